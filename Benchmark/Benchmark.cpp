@@ -0,0 +1,352 @@
+#include "Benchmark.h"
+#include "ProceduralVolume.h"
+#include "RenderSettingsFile.h"
+#ifdef VOLUMEVIZ_OPENCL
+#include "OpenCLVolumeRenderer.h"
+#endif
+#include "CPUVolumeRenderer.h"
+#include "TaskScheduler.h"
+
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSysInfo>
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+namespace
+{
+	QJsonObject toJson(const Benchmark::Statistics& statistics)
+	{
+		QJsonObject object;
+		object.insert("mean", statistics.mean);
+		object.insert("min", statistics.min);
+		object.insert("p50", statistics.p50);
+		object.insert("p90", statistics.p90);
+		object.insert("p95", statistics.p95);
+		object.insert("p99", statistics.p99);
+		object.insert("max", statistics.max);
+		return object;
+	}
+
+	// "256" or "256x256x128"
+	bool parseVolumeSize(const QString& text, glm::int3& size)
+	{
+		const auto values = text.split('x');
+		if (values.size() != 1 && values.size() != 3) return false;
+
+		for (int i = 0; i < 3; i++)
+			size[i] = values.value(values.size() == 1 ? 0 : i).toInt();
+		return size.x > 0 && size.y > 0 && size.z > 0;
+	}
+
+	double getElapsedMilliseconds(const QElapsedTimer& timer)
+	{
+		return (double)timer.nsecsElapsed() * 1e-6;
+	}
+}
+
+Benchmark::Statistics Benchmark::computeStatistics(std::vector<float> values)
+{
+	Statistics statistics;
+	if (values.empty()) return statistics;
+
+	std::sort(values.begin(), values.end());
+	auto percentile = [&](float p)
+	{
+		const size_t rank = (size_t)std::ceil(p / 100.0f * (float)values.size());
+		return values[std::min(std::max(rank, (size_t)1), values.size()) - 1];
+	};
+
+	double sum = 0.0;
+	for (float value : values)
+		sum += value;
+
+	statistics.mean = (float)(sum / (double)values.size());
+	statistics.min = values.front();
+	statistics.p50 = percentile(50.0f);
+	statistics.p90 = percentile(90.0f);
+	statistics.p95 = percentile(95.0f);
+	statistics.p99 = percentile(99.0f);
+	statistics.max = values.back();
+	return statistics;
+}
+
+QVector<OrbitCamera> Benchmark::createCameraPath(CameraPath path, int numFrames, const glm::vec3& volumeSize)
+{
+	QVector<OrbitCamera> cameras;
+
+	// the distance at which the bounding sphere of the volume fills the height of the view
+	OrbitCamera base;
+	base.angleX = 0.3f;
+	const float radius = 0.5f * glm::length(volumeSize);
+	const float fitDistance = radius / std::sin(glm::radians(base.fieldOfView) * 0.5f);
+
+	for (int i = 0; i < numFrames; i++)
+	{
+		const float t = numFrames > 1 ? (float)i / (float)(numFrames - 1) : 0.0f;
+		OrbitCamera camera = base;
+
+		switch (path)
+		{
+		case Orbit:
+			camera.zoom = fitDistance;
+			camera.angleY = 2.0f * 3.14159265f * (float)i / (float)numFrames;
+			break;
+		case Zoom:
+			// geometric, the apparent size grows at a constant rate, up to the center filling the view
+			camera.angleY = 0.6f;
+			camera.zoom = fitDistance * 1.5f * std::pow(0.4f / 1.5f, t);
+			break;
+		}
+		cameras.append(camera);
+	}
+	return cameras;
+}
+
+int Benchmark::run(const QStringList& arguments)
+{
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Benchmarks the rendering backends on procedural volumes, without a display");
+	parser.addHelpOption();
+	parser.addOptions({
+		{ "shape", "Procedural volume : spheres, noise or phantom.", "name", "phantom" },
+		{ "volume-size", "Volume size, N or XxYxZ voxels.", "size", "256" },
+		{ "sparsity", "Fraction of the volume left empty, in [0, 1].", "fraction", "0.7" },
+		{ "voxel-type", "Voxel type, uint8 or uint16.", "type", "uint8" },
+		{ "seed", "Seed of the procedural volume.", "seed", "1" },
+		{ "path", "Camera path, orbit or zoom.", "name", "orbit" },
+		{ "frames", "Frames measured.", "count", "120" },
+		{ "warmup", "Frames rendered before the measures.", "count", "5" },
+		{ "size", "Frame size.", "WxH", "1024x768" },
+		{ "backend", "Rendering backend, cpu or opencl (default : opencl when available).", "name" },
+		{ "step-size", "Sampling distance along the rays, in voxels.", "voxels", "1" },
+		{ "tf", "Transfer function JSON file, replaces the one of the shape.", "file" },
+		{ "tiles-per-frame", "OpenCL backend : marches the frames in tiles, this many per frame, 0 for all of them (default : a single dispatch).", "count" },
+		{ "output", "JSON results file (default : stdout).", "file" },
+		});
+	parser.process(arguments);
+
+	ProceduralVolume::Shape shape;
+	if (!ProceduralVolume::parseShape(parser.value("shape"), shape))
+	{
+		qDebug() << "Invalid shape" << parser.value("shape");
+		return 1;
+	}
+
+	glm::int3 volumeSize;
+	if (!parseVolumeSize(parser.value("volume-size"), volumeSize))
+	{
+		qDebug() << "Invalid volume size" << parser.value("volume-size");
+		return 1;
+	}
+
+	const QString voxelTypeName = parser.value("voxel-type");
+	if (voxelTypeName != "uint8" && voxelTypeName != "uint16")
+	{
+		qDebug() << "Invalid voxel type" << voxelTypeName;
+		return 1;
+	}
+	const VolumeData::VoxelType voxelType = voxelTypeName == "uint16" ? VolumeData::UInt16 : VolumeData::UInt8;
+
+	const QString pathName = parser.value("path");
+	if (pathName != "orbit" && pathName != "zoom")
+	{
+		qDebug() << "Invalid camera path" << pathName;
+		return 1;
+	}
+
+	const auto size = parser.value("size").split('x');
+	const int width = size.value(0).toInt();
+	const int height = size.value(1).toInt();
+	const int numFrames = parser.value("frames").toInt();
+	const int numWarmupFrames = std::max(parser.value("warmup").toInt(), 0);
+	if (width <= 0 || height <= 0 || numFrames <= 0)
+	{
+		qDebug() << "Invalid frame size or count" << parser.value("size") << parser.value("frames");
+		return 1;
+	}
+
+	const float sparsity = glm::clamp(parser.value("sparsity").toFloat(), 0.0f, 1.0f);
+	const unsigned int seed = parser.value("seed").toUInt();
+
+	TransferFunction transferFunction = ProceduralVolume::getTransferFunction(shape);
+	if (parser.isSet("tf") && !RenderSettingsFile::loadTransferFunction(parser.value("tf"), transferFunction))
+	{
+		qDebug() << "Invalid transfer function" << parser.value("tf");
+		return 1;
+	}
+
+	const QString backend = parser.value("backend");
+	if (!backend.isEmpty() && backend != "cpu" && backend != "opencl")
+	{
+		qDebug() << "Invalid backend" << backend;
+		return 1;
+	}
+#ifdef VOLUMEVIZ_OPENCL
+	// picked by default on a GPU only, as the viewer does, a CPU runtime when asked for
+	const bool opencl = backend == "opencl" || (backend.isEmpty() && OpenCLVolumeRenderer::isAvailable());
+	if (opencl && !OpenCLVolumeRenderer::isAvailable(true))
+	{
+		qDebug() << "No OpenCL device available";
+		return 1;
+	}
+#else
+	const bool opencl = false;
+	if (backend == "opencl")
+	{
+		qDebug() << "Built without the OpenCL backend (qmake CONFIG+=opencl)";
+		return 1;
+	}
+#endif
+
+	// -1 for the single dispatch
+	const int tilesPerFrame = parser.isSet("tiles-per-frame") ? parser.value("tiles-per-frame").toInt() : -1;
+	if (parser.isSet("tiles-per-frame") && (!opencl || tilesPerFrame < 0))
+	{
+		qDebug() << "Invalid tiles per frame, or not the OpenCL backend" << parser.value("tiles-per-frame");
+		return 1;
+	}
+
+	// volume, prepared as the loaders do
+	QElapsedTimer timer;
+	timer.start();
+
+	VolumeData* volumeData = ProceduralVolume::create(shape, volumeSize, voxelType, sparsity, seed);
+	volumeData->computeHistogram();
+	volumeData->buildMipLevels();
+	const double generationTime = getElapsedMilliseconds(timer);
+
+	// renderer
+	AbstractVolumeRenderer* volumeRenderer = nullptr;
+#ifdef VOLUMEVIZ_OPENCL
+	if (opencl)
+		volumeRenderer = new OpenCLVolumeRenderer();
+	else
+#endif
+		volumeRenderer = new CPUVolumeRenderer();
+
+	timer.restart();
+	volumeRenderer->setHeadless(true);
+	volumeRenderer->init();
+	volumeRenderer->setViewport(0, 0, width, height);
+#ifdef VOLUMEVIZ_OPENCL
+	if (tilesPerFrame >= 0)
+		static_cast<OpenCLVolumeRenderer*>(volumeRenderer)->setTiledDispatch(true, tilesPerFrame);
+#endif
+	volumeRenderer->setStepSize(parser.value("step-size").toFloat());
+	volumeRenderer->setVolumeData(volumeData);
+	volumeRenderer->setTransferFunction(transferFunction);
+	volumeRenderer->setRenderingStatus(true);
+	volumeRenderer->setTimingsEnabled(true);
+	const double setupTime = getElapsedMilliseconds(timer);
+
+	// frames, each one rendered from scratch and waited for
+	const QVector<OrbitCamera> cameras = createCameraPath(pathName == "zoom" ? Zoom : Orbit, numFrames, glm::vec3(volumeSize));
+	const float aspectRatio = (float)width / (float)height;
+
+	auto renderFrame = [&](const OrbitCamera& camera)
+	{
+		camera.apply(volumeRenderer, aspectRatio);
+		volumeRenderer->requestBuffersUpdate();
+		volumeRenderer->render();
+		volumeRenderer->finishFrame();
+	};
+
+	for (int i = 0; i < numWarmupFrames; i++)
+		renderFrame(cameras[i % cameras.size()]);
+
+	std::vector<float> frameTimes, rayMarchingTimes, occlusionTimes, postProcessingTimes, interopTimes, hostTimes;
+	QElapsedTimer frameTimer;
+	timer.restart();
+
+	for (const OrbitCamera& camera : cameras)
+	{
+		frameTimer.start();
+		renderFrame(camera);
+		frameTimes.push_back((float)getElapsedMilliseconds(frameTimer));
+
+		const AbstractVolumeRenderer::FrameTimings timings = volumeRenderer->getTimings();
+		rayMarchingTimes.push_back(timings.rayMarching);
+		occlusionTimes.push_back(timings.occlusion);
+		postProcessingTimes.push_back(timings.postProcessing);
+		interopTimes.push_back(timings.interop);
+		hostTimes.push_back(timings.host);
+	}
+
+	const double totalTime = getElapsedMilliseconds(timer) * 1e-3;
+
+	// results
+	QJsonObject configuration;
+	configuration.insert("shape", ProceduralVolume::getShapeName(shape));
+	configuration.insert("volumeSize", QJsonArray({ volumeSize.x, volumeSize.y, volumeSize.z }));
+	configuration.insert("voxelType", voxelTypeName);
+	configuration.insert("sparsity", sparsity);
+	configuration.insert("emptyFraction", ProceduralVolume::getEmptyFraction(volumeData));
+	configuration.insert("seed", (qint64)seed);
+	configuration.insert("path", pathName);
+	configuration.insert("frames", numFrames);
+	configuration.insert("warmup", numWarmupFrames);
+	configuration.insert("width", width);
+	configuration.insert("height", height);
+	configuration.insert("backend", opencl ? "opencl" : "cpu");
+	configuration.insert("stepSize", volumeRenderer->getStepSize());
+	configuration.insert("tilesPerFrame", tilesPerFrame);
+	configuration.insert("transferFunction", parser.isSet("tf") ? parser.value("tf") : "procedural");
+
+	QJsonObject system;
+	system.insert("os", QSysInfo::prettyProductName());
+	system.insert("cpu", QSysInfo::currentCpuArchitecture());
+	system.insert("hardwareThreads", (int)std::thread::hardware_concurrency());
+	system.insert("workers", (int)TaskScheduler::getInstance().getNumWorkers());
+
+	// the device times stay 0 for the CPU backend
+	QJsonObject passes;
+	passes.insert("rayMarching", toJson(computeStatistics(rayMarchingTimes)));
+	passes.insert("occlusion", toJson(computeStatistics(occlusionTimes)));
+	passes.insert("postProcessing", toJson(computeStatistics(postProcessingTimes)));
+	passes.insert("interop", toJson(computeStatistics(interopTimes)));
+	passes.insert("host", toJson(computeStatistics(hostTimes)));
+
+	QJsonArray frameTimesArray;
+	for (float frameTime : frameTimes)
+		frameTimesArray.append(frameTime);
+
+	// the times are in milliseconds, but totalTime in seconds
+	QJsonObject results;
+	results.insert("configuration", configuration);
+	results.insert("system", system);
+	results.insert("generationTime", generationTime);
+	results.insert("setupTime", setupTime);
+	results.insert("totalTime", totalTime);
+	results.insert("fps", totalTime > 0.0 ? numFrames / totalTime : 0.0);
+	results.insert("frameTime", toJson(computeStatistics(frameTimes)));
+	results.insert("passes", passes);
+	results.insert("frameTimes", frameTimesArray);
+
+	volumeRenderer->cleanup();
+	delete volumeRenderer;
+	delete volumeData;
+
+	const QByteArray json = QJsonDocument(results).toJson(QJsonDocument::Indented);
+	if (!parser.isSet("output"))
+	{
+		fwrite(json.constData(), 1, json.size(), stdout);
+		return 0;
+	}
+
+	QFile file(parser.value("output"));
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size())
+	{
+		qDebug() << "Cannot write the results to" << parser.value("output");
+		return 1;
+	}
+	return 0;
+}
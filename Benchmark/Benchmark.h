@@ -0,0 +1,36 @@
+#pragma once
+
+#include "OrbitCamera.h"
+#include <QStringList>
+#include <QVector>
+#include <vector>
+
+// Renders a procedural volume along a scripted camera path, headless, and reports the frame rate,
+// the per-pass times and the frame time percentiles as JSON (stdout, or --output) :
+// VolumeVizBenchmark [--shape spheres|noise|phantom] [--volume-size 256 or XxYxZ] [--sparsity 0.7]
+//                    [--voxel-type uint8|uint16] [--path orbit|zoom] [--frames 120] [--warmup 5]
+//                    [--size 1024x768] [--backend cpu|opencl] [--step-size 1] [--seed 1] [--tf tf.json]
+//                    [--tiles-per-frame N] [--output results.json]
+class Benchmark
+{
+public:
+	enum CameraPath
+	{
+		Orbit, // a revolution around the Y axis, the volume filling the view
+		Zoom // from the whole volume to a close up of its center, at a fixed angle
+	};
+
+	struct Statistics
+	{
+		float mean = 0.0f, min = 0.0f, p50 = 0.0f, p90 = 0.0f, p95 = 0.0f, p99 = 0.0f, max = 0.0f;
+	};
+
+	// nearest rank percentiles
+	static Statistics computeStatistics(std::vector<float> values);
+
+	// the cameras of the path, framing a volume of the given size (in voxels of unit spacing)
+	static QVector<OrbitCamera> createCameraPath(CameraPath path, int numFrames, const glm::vec3& volumeSize);
+
+	// returns the process exit code
+	static int run(const QStringList& arguments);
+};
@@ -0,0 +1,340 @@
+#include "ProceduralVolume.h"
+#include "TaskScheduler.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace
+{
+	// fills the z slice of the volume with densities in [0, 1], 0 being empty
+	using SliceFunction = std::function<void(int z, float* slice)>;
+
+	template <typename T>
+	void fillVolume(VolumeData* vdata, const SliceFunction& function)
+	{
+		const glm::int3 n = vdata->_nxyz;
+		const float scale = std::numeric_limits<T>::is_integer ? (float)std::numeric_limits<T>::max() : 1.0f;
+		const float rounding = std::numeric_limits<T>::is_integer ? 0.5f : 0.0f;
+
+		TaskScheduler::getInstance().parallelFor(n.z, [&](size_t z, unsigned int)
+			{
+				std::vector<float> slice((size_t)n.x * n.y);
+				function((int)z, slice.data());
+
+				T* dst = vdata->getVoxels<T>() + slice.size() * z;
+				for (size_t i = 0; i < slice.size(); i++)
+					dst[i] = (T)(glm::clamp(slice[i], 0.0f, 1.0f) * scale + rounding);
+			});
+	}
+
+	// lattice values in [0, 1)
+	inline float hash(int x, int y, int z, unsigned int seed)
+	{
+		unsigned int h = seed ^ ((unsigned int)x * 0x8da6b343u) ^ ((unsigned int)y * 0xd8163841u) ^ ((unsigned int)z * 0xcb1ab31fu);
+		h ^= h >> 16;
+		h *= 0x7feb352du;
+		h ^= h >> 15;
+		h *= 0x846ca68bu;
+		h ^= h >> 16;
+		return (float)(h >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// smooth trilinear interpolation of the lattice values
+	float valueNoise(const glm::vec3& p, unsigned int seed)
+	{
+		const glm::vec3 cell = glm::floor(p);
+		const glm::vec3 t = p - cell;
+		const glm::vec3 w = t * t * (3.0f - 2.0f * t);
+		const int x = (int)cell.x, y = (int)cell.y, z = (int)cell.z;
+
+		const float c00 = glm::mix(hash(x, y, z, seed), hash(x + 1, y, z, seed), w.x);
+		const float c10 = glm::mix(hash(x, y + 1, z, seed), hash(x + 1, y + 1, z, seed), w.x);
+		const float c01 = glm::mix(hash(x, y, z + 1, seed), hash(x + 1, y, z + 1, seed), w.x);
+		const float c11 = glm::mix(hash(x, y + 1, z + 1, seed), hash(x + 1, y + 1, z + 1, seed), w.x);
+		return glm::mix(glm::mix(c00, c10, w.y), glm::mix(c01, c11, w.y), w.z);
+	}
+
+	// 4 octaves, in [0, 1)
+	float fractalNoise(const glm::vec3& p, unsigned int seed)
+	{
+		float value = 0.0f, amplitude = 0.5f, frequency = 1.0f, sum = 0.0f;
+		for (int octave = 0; octave < 4; octave++)
+		{
+			value += amplitude * valueNoise(p * frequency, seed + octave);
+			sum += amplitude;
+			amplitude *= 0.5f;
+			frequency *= 2.0f;
+		}
+		return value / sum;
+	}
+
+	struct Sphere
+	{
+		glm::vec3 center;
+		float radius, density;
+	};
+
+	SliceFunction makeSpheres(const glm::int3& n, float sparsity, unsigned int seed)
+	{
+		// random placements leave exp(-total / volume) of it empty
+		const double volume = (double)n.x * n.y * n.z;
+		const double total = -std::log(std::max(sparsity, 0.01f)) * volume;
+		const float minSize = (float)std::min(n.x, std::min(n.y, n.z));
+
+		std::mt19937 random(seed);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		auto spheres = std::make_shared<std::vector<Sphere>>();
+		double placed = 0.0;
+
+		while (sparsity < 1.0f && placed < total && spheres->size() < 1000000)
+		{
+			Sphere sphere;
+			sphere.center = glm::vec3(uniform(random), uniform(random), uniform(random)) * glm::vec3(n);
+			sphere.radius = std::max(minSize * (0.04f + 0.08f * uniform(random)), 1.5f);
+			sphere.density = 0.3f + 0.7f * uniform(random);
+			spheres->push_back(sphere);
+			placed += 4.0 / 3.0 * 3.14159265 * std::pow((double)sphere.radius, 3.0);
+		}
+
+		return [n, spheres](int z, float* slice)
+		{
+			std::fill(slice, slice + (size_t)n.x * n.y, 0.0f);
+			const float pz = (float)z + 0.5f;
+
+			// the disc of every sphere crossing the slice, the densest one wins
+			for (const Sphere& sphere : *spheres)
+			{
+				const float dz = pz - sphere.center.z;
+				const float discRadius2 = sphere.radius * sphere.radius - dz * dz;
+				if (discRadius2 <= 0.0f) continue;
+
+				const float discRadius = std::sqrt(discRadius2);
+				const int y0 = std::max((int)(sphere.center.y - discRadius), 0), y1 = std::min((int)(sphere.center.y + discRadius) + 1, n.y);
+				const int x0 = std::max((int)(sphere.center.x - discRadius), 0), x1 = std::min((int)(sphere.center.x + discRadius) + 1, n.x);
+
+				for (int y = y0; y < y1; y++)
+				{
+					const float dy = (float)y + 0.5f - sphere.center.y;
+					for (int x = x0; x < x1; x++)
+					{
+						const float dx = (float)x + 0.5f - sphere.center.x;
+						const float d2 = dx * dx + dy * dy + dz * dz;
+						if (d2 >= sphere.radius * sphere.radius) continue;
+
+						float& value = slice[(size_t)y * n.x + x];
+						value = std::max(value, sphere.density * (1.0f - 0.5f * d2 / (sphere.radius * sphere.radius)));
+					}
+				}
+			}
+		};
+	}
+
+	SliceFunction makeNoise(const glm::int3& n, float sparsity, unsigned int seed)
+	{
+		// 8 lattice cells across the largest side
+		const float frequency = 8.0f / (float)std::max(n.x, std::max(n.y, n.z));
+
+		// the values under the sparsity quantile are cut, the quantile is estimated from random samples
+		std::mt19937 random(seed);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		std::vector<float> samples(1 << 16);
+		for (float& sample : samples)
+			sample = fractalNoise(glm::vec3(uniform(random), uniform(random), uniform(random)) * glm::vec3(n) * frequency, seed);
+		std::sort(samples.begin(), samples.end());
+
+		const float threshold = sparsity <= 0.0f ? -1.0f : samples[std::min((size_t)(sparsity * samples.size()), samples.size() - 1)];
+
+		return [n, frequency, threshold, seed](int z, float* slice)
+		{
+			for (int y = 0; y < n.y; y++)
+			{
+				for (int x = 0; x < n.x; x++)
+				{
+					const float value = fractalNoise(glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f) * frequency, seed);
+					// the values kept are never rounded to 0
+					slice[(size_t)y * n.x + x] = value < threshold ? 0.0f : 0.05f + 0.95f * (value - threshold) / (1.0f - threshold);
+				}
+			}
+		};
+	}
+
+	struct Ellipsoid
+	{
+		glm::vec3 radii, center;
+		float angle; // around z, in degrees
+		float density; // added to the ellipsoids it is in
+	};
+
+	// Shepp-Logan 3D (Kak & Slaney) with the densities of the modified 2D phantom (Toft), in [-1, 1]^3
+	const Ellipsoid PhantomEllipsoids[] = {
+		{ { 0.69f, 0.92f, 0.9f }, { 0.0f, 0.0f, 0.0f }, 0.0f, 1.0f },
+		{ { 0.6624f, 0.874f, 0.88f }, { 0.0f, -0.0184f, 0.0f }, 0.0f, -0.8f },
+		{ { 0.41f, 0.16f, 0.21f }, { -0.22f, 0.0f, -0.25f }, 108.0f, -0.2f },
+		{ { 0.31f, 0.11f, 0.22f }, { 0.22f, 0.0f, -0.25f }, 72.0f, -0.2f },
+		{ { 0.21f, 0.25f, 0.5f }, { 0.0f, 0.35f, -0.25f }, 0.0f, 0.1f },
+		{ { 0.046f, 0.046f, 0.046f }, { 0.0f, 0.1f, -0.25f }, 0.0f, 0.1f },
+		{ { 0.046f, 0.023f, 0.02f }, { -0.08f, -0.65f, -0.25f }, 0.0f, 0.1f },
+		{ { 0.046f, 0.023f, 0.02f }, { 0.06f, -0.65f, -0.25f }, 90.0f, 0.1f },
+		{ { 0.056f, 0.04f, 0.1f }, { 0.06f, -0.105f, 0.625f }, 90.0f, 0.1f },
+		{ { 0.056f, 0.056f, 0.1f }, { 0.0f, 0.1f, 0.625f }, 0.0f, 0.1f },
+	};
+
+	bool isInside(const Ellipsoid& ellipsoid, const glm::vec3& p)
+	{
+		const glm::vec3 d = p - ellipsoid.center;
+		const float angle = glm::radians(ellipsoid.angle);
+		const float c = std::cos(angle), s = std::sin(angle);
+		const glm::vec3 local = glm::vec3(c * d.x + s * d.y, -s * d.x + c * d.y, d.z) / ellipsoid.radii;
+		return glm::dot(local, local) <= 1.0f;
+	}
+
+	SliceFunction makePhantom(const glm::int3& n, float sparsity, unsigned int seed)
+	{
+		// the head covers 4/3 pi 0.69 0.92 0.9 / 8 of [-1, 1]^3 at scale 1
+		const float headFraction = 0.2991f;
+		const float scale = glm::clamp(std::cbrt((1.0f - sparsity) / headFraction), 0.05f, 1.0f / 0.92f);
+
+		return [n, scale, seed](int z, float* slice)
+		{
+			for (int y = 0; y < n.y; y++)
+			{
+				for (int x = 0; x < n.x; x++)
+				{
+					const glm::vec3 voxel(x + 0.5f, y + 0.5f, z + 0.5f);
+					const glm::vec3 p = (voxel / glm::vec3(n) * 2.0f - 1.0f) / scale;
+
+					float value = 0.0f;
+					if (isInside(PhantomEllipsoids[0], p))
+					{
+						for (const Ellipsoid& ellipsoid : PhantomEllipsoids)
+						{
+							if (isInside(ellipsoid, p))
+								value += ellipsoid.density;
+						}
+
+						// the tissues are never uniform, nor empty
+						value = std::max(value, 0.02f) + 0.03f * (valueNoise(p * 40.0f, seed) - 0.5f);
+						value = std::max(value, 0.01f);
+					}
+					slice[(size_t)y * n.x + x] = value;
+				}
+			}
+		};
+	}
+}
+
+bool ProceduralVolume::parseShape(const QString& name, Shape& shape)
+{
+	for (Shape candidate : { Spheres, Noise, Phantom })
+	{
+		if (name == getShapeName(candidate))
+		{
+			shape = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+QString ProceduralVolume::getShapeName(Shape shape)
+{
+	switch (shape)
+	{
+	case Spheres: return "spheres";
+	case Noise: return "noise";
+	case Phantom: return "phantom";
+	}
+	return QString();
+}
+
+VolumeData* ProceduralVolume::create(Shape shape, const glm::int3& size, VolumeData::VoxelType voxelType, float sparsity, unsigned int seed)
+{
+	TRACE_SCOPE("ProceduralVolume::create");
+	sparsity = glm::clamp(sparsity, 0.0f, 1.0f);
+
+	SliceFunction function;
+	switch (shape)
+	{
+	case Spheres: function = makeSpheres(size, sparsity, seed); break;
+	case Noise: function = makeNoise(size, sparsity, seed); break;
+	case Phantom: function = makePhantom(size, sparsity, seed); break;
+	}
+
+	auto vdata = new VolumeData;
+	vdata->init(size.x, size.y, size.z, 1.0f, 1.0f, 1.0f, voxelType);
+
+	switch (voxelType)
+	{
+	case VolumeData::UInt8: fillVolume<unsigned char>(vdata, function); break;
+	case VolumeData::UInt16: fillVolume<unsigned short>(vdata, function); break;
+	case VolumeData::Float32: fillVolume<float>(vdata, function); break;
+	}
+	return vdata;
+}
+
+TransferFunction ProceduralVolume::getTransferFunction(Shape shape)
+{
+	// value and opacity per voxel, the values being normalized to the range of the volume
+	TransferFunction transferFunction;
+	auto add = [&](float value, float opacity, const QColor& color)
+	{
+		transferFunction.append(qMakePair(QPointF(value, opacity), color));
+	};
+
+	switch (shape)
+	{
+	case Spheres:
+		add(0.0f, 0.0f, QColor(0, 0, 0));
+		add(0.1f, 0.0f, QColor(40, 80, 200));
+		add(0.2f, 0.02f, QColor(40, 80, 200));
+		add(0.6f, 0.1f, QColor(230, 140, 40));
+		add(1.0f, 0.6f, QColor(255, 255, 255));
+		break;
+	case Noise:
+		add(0.0f, 0.0f, QColor(0, 0, 0));
+		add(0.05f, 0.0f, QColor(60, 160, 80));
+		add(0.3f, 0.02f, QColor(60, 160, 80));
+		add(0.7f, 0.2f, QColor(220, 200, 80));
+		add(1.0f, 0.8f, QColor(255, 255, 255));
+		break;
+	case Phantom:
+		add(0.0f, 0.0f, QColor(0, 0, 0));
+		add(0.1f, 0.0f, QColor(190, 90, 70));
+		add(0.2f, 0.03f, QColor(190, 90, 70));
+		add(0.3f, 0.3f, QColor(255, 210, 60));
+		add(0.4f, 0.02f, QColor(190, 90, 70));
+		add(0.9f, 0.1f, QColor(225, 225, 225));
+		add(1.0f, 0.5f, QColor(255, 255, 255));
+		break;
+	}
+	return transferFunction;
+}
+
+float ProceduralVolume::getEmptyFraction(const VolumeData* vdata)
+{
+	const glm::int3 n = vdata->_nxyz;
+	const size_t sliceSize = (size_t)n.x * n.y;
+	const size_t voxelSize = vdata->getVoxelSize();
+	std::atomic<size_t> numEmpty(0);
+
+	TaskScheduler::getInstance().parallelFor(n.z, [&](size_t z, unsigned int)
+		{
+			const VolumeData::DataType* slice = vdata->_data + sliceSize * voxelSize * z;
+			size_t count = 0;
+			for (size_t i = 0; i < sliceSize; i++)
+			{
+				bool empty = true;
+				for (size_t b = 0; b < voxelSize && empty; b++)
+					empty = slice[i * voxelSize + b] == 0;
+				count += empty;
+			}
+			numEmpty += count;
+		});
+
+	return (float)numEmpty / (float)(sliceSize * n.z);
+}
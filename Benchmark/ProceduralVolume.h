@@ -0,0 +1,33 @@
+#pragma once
+
+#include "AbstractVolumeRenderer.h"
+#include "VolumeData.h"
+#include <QString>
+
+// Synthetic volumes for the benchmarks, the same seed gives the same voxels.
+// sparsity is the fraction of the voxels left empty (0), approximately : getEmptyFraction measures it.
+//  - Spheres : random solid spheres with a brighter core, as many as leave sparsity of the volume empty on average
+//  - Noise : 4 octaves of value noise, the lowest values cut to 0
+//  - Phantom : the modified Shepp-Logan head phantom (skull, brain, ventricles, small features) and a faint texture,
+//    scaled so the head covers 1 - sparsity of the volume, 38% at most
+class ProceduralVolume
+{
+public:
+	enum Shape
+	{
+		Spheres,
+		Noise,
+		Phantom
+	};
+
+	static bool parseShape(const QString& name, Shape& shape);
+	static QString getShapeName(Shape shape);
+
+	// a linear, single level volume of unit spacing, without its histogram
+	static VolumeData* create(Shape shape, const glm::int3& size, VolumeData::VoxelType voxelType, float sparsity, unsigned int seed);
+
+	// the transfer function the benchmarks render the shape with
+	static TransferFunction getTransferFunction(Shape shape);
+
+	static float getEmptyFraction(const VolumeData* vdata);
+};
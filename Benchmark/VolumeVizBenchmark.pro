@@ -0,0 +1,57 @@
+# ----------------------------------------------------
+# Headless benchmark of the rendering backends,
+# built from the sources of VolumeViz without its widgets.
+# ------------------------------------------------------
+
+TEMPLATE = app
+TARGET = VolumeVizBenchmark
+DESTDIR = ../x64/Release
+QT += core gui
+QT -= widgets
+CONFIG += release console c++17
+INCLUDEPATH += . \
+    ../VolumeViz \
+    ../VolumeViz/thirdparty
+# the CPU backend uploads its frames to an OpenGL texture when it has one
+win32:LIBS += -L"../VolumeViz/thirdparty" \
+    -lOpenGL32
+unix:LIBS += -lGL
+DEPENDPATH += .
+OBJECTS_DIR += release
+
+HEADERS += ./Benchmark.h \
+    ./ProceduralVolume.h \
+    ../VolumeViz/AbstractVolumeRenderer.h \
+    ../VolumeViz/CPUVolumeRenderer.h \
+    ../VolumeViz/VolumeData.h \
+    ../VolumeViz/StreamedVolumeData.h \
+    ../VolumeViz/MappedVolumeData.h \
+    ../VolumeViz/VolumeDataLoader.h \
+    ../VolumeViz/TaskScheduler.h \
+    ../VolumeViz/Tracer.h \
+    ../VolumeViz/OrbitCamera.h \
+    ../VolumeViz/RenderSettingsFile.h
+SOURCES += ./main.cpp \
+    ./Benchmark.cpp \
+    ./ProceduralVolume.cpp \
+    ../VolumeViz/AbstractVolumeRenderer.cpp \
+    ../VolumeViz/CPUVolumeRenderer.cpp \
+    ../VolumeViz/VolumeData.cpp \
+    ../VolumeViz/StreamedVolumeData.cpp \
+    ../VolumeViz/MappedVolumeData.cpp \
+    ../VolumeViz/VolumeDataLoader.cpp \
+    ../VolumeViz/TaskScheduler.cpp \
+    ../VolumeViz/Tracer.cpp \
+    ../VolumeViz/OrbitCamera.cpp \
+    ../VolumeViz/RenderSettingsFile.cpp
+
+# The OpenCL backend is built with qmake CONFIG+=opencl, the benchmark is otherwise CPU only
+opencl {
+    DEFINES += VOLUMEVIZ_OPENCL
+    HEADERS += ../VolumeViz/OpenCLVolumeRenderer.h \
+        ../VolumeViz/OpenCLBrickCache.h
+    SOURCES += ../VolumeViz/OpenCLVolumeRenderer.cpp \
+        ../VolumeViz/OpenCLBrickCache.cpp
+    win32:LIBS += -lcl/OpenCL
+    unix:LIBS += -lOpenCL
+}
@@ -0,0 +1,20 @@
+#include "Benchmark.h"
+#include "Tracer.h"
+#include <QCoreApplication>
+
+int main(int argc, char *argv[])
+{
+	// headless, no display connection is needed
+	QCoreApplication a(argc, argv);
+
+	// VOLUMEVIZ_TRACE=file records the run, the trace is written at exit
+	const QString tracePath = QString::fromLocal8Bit(qgetenv("VOLUMEVIZ_TRACE"));
+	if (!tracePath.isEmpty())
+		Tracer::getInstance().start();
+
+	const int exitCode = Benchmark::run(a.arguments());
+
+	if (Tracer::getInstance().isRecording())
+		Tracer::getInstance().stop(tracePath);
+	return exitCode;
+}
@@ -0,0 +1,345 @@
+#include "LargeVolumeTests.h"
+#include "BasicVolumeDataLoader.h"
+#include "MappedVolumeData.h"
+#include "StreamedVolumeData.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#include <limits>
+#include <vector>
+
+namespace
+{
+	const glm::int3 VolumeSize(2047, 2049, 1040); // neither the rows nor the slices are a multiple of the bricks
+	const size_t NumVoxels = (size_t)VolumeSize.x * VolumeSize.y * VolumeSize.z; // 4 362 075 120, past 2^32
+	const size_t StreamedCacheBudget = (size_t)256 << 20;
+
+	// a patterned block across the brick borders along the three axes, at the far end of the volume
+	const glm::int3 BlockOrigin(1990, 1995, 1000);
+	const glm::int3 BlockSize(48, 40, 40);
+	// the block and the background around it, within the volume
+	const glm::int3 BoxOrigin = BlockOrigin - 4;
+	const glm::int3 BoxSize = glm::min(BlockSize + 8, VolumeSize - BoxOrigin);
+
+	// never 0 (the background) nor 255 (the last voxel)
+	unsigned char blockValue(int x, int y, int z)
+	{
+		return (unsigned char)(1 + (x * 7 + y * 13 + z * 3) % 254);
+	}
+
+	struct Marker
+	{
+		glm::int3 position;
+		unsigned char value;
+	};
+
+	const Marker Markers[] = {
+		{ glm::int3(0, 0, 0), 10 },
+		{ glm::int3(5, 1, 512), 20 }, // linear offset past 2^31
+		{ glm::int3(100, 2000, 1024), 30 }, // linear offset past 2^32
+		{ VolumeSize - 1, 255 }
+	};
+
+	qint64 getLinearOffset(const glm::int3& p)
+	{
+		return ((qint64)p.z * VolumeSize.y + p.y) * VolumeSize.x + p.x;
+	}
+
+	unsigned char getExpectedVoxel(const glm::int3& p)
+	{
+		if (glm::all(glm::greaterThanEqual(p, BlockOrigin)) && glm::all(glm::lessThan(p, BlockOrigin + BlockSize)))
+			return blockValue(p.x, p.y, p.z);
+
+		for (const auto& marker : Markers)
+		{
+			if (marker.position == p)
+				return marker.value;
+		}
+		return 0;
+	}
+
+	// count of every value in the whole volume
+	std::vector<unsigned long long> getExpectedCounts()
+	{
+		std::vector<unsigned long long> counts(256, 0);
+		for (int z = 0; z < BlockSize.z; z++)
+		{
+			for (int y = 0; y < BlockSize.y; y++)
+			{
+				for (int x = 0; x < BlockSize.x; x++)
+					counts[blockValue(BlockOrigin.x + x, BlockOrigin.y + y, BlockOrigin.z + z)]++;
+			}
+		}
+
+		for (const auto& marker : Markers)
+			counts[marker.value]++;
+
+		unsigned long long numMarked = 0;
+		for (int v = 1; v < 256; v++)
+			numMarked += counts[v];
+		counts[0] = NumVoxels - numMarked;
+		return counts;
+	}
+
+	// the file is extended with a hole, only the block and the markers are written
+	bool writeSparseVolume(const QString& filePath)
+	{
+		QFile file(filePath);
+		if (!file.open(QIODevice::WriteOnly) || !file.resize((qint64)NumVoxels))
+			return false;
+
+		bool written = true;
+		std::vector<char> row(BlockSize.x);
+		for (int z = 0; z < BlockSize.z; z++)
+		{
+			for (int y = 0; y < BlockSize.y; y++)
+			{
+				for (int x = 0; x < BlockSize.x; x++)
+					row[x] = (char)blockValue(BlockOrigin.x + x, BlockOrigin.y + y, BlockOrigin.z + z);
+
+				written &= file.seek(getLinearOffset(BlockOrigin + glm::int3(0, y, z)));
+				written &= file.write(row.data(), row.size()) == (qint64)row.size();
+			}
+		}
+
+		for (const auto& marker : Markers)
+		{
+			written &= file.seek(getLinearOffset(marker.position));
+			written &= file.write((const char*)&marker.value, 1) == 1;
+		}
+
+		file.close();
+		return written;
+	}
+}
+
+LargeVolumeTests::LargeVolumeTests(const QString& directory) : _directory(directory)
+{
+	_sourcePath = QDir(_directory).absoluteFilePath("source.raw");
+	_storePath = QDir(_directory).absoluteFilePath("store");
+}
+
+int LargeVolumeTests::run(const QStringList& arguments)
+{
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Checks the volumes past 2^31 voxels on a sparse file and its bricked store");
+	parser.addHelpOption();
+	parser.addOptions({
+		{ "dir", "Scratch directory, 5 GB of free space are needed.", "dir", QDir::tempPath() },
+		});
+	parser.process(arguments);
+
+	LargeVolumeTests tests(QDir(parser.value("dir")).absoluteFilePath("VolumeVizLargeVolumeTests"));
+
+	// the leftovers of an interrupted run are replaced
+	QDir directory(tests._directory);
+	directory.removeRecursively();
+	if (!QDir().mkpath(tests._directory) || !writeSparseVolume(tests._sourcePath))
+	{
+		qDebug() << "Cannot write the sparse volume in" << tests._directory;
+		directory.removeRecursively();
+		return 1;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	tests.testSource();
+	qDebug() << "Source checked in" << timer.restart() / 1000.0 << "s";
+	tests.testMappedStore();
+	qDebug() << "Mapped store checked in" << timer.restart() / 1000.0 << "s";
+	tests.testStreamedStore();
+	qDebug() << "Streamed store checked in" << timer.restart() / 1000.0 << "s";
+
+	directory.removeRecursively();
+
+	qDebug() << tests._numFailures << "failed checks";
+	return tests._numFailures;
+}
+
+void LargeVolumeTests::testSource()
+{
+	MappedVolumeData source;
+	check(source.map(_sourcePath, 0, VolumeSize.x, VolumeSize.y, VolumeSize.z, 1.0f, 1.0f, 1.0f, VolumeData::UInt8), "source mapped");
+	if (!source.isMapped()) return;
+
+	check(source.getNumVoxels() == NumVoxels && source.getDataSize() == NumVoxels, "source size");
+	checkMarkers(&source, "source");
+	checkBox(&source, BoxOrigin, BoxSize, "source");
+	checkBox(&source, VolumeSize - 2, glm::int3(2), "source");
+
+	source.computeHistogram(256);
+	checkHistogram(&source, "source");
+
+	// written with its histogram, the pyramid is read back from the store through a cache
+	BasicVolumeDataLoader saver;
+	saver.setCacheBudget(StreamedCacheBudget);
+	check(saver.saveToBrickedBinFormat(&source, _storePath), "store written");
+}
+
+void LargeVolumeTests::testMappedStore()
+{
+	// no level is large enough to be streamed, all of them are mapped
+	BasicVolumeDataLoader loader;
+	loader.setMemoryMapping(true);
+	loader.setCacheBudget(std::numeric_limits<size_t>::max());
+
+	VolumeData* vdata = loader.load(_storePath);
+	check(vdata != nullptr, "mapped store loaded");
+	if (vdata == nullptr) return;
+
+	check(vdata->isMapped() && vdata->_layout == VolumeData::Bricked, "mapped store bricked");
+	check(vdata->_nxyz == VolumeSize && vdata->getNumVoxels() == NumVoxels, "mapped store size");
+	check(vdata->getNumLevels() > 1 && vdata->getLevel(1)->_nxyz == (VolumeSize + 1) / 2, "mapped store pyramid");
+	checkMarkers(vdata, "mapped store");
+	checkBox(vdata, BoxOrigin, BoxSize, "mapped store");
+	checkHistogram(vdata, "mapped store");
+	checkMinMaxGrid(vdata, "mapped store");
+
+	delete vdata;
+}
+
+void LargeVolumeTests::testStreamedStore()
+{
+	BasicVolumeDataLoader loader;
+	loader.setCacheBudget(StreamedCacheBudget);
+
+	VolumeData* vdata = loader.load(_storePath);
+	check(vdata != nullptr, "streamed store loaded");
+	if (vdata == nullptr) return;
+
+	check(vdata->isStreamed() && vdata->getNumVoxels() == NumVoxels, "streamed store");
+	checkMarkers(vdata, "streamed store");
+	checkBox(vdata, BoxOrigin, BoxSize, "streamed store");
+	checkHistogram(vdata, "streamed store");
+	checkMinMaxGrid(vdata, "streamed store");
+
+	// the same statistics from the bricks, streamed within the budget
+	vdata->computeHistogram(256);
+	checkHistogram(vdata, "streamed store recomputed");
+
+	delete vdata;
+}
+
+void LargeVolumeTests::check(bool condition, const QString& what)
+{
+	if (!condition)
+	{
+		qDebug().noquote() << "FAILED" << what;
+		_numFailures++;
+	}
+}
+
+void LargeVolumeTests::checkMarkers(const VolumeData* vdata, const QString& name)
+{
+	for (const auto& marker : Markers)
+	{
+		const glm::int3 p = marker.position;
+		const QString what = QString("%1 voxel (%2, %3, %4)").arg(name).arg(p.x).arg(p.y).arg(p.z);
+
+		if (vdata->_layout == VolumeData::Bricked)
+		{
+			// the bricks of a store follow each other, x fastest
+			const int brickSize = vdata->getBrickSize();
+			const glm::int3 numBricks = (VolumeSize + brickSize - 1) / brickSize;
+			const glm::int3 brick = p / brickSize, inBrick = p % brickSize;
+			const qint64 brickIndex = ((qint64)brick.z * numBricks.y + brick.y) * numBricks.x + brick.x;
+			const qint64 offset = brickIndex * brickSize * brickSize * brickSize + ((qint64)inBrick.z * brickSize + inBrick.y) * brickSize + inBrick.x;
+
+			check(vdata->getBrickIndex(p.x, p.y, p.z) == (size_t)brickIndex, what + " brick index");
+			if (!vdata->isStreamed())
+				check(vdata->getVoxelOffset(p.x, p.y, p.z) == (size_t)offset, what + " offset");
+		}
+		else
+		{
+			check(vdata->getVoxelOffset(p.x, p.y, p.z) == (size_t)getLinearOffset(p), what + " offset");
+		}
+
+		if (!vdata->isStreamed())
+			check(vdata->getVoxel<unsigned char>(p.x, p.y, p.z) == marker.value, what + " value");
+
+		unsigned char value = 0;
+		vdata->readBox(p, glm::int3(1), &value);
+		check(value == marker.value, what + " read");
+	}
+}
+
+void LargeVolumeTests::checkBox(const VolumeData* vdata, const glm::int3& origin, const glm::int3& size, const QString& name)
+{
+	std::vector<unsigned char> box((size_t)size.x * size.y * size.z);
+	vdata->readBox(origin, size, box.data());
+
+	size_t numWrong = 0;
+	for (int z = 0; z < size.z; z++)
+	{
+		for (int y = 0; y < size.y; y++)
+		{
+			for (int x = 0; x < size.x; x++)
+			{
+				if (box[((size_t)z * size.y + y) * size.x + x] != getExpectedVoxel(origin + glm::int3(x, y, z)))
+					numWrong++;
+			}
+		}
+	}
+
+	check(numWrong == 0, QString("%1 box at (%2, %3, %4) : %5 wrong voxels").arg(name).arg(origin.x).arg(origin.y).arg(origin.z).arg(numWrong));
+}
+
+void LargeVolumeTests::checkHistogram(const VolumeData* vdata, const QString& name)
+{
+	check(vdata->_min == 0.0f && vdata->_max == 255.0f, name + " range");
+	check(vdata->_histogram != nullptr && vdata->_numBins == 256, name + " histogram");
+	if (vdata->_histogram == nullptr || vdata->_numBins != 256) return;
+
+	// 256 bins over [0, 255] hold a value each, the background is past 2^32 voxels
+	const auto counts = getExpectedCounts();
+	check(vdata->_histogram[0] == std::numeric_limits<unsigned int>::max(), name + " background bin saturated");
+
+	int numWrong = 0;
+	for (int v = 1; v < 256; v++)
+	{
+		if (vdata->_histogram[v] != counts[v])
+			numWrong++;
+	}
+	check(numWrong == 0, QString("%1 histogram : %2 wrong bins").arg(name).arg(numWrong));
+}
+
+void LargeVolumeTests::checkMinMaxGrid(const VolumeData* vdata, const QString& name)
+{
+	// read with the levels, never built from the voxels
+	check(vdata->_minMaxGrid.size() == vdata->getNumMinMaxCells(), name + " min/max grid");
+	if (vdata->_minMaxGrid.size() != vdata->getNumMinMaxCells()) return;
+
+	// the cells of the markers, of the block and of the background, widened by a voxel
+	std::vector<glm::int3> cells = { BlockOrigin / VolumeData::MinMaxBrickSize, glm::int3(10, 10, 10) };
+	for (const auto& marker : Markers)
+		cells.push_back(marker.position / VolumeData::MinMaxBrickSize);
+
+	const glm::int3 gridSize = vdata->getMinMaxGridSize();
+	int numWrong = 0;
+	for (const auto& cell : cells)
+	{
+		const glm::int3 begin = glm::max(cell * VolumeData::MinMaxBrickSize - 1, glm::int3(0));
+		const glm::int3 end = glm::min((cell + 1) * VolumeData::MinMaxBrickSize + 1, VolumeSize);
+		glm::float2 range(255.0f, 0.0f);
+		for (int z = begin.z; z < end.z; z++)
+		{
+			for (int y = begin.y; y < end.y; y++)
+			{
+				for (int x = begin.x; x < end.x; x++)
+				{
+					const float value = getExpectedVoxel(glm::int3(x, y, z));
+					range = glm::float2(std::min(range.x, value), std::max(range.y, value));
+				}
+			}
+		}
+
+		if (vdata->_minMaxGrid[((size_t)cell.z * gridSize.y + cell.y) * gridSize.x + cell.x] != range)
+			numWrong++;
+	}
+	check(numWrong == 0, QString("%1 min/max grid : %2 wrong cells").arg(name).arg(numWrong));
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "VolumeData.h"
+#include <QString>
+#include <QStringList>
+
+// Exact checks of the index paths past 2^31 and 2^32 voxels, on a sparse file of 2047 x 2049 x 1040 8 bits voxels
+// (4.4 GB, 75 kB of them written) holding a patterned block and a few marked voxels :
+// the voxel offsets and brick indices, readBox, the histogram whose background bin saturates, and the round trip
+// through a bricked store (saveToBrickedBinFormat, then the store loaded mapped and streamed, with its min/max grids).
+// The store needs 5 GB of free space in the scratch directory, everything is removed at exit :
+// VolumeVizTests [--dir scratch]
+class LargeVolumeTests
+{
+public:
+	// returns the process exit code, the number of failed checks
+	static int run(const QStringList& arguments);
+private:
+	explicit LargeVolumeTests(const QString& directory);
+
+	void testSource();
+	void testMappedStore();
+	void testStreamedStore();
+
+	// the checks only log their failures, the run carries on to report all of them
+	void check(bool condition, const QString& what);
+	void checkMarkers(const VolumeData* vdata, const QString& name);
+	void checkBox(const VolumeData* vdata, const glm::int3& origin, const glm::int3& size, const QString& name);
+	void checkHistogram(const VolumeData* vdata, const QString& name);
+	void checkMinMaxGrid(const VolumeData* vdata, const QString& name);
+
+	QString _directory;
+	QString _sourcePath;
+	QString _storePath;
+	int _numFailures = 0;
+};
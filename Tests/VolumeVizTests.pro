@@ -0,0 +1,34 @@
+# ----------------------------------------------------
+# Checks of the volumes past 2^31 voxels on sparse files,
+# built from the sources of VolumeViz without its widgets.
+# ------------------------------------------------------
+
+TEMPLATE = app
+TARGET = VolumeVizTests
+DESTDIR = ../x64/Release
+QT += core gui
+QT -= widgets
+CONFIG += release console c++17
+INCLUDEPATH += . \
+    ../VolumeViz \
+    ../VolumeViz/thirdparty
+DEPENDPATH += .
+OBJECTS_DIR += release
+
+HEADERS += ./LargeVolumeTests.h \
+    ../VolumeViz/BasicVolumeDataLoader.h \
+    ../VolumeViz/VolumeData.h \
+    ../VolumeViz/StreamedVolumeData.h \
+    ../VolumeViz/MappedVolumeData.h \
+    ../VolumeViz/VolumeDataLoader.h \
+    ../VolumeViz/TaskScheduler.h \
+    ../VolumeViz/Tracer.h
+SOURCES += ./main.cpp \
+    ./LargeVolumeTests.cpp \
+    ../VolumeViz/BasicVolumeDataLoader.cpp \
+    ../VolumeViz/VolumeData.cpp \
+    ../VolumeViz/StreamedVolumeData.cpp \
+    ../VolumeViz/MappedVolumeData.cpp \
+    ../VolumeViz/VolumeDataLoader.cpp \
+    ../VolumeViz/TaskScheduler.cpp \
+    ../VolumeViz/Tracer.cpp
@@ -0,0 +1,8 @@
+#include "LargeVolumeTests.h"
+#include <QCoreApplication>
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	return LargeVolumeTests::run(a.arguments());
+}
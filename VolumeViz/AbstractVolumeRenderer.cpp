@@ -1,5 +1,10 @@
 #include "AbstractVolumeRenderer.h"
+#include "StreamedVolumeData.h"
+#include "Tracer.h"
 #include <qopengl.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 void AbstractVolumeRenderer::setGLTexture(unsigned int textureId)
 {
@@ -37,6 +42,45 @@ void AbstractVolumeRenderer::setVolumeData(VolumeData* vdata)
 	_vdata = vdata;
 }
 
+void AbstractVolumeRenderer::prepareVolumeData(VolumeData* vdata) const
+{
+	TRACE_SCOPE("AbstractVolumeRenderer::prepareVolumeData");
+	if (vdata == nullptr) return;
+	// the streamed levels keep the grids of their store, building one would read them from the disk whole
+	for (int i = 0; i < vdata->getNumLevels(); i++)
+	{
+		VolumeData* level = vdata->getLevel(i);
+		if (!level->isStreamed())
+			level->computeMinMaxGrid();
+	}
+
+	// the coarsest levels first, the finer ones fall back to central differences past the budget
+	size_t gradientsSize = 0;
+	for (int i = vdata->getNumLevels() - 1; i >= 0; i--)
+	{
+		VolumeData* level = vdata->getLevel(i);
+		gradientsSize += level->getNumVoxels() * sizeof(glm::u8vec4);
+		if (level->isStreamed() || gradientsSize > _gradientVolumeBudget)
+			level->clearGradients();
+		else
+			level->computeGradients();
+	}
+}
+
+void AbstractVolumeRenderer::setGradientVolumeBudget(size_t bytes)
+{
+	_gradientVolumeBudget = bytes;
+}
+
+size_t AbstractVolumeRenderer::getGradientVolumeBudget() const
+{
+	return _gradientVolumeBudget;
+}
+
+void AbstractVolumeRenderer::finishFrame()
+{
+}
+
 void AbstractVolumeRenderer::requestBuffersUpdate()
 {
 	_updateRequested = true;
@@ -46,3 +90,276 @@ void AbstractVolumeRenderer::setRenderingStatus(bool status)
 {
 	this->_renderingStatus = status;
 }
+
+void AbstractVolumeRenderer::setHeadless(bool headless)
+{
+	_headless = headless;
+}
+
+bool AbstractVolumeRenderer::isHeadless() const
+{
+	return _headless;
+}
+
+bool AbstractVolumeRenderer::readFramebuffer(unsigned char* rgbaPixels)
+{
+	return false;
+}
+
+void AbstractVolumeRenderer::setLevelOfDetail(int level)
+{
+	level = std::max(level, 0);
+	if (level == _levelOfDetail) return;
+	_levelOfDetail = level;
+	requestBuffersUpdate();
+}
+
+int AbstractVolumeRenderer::getLevelOfDetail() const
+{
+	return _levelOfDetail;
+}
+
+void AbstractVolumeRenderer::setStepSize(float stepSize)
+{
+	_stepSize = std::max(stepSize, 0.01f);
+	requestBuffersUpdate();
+}
+
+float AbstractVolumeRenderer::getStepSize() const
+{
+	return _stepSize;
+}
+
+void AbstractVolumeRenderer::setTimingsEnabled(bool enabled)
+{
+	_timingsEnabled = enabled;
+	if (!enabled)
+	{
+		_timings.clear();
+		_lastTimings = -1;
+	}
+}
+
+bool AbstractVolumeRenderer::areTimingsEnabled() const
+{
+	return _timingsEnabled;
+}
+
+int AbstractVolumeRenderer::getNumTimings() const
+{
+	return (int)_timings.size();
+}
+
+AbstractVolumeRenderer::FrameTimings AbstractVolumeRenderer::getTimings(int frame) const
+{
+	if (frame < 0 || frame >= (int)_timings.size()) return FrameTimings();
+	return _timings[(_lastTimings - frame + TimingsHistorySize) % TimingsHistorySize];
+}
+
+AbstractVolumeRenderer::FrameTimings AbstractVolumeRenderer::getAverageTimings() const
+{
+	FrameTimings average;
+	if (_timings.empty()) return average;
+
+	for (const FrameTimings& timings : _timings)
+	{
+		average.rayMarching += timings.rayMarching;
+		average.occlusion += timings.occlusion;
+		average.postProcessing += timings.postProcessing;
+		average.interop += timings.interop;
+		average.host += timings.host;
+		average.frame += timings.frame;
+	}
+
+	const float scale = 1.0f / (float)_timings.size();
+	average.rayMarching *= scale;
+	average.occlusion *= scale;
+	average.postProcessing *= scale;
+	average.interop *= scale;
+	average.host *= scale;
+	average.frame *= scale;
+	return average;
+}
+
+double AbstractVolumeRenderer::getTime()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AbstractVolumeRenderer::recordTimings(const FrameTimings& timings)
+{
+	if (!_timingsEnabled) return;
+
+	_lastTimings = (_lastTimings + 1) % TimingsHistorySize;
+	if ((int)_timings.size() < TimingsHistorySize)
+		_timings.push_back(timings);
+	else
+		_timings[_lastTimings] = timings;
+}
+
+VolumeData* AbstractVolumeRenderer::getLevelData() const
+{
+	return _vdata != nullptr ? _vdata->getLevel(_levelOfDetail) : nullptr;
+}
+
+bool AbstractVolumeRenderer::updateStreaming()
+{
+	if (_vdata == nullptr) return false;
+
+	bool arrived = false;
+	for (int i = 0; i < _vdata->getNumLevels(); i++)
+	{
+		VolumeData* level = _vdata->getLevel(i);
+		if (level->isStreamed())
+			arrived |= static_cast<StreamedVolumeData*>(level)->updateResidency();
+	}
+	return arrived;
+}
+
+void AbstractVolumeRenderer::sortBricksFrontToBack(const VolumeData* level, int brickSize, std::vector<size_t>& brickIndices) const
+{
+	// the eye in voxels of the level, the volume being centered on the origin
+	const glm::vec3 levelScale = glm::vec3(level->_nxyz) / glm::vec3(_vdata->_nxyz);
+	const glm::vec3 eyePosition = _position * levelScale + glm::vec3(level->_nxyz) * 0.5f;
+	const glm::int3 numBricks = (level->_nxyz + brickSize - 1) / brickSize;
+
+	std::vector<std::pair<float, size_t>> distances;
+	distances.reserve(brickIndices.size());
+	for (size_t brickIndex : brickIndices)
+	{
+		const glm::int3 brick = glm::int3((int)(brickIndex % numBricks.x), (int)(brickIndex / numBricks.x % numBricks.y),
+			(int)(brickIndex / ((size_t)numBricks.x * numBricks.y)));
+		const glm::vec3 center = (glm::vec3(brick) + 0.5f) * (float)brickSize;
+		distances.emplace_back(glm::distance(eyePosition, center), brickIndex);
+	}
+	std::sort(distances.begin(), distances.end());
+
+	for (size_t i = 0; i < distances.size(); i++)
+		brickIndices[i] = distances[i].second;
+}
+
+void AbstractVolumeRenderer::classifyMinMaxGrid(const VolumeData* level, const float* rgbaTransferFunction, int resolution, std::vector<unsigned char>& occupancy) const
+{
+	TRACE_SCOPE("AbstractVolumeRenderer::classifyMinMaxGrid");
+	occupancy.clear();
+	if (level->_minMaxGrid.empty()) return;
+
+	// number of visible entries before every entry
+	std::vector<int> visibleEntries(resolution + 1, 0);
+	for (int i = 0; i < resolution; i++)
+		visibleEntries[i + 1] = visibleEntries[i] + (rgbaTransferFunction[i * 4 + 3] > MinOpacity ? 1 : 0);
+
+	// stored value to transfer function coordinate, as the UNORM image and min_max_values do in the kernel
+	const glm::float2 range = _vdata->getNormalizedRange();
+	const float densityScale = _vdata->getNormalizedScale() / (range.y - range.x);
+	const float densityOffset = -range.x / (range.y - range.x);
+
+	occupancy.resize(level->_minMaxGrid.size());
+	for (size_t b = 0; b < occupancy.size(); b++)
+	{
+		// the entries the linear filtering of the transfer function reads for the densities of the brick
+		const glm::float2 densities = level->_minMaxGrid[b] * densityScale + densityOffset;
+		const int first = glm::clamp((int)std::floor(densities.x * resolution - 0.5f), 0, resolution - 1);
+		const int last = glm::clamp((int)std::floor(densities.y * resolution - 0.5f) + 1, 0, resolution - 1);
+		occupancy[b] = visibleEntries[last + 1] > visibleEntries[first] ? 1 : 0;
+	}
+}
+
+void AbstractVolumeRenderer::bakeTransferFunction(const TransferFunction& colors, int resolution, float* rgbaBuffer)
+{
+	const int numControlPoints = colors.size();
+	if (numControlPoints == 0) return;
+
+	// a single sweep over the control points ordered by density, the editor keeps them so
+	auto isBefore = [](const QPair<QPointF, QColor>& a, const QPair<QPointF, QColor>& b) { return a.first.x() < b.first.x(); };
+	const TransferFunction* controlPoints = &colors;
+	TransferFunction sortedColors;
+	if (!std::is_sorted(colors.begin(), colors.end(), isBefore))
+	{
+		sortedColors = colors;
+		std::stable_sort(sortedColors.begin(), sortedColors.end(), isBefore);
+		controlPoints = &sortedColors;
+	}
+
+	const int nchannels = 4; // RGBA 4-channels
+	const float invResolution = 1.0f / (float)resolution;
+	const auto& firstCP = (*controlPoints)[0];
+	const auto& lastCP = (*controlPoints)[numControlPoints - 1];
+	int j = 0;
+
+	for (int i = 0; i < resolution; i++)
+	{
+		float* color = rgbaBuffer + i * nchannels;
+		const float t = i * invResolution;
+
+		// the first segment holding t
+		while (j < numControlPoints - 1 && (*controlPoints)[j + 1].first.x() < t) j++;
+
+		if (j < numControlPoints - 1 && firstCP.first.x() <= t)
+		{
+			// linear interpolation
+			const auto& currentCP = (*controlPoints)[j];
+			const auto& nextCP = (*controlPoints)[j + 1];
+			const float interp = (t - currentCP.first.x()) / (nextCP.first.x() - currentCP.first.x());
+
+			color[0] = glm::lerp((float)currentCP.second.redF(), (float)nextCP.second.redF(), interp);
+			color[1] = glm::lerp((float)currentCP.second.greenF(), (float)nextCP.second.greenF(), interp);
+			color[2] = glm::lerp((float)currentCP.second.blueF(), (float)nextCP.second.blueF(), interp);
+			color[3] = glm::lerp((float)currentCP.first.y(), (float)nextCP.first.y(), interp);
+		}
+		else
+		{
+			color[0] = lastCP.second.redF();
+			color[1] = lastCP.second.greenF();
+			color[2] = lastCP.second.blueF();
+			color[3] = lastCP.first.y();
+		}
+	}
+}
+
+void AbstractVolumeRenderer::preIntegrateTransferFunction(const float* rgbaTransferFunction, int resolution, int size, float* rgbaTable)
+{
+	TRACE_SCOPE("AbstractVolumeRenderer::preIntegrateTransferFunction");
+	const float maxOpacity = 0.9999f; // keeps the extinction finite
+
+	// prefix sums of the extinction weighted colors (rgb) and of the extinction (a), the entries being constant over their span
+	std::vector<glm::vec4> prefixSums(resolution + 1, glm::vec4(0.0f));
+	for (int i = 0; i < resolution; i++)
+	{
+		const float* entry = rgbaTransferFunction + i * 4;
+		const float extinction = -std::log(1.0f - std::min(entry[3], maxOpacity));
+		prefixSums[i + 1] = prefixSums[i] + glm::vec4(glm::vec3(entry[0], entry[1], entry[2]) * extinction, extinction);
+	}
+
+	// integral from 0 to density
+	auto integral = [&](float density)
+	{
+		const float x = glm::clamp(density * resolution, 0.0f, (float)resolution);
+		const int i = std::min((int)x, resolution - 1);
+		return glm::mix(prefixSums[i], prefixSums[i + 1], x - i) / (float)resolution;
+	};
+
+	// the integrals at the texel centers, the diagonal (front = back) is averaged over the span of its texel
+	std::vector<glm::vec4> integrals(size), texelIntegrals(size);
+	for (int i = 0; i < size; i++)
+	{
+		integrals[i] = integral((i + 0.5f) / size);
+		texelIntegrals[i] = integral((i + 1.0f) / size) - integral((float)i / size);
+	}
+
+	for (int back = 0; back < size; back++)
+	{
+		for (int front = 0; front < size; front++)
+		{
+			const glm::vec4 average = front == back ? texelIntegrals[front] * (float)size :
+				(integrals[back] - integrals[front]) * ((float)size / (float)(back - front));
+
+			float* entry = rgbaTable + ((size_t)back * size + front) * 4;
+			const glm::vec3 color = average.a > 0.0f ? glm::vec3(average) / average.a : glm::vec3(0.0f);
+			entry[0] = color.r;
+			entry[1] = color.g;
+			entry[2] = color.b;
+			entry[3] = average.a;
+		}
+	}
+}
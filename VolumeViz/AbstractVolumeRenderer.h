@@ -20,27 +20,103 @@ public:
 		Opacity,
 		Depth
 	};
+
+	// durations of the passes of a frame in milliseconds, the device ones stay 0 for the CPU backend
+	struct FrameTimings
+	{
+		float rayMarching = 0.0f;
+		float occlusion = 0.0f;
+		float postProcessing = 0.0f;
+		float interop = 0.0f; // acquisition and release of the shared GL texture
+		float host = 0.0f; // spent in render()
+		float frame = 0.0f; // from render() to the frame complete, from its first command queued to the last one done on a device
+	};
+
+	static constexpr float MinOpacity = 0.001f; // samples below it are not composited, the kernel skips them alike
+	static const size_t DefaultGradientVolumeBudget = (size_t)1 << 30; // in bytes
+	static const int TimingsHistorySize = 128; // frames
+	virtual ~AbstractVolumeRenderer() = default;
+
 	virtual void init() = 0;
 	virtual void cleanup() = 0;
 	virtual void render() = 0;
+	// blocks until the last frame rendered is complete, before its output is drawn : render() may only submit it
+	virtual void finishFrame();
 	virtual void setGLTexture(unsigned int);
 	virtual void setViewport(int x, int y, int width, int height);
 	virtual void setRenderType(RenderType type);
 	virtual void setMatrices(glm::mat4x4 modelViewMatrix, glm::mat4x4 projectionMatrix);
 	virtual void setViewPosition(glm::vec3 position);
 	virtual void setVolumeData(VolumeData* vdata);
+	// converts the volume to what the backend samples best, touches nothing but vdata so it can run on a loading thread.
+	// Builds the min/max grids of the levels for the empty space skipping, and their gradient volumes within the budget.
+	virtual void prepareVolumeData(VolumeData* vdata) const;
+	// memory of the gradient volumes (4 bytes per voxel), the coarsest levels first, must be set before prepareVolumeData.
+	// The levels left without one are shaded with central differences, 0 disables them.
+	void setGradientVolumeBudget(size_t bytes);
+	size_t getGradientVolumeBudget() const;
 	virtual void setTransferFunction(const TransferFunction& colors) = 0;
 	virtual void requestBuffersUpdate();
 	virtual void setRenderingStatus(bool status);
+	// renders into a buffer owned by the backend instead of the shared GL texture, must be set before init()
+	virtual void setHeadless(bool headless);
+	bool isHeadless() const;
+	// copies the last frame as _width x _height RGBA8 pixels, row 0 being the bottom of the viewport
+	virtual bool readFramebuffer(unsigned char* rgbaPixels);
+	// mip level to render, 0 being the full resolution, coarser levels keep the interaction fluid
+	virtual void setLevelOfDetail(int level);
+	int getLevelOfDetail() const;
+	// sampling distance along the rays, in voxels of the level rendered
+	virtual void setStepSize(float stepSize);
+	float getStepSize() const;
+	// keeps the timings of the last TimingsHistorySize frames rendered, off by default
+	void setTimingsEnabled(bool enabled);
+	bool areTimingsEnabled() const;
+	int getNumTimings() const;
+	FrameTimings getTimings(int frame = 0) const; // frame 0 being the last one complete
+	FrameTimings getAverageTimings() const;
 protected:
+	// milliseconds of a steady clock
+	static double getTime();
+	void recordTimings(const FrameTimings& timings);
+
+	// the level of _vdata actually rendered
+	VolumeData* getLevelData() const;
+	// updates the residency of the streamed levels between two frames, returns true when bricks arrived
+	bool updateStreaming();
+	// orders bricks of brickSize^3 voxels of the level (x fastest), the nearest to the eye first :
+	// the brick requests of the rays are served front to back
+	void sortBricksFrontToBack(const VolumeData* level, int brickSize, std::vector<size_t>& brickIndices) const;
+
+	// bakes the control points into a lookup table of resolution RGBA entries, linearly interpolated, in a single sweep
+	static void bakeTransferFunction(const TransferFunction& colors, int resolution, float* rgbaBuffer);
+
+	// Pre-integration of the baked transfer function (resolution RGBA entries) for every pair of front and back densities
+	// of a segment : size x size RGBA entries, front density along x, texel centers at (i + 0.5) / size.
+	// rgb is the color averaged over the segment and a its extinction per voxel, the opacities of the transfer function
+	// being those of a one voxel step : a segment of length d is then 1 - exp(-a * d) opaque, whatever d.
+	// Built in O(resolution + size^2) from prefix sums of the extinction.
+	static void preIntegrateTransferFunction(const float* rgbaTransferFunction, int resolution, int size, float* rgbaTable);
+
+	// Empty space skipping : flags the bricks of the min/max grid of the level that hold a sample the transfer function
+	// (resolution RGBA entries) makes visible, through a prefix sum of its opacities. Empty without a grid.
+	void classifyMinMaxGrid(const VolumeData* level, const float* rgbaTransferFunction, int resolution, std::vector<unsigned char>& occupancy) const;
+
 	bool _updateRequested = true;
 	VolumeData* _vdata = nullptr;
 	unsigned int _glTexture = -1;
-	RenderType _renderType;
+	RenderType _renderType = Shaded;
 	glm::mat4x4 _modelViewMatrix, _projectionMatrix, _invModelViewProjectionMatrix;
 	int _numTFControlPoints = 0;
 	int _width = 0, _height = 0;
 	int _x = 0, _y = 0;
 	glm::vec3 _position;
 	bool _renderingStatus = false;
+	bool _headless = false;
+	int _levelOfDetail = 0;
+	float _stepSize = 1.0f;
+	size_t _gradientVolumeBudget = DefaultGradientVolumeBudget;
+	bool _timingsEnabled = false;
+	std::vector<FrameTimings> _timings; // rolling buffer
+	int _lastTimings = -1; // slot of the last frame
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "BasicVolumeDataLoader.h"
+#include "Tracer.h"
 #include <QDir>
 #include <QFileInfo>
 #include <QRegExp>
@@ -12,24 +13,11 @@ BasicVolumeDataLoader::BasicVolumeDataLoader()
 
 VolumeData* BasicVolumeDataLoader::load(const QString& path)
 {
+	TRACE_SCOPE("BasicVolumeDataLoader::load");
 	QDir directory(path);
-	QFile file(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
-	if (file.open(QIODevice::OpenModeFlag::ReadOnly))
+	auto vdata = loadFromBinFormat(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
+	if (vdata != nullptr)
 	{
-		auto vdata = new VolumeData;
-
-		file.read((char*)(&vdata->_nxyz), sizeof(vdata->_nxyz));
-		file.read((char*)(&vdata->_sxyz), sizeof(vdata->_sxyz));
-		vdata->init(vdata->_nxyz.x, vdata->_nxyz.y, vdata->_nxyz.z,
-			vdata->_sxyz.x, vdata->_sxyz.y, vdata->_sxyz.z);
-		file.read((char*)vdata->_data, sizeof(VolumeData::DataType) * vdata->_nxyz.x * vdata->_nxyz.y * vdata->_nxyz.z);
-		file.read((char*)&vdata->_min, sizeof(float));
-		file.read((char*)&vdata->_max, sizeof(float));
-		file.read((char*)&vdata->_mean, sizeof(float));
-		file.read((char*)&vdata->_std, sizeof(float));
-		vdata->computeHistogram();
-
-		file.close();
 		/*
 		// half size, just to be able to commit the file
 		QFile hfFile(directory.absoluteFilePath(QString("%1-small.bin").arg(directory.dirName())));
@@ -61,7 +49,6 @@ VolumeData* BasicVolumeDataLoader::load(const QString& path)
 			return tempVolume;
 		}
 		//*/
-		return vdata;
 	}
-	return nullptr;
+	return vdata;
 }
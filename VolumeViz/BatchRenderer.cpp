@@ -0,0 +1,348 @@
+#include "BatchRenderer.h"
+#include "RenderSettingsFile.h"
+#include "OpenCLVolumeRenderer.h"
+#include "CPUVolumeRenderer.h"
+#include "BasicVolumeDataLoader.h"
+#include "TIFFStackVolumeDataLoader.h"
+#include "RawVolumeDataLoader.h"
+#include "StreamedVolumeData.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QImage>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <cstring>
+
+namespace
+{
+	// Encodes and writes the frames on background threads so the renderer never waits on the disk
+	class ImageWriterQueue
+	{
+	public:
+		ImageWriterQueue(int numThreads, int maxPending) : _maxPending(maxPending)
+		{
+			for (int i = 0; i < numThreads; i++)
+				_threads.emplace_back(&ImageWriterQueue::writerLoop, this);
+		}
+
+		~ImageWriterQueue()
+		{
+			finish();
+		}
+
+		// writes the remaining frames and stops the threads
+		void finish()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_quit = true;
+			}
+			_condition.notify_all();
+
+			for (auto& thread : _threads)
+				thread.join();
+			_threads.clear();
+		}
+
+		void push(const QImage& image, const QString& path)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_condition.wait(lock, [this]() { return (int)_pending.size() < _maxPending; });
+			_pending.emplace_back(image, path);
+			_condition.notify_all();
+		}
+
+		int getNumFailures()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _numFailures;
+		}
+
+	private:
+		void writerLoop()
+		{
+			while (true)
+			{
+				std::pair<QImage, QString> frame;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_condition.wait(lock, [this]() { return _quit || !_pending.empty(); });
+
+					if (_pending.empty()) return;
+
+					frame = std::move(_pending.front());
+					_pending.pop_front();
+				}
+				_condition.notify_all();
+
+				if (!frame.first.save(frame.second))
+				{
+					qDebug() << "Cannot write" << frame.second;
+					std::lock_guard<std::mutex> lock(_mutex);
+					_numFailures++;
+				}
+			}
+		}
+
+		std::vector<std::thread> _threads;
+		std::deque<std::pair<QImage, QString>> _pending;
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		int _maxPending;
+		int _numFailures = 0;
+		bool _quit = false;
+	};
+
+	// the import settings of a headerless dump, from the --raw options
+	bool parseRawSettings(const QCommandLineParser& parser, RawVolumeDataLoader::Settings& settings)
+	{
+		const auto dimensions = parser.value("raw").split('x');
+		const auto spacing = parser.value("raw-spacing").split('x');
+		if (dimensions.size() != 3 || spacing.size() != 3)
+		{
+			qDebug() << "Invalid raw dimensions or spacing" << parser.value("raw") << parser.value("raw-spacing");
+			return false;
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			settings.dimensions[i] = dimensions[i].toInt();
+			settings.spacing[i] = spacing[i].toFloat();
+		}
+
+		const QString voxelType = parser.value("raw-type");
+		if (voxelType == "uint8")
+			settings.voxelType = VolumeData::UInt8;
+		else if (voxelType == "uint16")
+			settings.voxelType = VolumeData::UInt16;
+		else if (voxelType == "float32")
+			settings.voxelType = VolumeData::Float32;
+		else
+		{
+			qDebug() << "Invalid raw voxel type" << voxelType;
+			return false;
+		}
+
+		const QString endianness = parser.value("raw-endian");
+		if (endianness != "little" && endianness != "big")
+		{
+			qDebug() << "Invalid raw byte order" << endianness;
+			return false;
+		}
+		settings.bigEndian = endianness == "big";
+
+		settings.headerOffset = parser.value("raw-offset").toLongLong();
+		settings.slicePattern = parser.value("raw-pattern");
+		settings.firstSliceNumber = parser.value("raw-first").toInt();
+		return true;
+	}
+
+	// waits for the bricks the last frame missed, returns true when the frame is worth rendering again
+	bool waitForStreamedBricks(VolumeData* volumeData)
+	{
+		bool arrived = false;
+		for (int i = 0; i < volumeData->getNumLevels(); i++)
+		{
+			const VolumeData* level = volumeData->getLevel(i);
+			if (level->isStreamed())
+				arrived |= static_cast<const StreamedVolumeData*>(level)->waitForRequests();
+		}
+		return arrived;
+	}
+}
+
+bool BatchRenderer::isBatchInvocation(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--batch") == 0)
+			return true;
+	}
+	return false;
+}
+
+int BatchRenderer::run(const QStringList& arguments)
+{
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Renders a volume from a list of cameras without a display");
+	parser.addHelpOption();
+	parser.addOptions({
+		{ "batch", "Run in batch mode." },
+		{ "volume", "Volume directory (.bin file or TIFF stack).", "dir" },
+		{ "tf", "Transfer function JSON file.", "file" },
+		{ "cameras", "Camera list JSON file.", "file" },
+		{ "output", "Output directory of the frames.", "dir", "frames" },
+		{ "size", "Frame size.", "WxH", "1024x768" },
+		{ "backend", "Rendering backend, cpu or opencl (default : opencl when available).", "name" },
+		{ "format", "Image format of the frames.", "ext", "png" },
+		{ "cache", "Memory budget of the streamed volumes, in MB.", "MB", "1024" },
+		{ "convert", "Writes the volume as a bricked .bin store in the output directory, to be streamed, and exits." },
+		{ "raw", "Imports --volume as a headerless dump of the given dimensions, a depth of 0 counting the slice files.", "XxYxZ" },
+		{ "raw-type", "Voxel type of the dump, uint8, uint16 or float32.", "type", "uint8" },
+		{ "raw-endian", "Byte order of the dump, little or big.", "order", "little" },
+		{ "raw-offset", "Bytes skipped at the start of every file of the dump.", "bytes", "0" },
+		{ "raw-pattern", "Slice file names in the --volume directory, %1 being the slice number (default : a single file).", "pattern" },
+		{ "raw-first", "Number of the first slice file.", "number", "1" },
+		{ "raw-spacing", "Voxel spacing of the dump.", "XxYxZ", "1x1x1" },
+		});
+	parser.process(arguments);
+
+	const bool convert = parser.isSet("convert");
+	if (!parser.isSet("volume") || (!convert && (!parser.isSet("tf") || !parser.isSet("cameras"))))
+	{
+		qDebug().noquote() << parser.helpText();
+		return 1;
+	}
+
+	const size_t cacheBudget = (size_t)std::max(parser.value("cache").toInt(), 1) << 20;
+
+	const auto size = parser.value("size").split('x');
+	const int width = size.value(0).toInt();
+	const int height = size.value(1).toInt();
+	if (width <= 0 || height <= 0)
+	{
+		qDebug() << "Invalid frame size" << parser.value("size");
+		return 1;
+	}
+
+	// the render settings are checked before the volume is read, a conversion does not need them
+	TransferFunction transferFunction;
+	if (!convert && !RenderSettingsFile::loadTransferFunction(parser.value("tf"), transferFunction))
+	{
+		qDebug() << "Invalid transfer function" << parser.value("tf");
+		return 1;
+	}
+
+	QVector<OrbitCamera> cameras;
+	if (!convert && !RenderSettingsFile::loadCameras(parser.value("cameras"), cameras))
+	{
+		qDebug() << "Invalid camera list" << parser.value("cameras");
+		return 1;
+	}
+
+	// volume
+	const QString volumePath = parser.value("volume");
+	QDir volumeDirectory(volumePath);
+	VolumeData* volumeData = nullptr;
+	BasicVolumeDataLoader binLoader;
+
+	if (parser.isSet("raw"))
+	{
+		RawVolumeDataLoader::Settings settings;
+		if (!parseRawSettings(parser, settings))
+			return 1;
+		volumeData = RawVolumeDataLoader(settings).load(volumePath);
+	}
+	else if (volumeDirectory.exists(QString("%1.bin").arg(volumeDirectory.dirName())))
+	{
+		// several batch processes on one host share the mapped pages
+		binLoader.setMemoryMapping(true);
+		binLoader.setCacheBudget(cacheBudget);
+		volumeData = binLoader.load(volumePath);
+	}
+	else
+	{
+		volumeData = TIFFStackVolumeDataLoader().load(volumePath);
+	}
+
+	if (volumeData == nullptr)
+	{
+		qDebug() << "Cannot load the volume" << volumePath;
+		return 1;
+	}
+
+	if (convert)
+	{
+		// the store and its pyramid are written brick by brick, the source being mapped or streamed
+		QDir outputDirectory(parser.value("output"));
+		if (outputDirectory.absolutePath() == volumeDirectory.absolutePath())
+		{
+			qDebug() << "The bricked store cannot replace its source" << volumePath;
+			delete volumeData;
+			return 1;
+		}
+
+		binLoader.setCacheBudget(cacheBudget);
+		const bool converted = binLoader.saveToBrickedBinFormat(volumeData, outputDirectory.absolutePath());
+		delete volumeData;
+		return converted ? 0 : 1;
+	}
+
+	// renderer
+	AbstractVolumeRenderer* volumeRenderer = nullptr;
+	const QString backend = parser.value("backend");
+
+	if (backend == "opencl" && !OpenCLVolumeRenderer::isAvailable(true))
+	{
+		qDebug() << "No OpenCL device available";
+		delete volumeData;
+		return 1;
+	}
+
+	if (backend == "opencl" || (backend.isEmpty() && OpenCLVolumeRenderer::isAvailable()))
+		volumeRenderer = new OpenCLVolumeRenderer();
+	else
+		volumeRenderer = new CPUVolumeRenderer();
+
+	volumeRenderer->setHeadless(true);
+	volumeRenderer->init();
+	volumeRenderer->setViewport(0, 0, width, height);
+	volumeRenderer->setVolumeData(volumeData);
+	volumeRenderer->setTransferFunction(transferFunction);
+	volumeRenderer->setRenderingStatus(true);
+
+	// frames
+	QDir outputDirectory(parser.value("output"));
+	outputDirectory.mkpath(".");
+
+	const float aspectRatio = (float)width / (float)height;
+	QImage frame(width, height, QImage::Format_RGBA8888);
+	int exitCode = 0;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	ImageWriterQueue writer(2, 8);
+
+	for (int i = 0; i < cameras.size(); i++)
+	{
+		cameras[i].apply(volumeRenderer, aspectRatio);
+		volumeRenderer->requestBuffersUpdate();
+		volumeRenderer->render();
+
+		// the parts of a streamed volume that were not resident are completed, within a few passes
+		// as a budget smaller than the bricks in view keeps evicting some of them
+		for (int pass = 0; pass < 8 && waitForStreamedBricks(volumeData); pass++)
+			volumeRenderer->render();
+
+		if (!volumeRenderer->readFramebuffer(frame.bits()))
+		{
+			qDebug() << "The backend cannot read back its frames";
+			exitCode = 1;
+			break;
+		}
+
+		// the framebuffer rows go from the bottom to the top
+		writer.push(frame.mirrored(),
+			outputDirectory.absoluteFilePath(QString("frame_%1.%2").arg(i, 5, 10, QChar('0')).arg(parser.value("format"))));
+	}
+
+	writer.finish();
+	if (writer.getNumFailures() > 0)
+		exitCode = 1;
+
+	const double seconds = timer.elapsed() / 1000.0;
+	qDebug() << cameras.size() << "frames in" << seconds << "s," << cameras.size() / seconds << "frames/s";
+
+	volumeRenderer->cleanup();
+	delete volumeRenderer;
+	delete volumeData;
+
+	return exitCode;
+}
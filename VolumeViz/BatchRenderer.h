@@ -0,0 +1,18 @@
+#pragma once
+
+#include <QStringList>
+
+// Command line entry point rendering stills and turntables without a display :
+// VolumeViz --batch --volume <dir> --tf <tf.json> --cameras <cameras.json> --output <dir>
+//           [--size 1920x1080] [--backend cpu|opencl] [--format png]
+// Headerless dumps are imported with --raw XxYxZ [--raw-type uint8|uint16|float32] [--raw-endian little|big]
+//           [--raw-offset bytes] [--raw-pattern name.%1] [--raw-first 1] [--raw-spacing 1x1x1]
+class BatchRenderer
+{
+public:
+	// true when the arguments ask for batch mode, before any Q*Application is created
+	static bool isBatchInvocation(int argc, char* argv[]);
+
+	// renders every camera and writes the frames, returns the process exit code
+	static int run(const QStringList& arguments);
+};
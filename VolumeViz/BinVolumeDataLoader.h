@@ -1,11 +1,13 @@
 #pragma once
 
-#include "VolumeDataLoader.h"
+#include "RawVolumeDataLoader.h"
 
-class BinVolumeDataLoader : public AbstractVolumeDataLoader
+// Directories of 256 x 256 big endian 16 bits slices named <directory>.1 to <directory>.N
+class BinVolumeDataLoader : public RawVolumeDataLoader
 {
 public:
+	BinVolumeDataLoader();
+
 	// Inherited via VolumeDataLoader
 	virtual VolumeData* load(const QString& path) override;
 };
-
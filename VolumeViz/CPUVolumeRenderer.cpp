@@ -0,0 +1,520 @@
+#include "CPUVolumeRenderer.h"
+#include "TaskScheduler.h"
+#include "StreamedVolumeData.h"
+#include "Tracer.h"
+#include <qopengl.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	// Trilinear sampling with voxel centers at i + 0.5, clamped to the edges (same convention as CLK_FILTER_LINEAR),
+	// returns the interpolated stored value
+	template <typename T>
+	inline float sampleVolume(const VolumeData& vdata, float x, float y, float z)
+	{
+		const T* data = vdata.getVoxels<T>();
+		const glm::int3& dims = vdata._nxyz;
+
+		x -= 0.5f;
+		y -= 0.5f;
+		z -= 0.5f;
+
+		const float fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+		const float tx = x - fx, ty = y - fy, tz = z - fz;
+
+		const int x0 = glm::clamp((int)fx, 0, dims.x - 1), x1 = glm::clamp((int)fx + 1, 0, dims.x - 1);
+		const int y0 = glm::clamp((int)fy, 0, dims.y - 1), y1 = glm::clamp((int)fy + 1, 0, dims.y - 1);
+		const int z0 = glm::clamp((int)fz, 0, dims.z - 1), z1 = glm::clamp((int)fz + 1, 0, dims.z - 1);
+
+		float v[8];
+		const bool bricked = vdata._layout == VolumeData::Bricked;
+
+		if (!bricked || (((x0 ^ x1) | (y0 ^ y1) | (z0 ^ z1)) >> vdata._brickShift) == 0)
+		{
+			// the 8 neighbours share a brick (or the linear array), a single lookup and fixed strides
+			const size_t strideY = bricked ? (size_t)1 << vdata._brickShift : (size_t)dims.x;
+			const size_t strideZ = bricked ? (size_t)1 << (2 * vdata._brickShift) : (size_t)dims.x * dims.y;
+			const T* p = data + vdata.getVoxelOffset(x0, y0, z0);
+			const size_t dx = x1 - x0, dy = (y1 - y0) * strideY, dz = (z1 - z0) * strideZ;
+
+			v[0] = p[0]; v[1] = p[dx]; v[2] = p[dy]; v[3] = p[dx + dy];
+			v[4] = p[dz]; v[5] = p[dx + dz]; v[6] = p[dy + dz]; v[7] = p[dx + dy + dz];
+		}
+		else
+		{
+			v[0] = data[vdata.getVoxelOffset(x0, y0, z0)]; v[1] = data[vdata.getVoxelOffset(x1, y0, z0)];
+			v[2] = data[vdata.getVoxelOffset(x0, y1, z0)]; v[3] = data[vdata.getVoxelOffset(x1, y1, z0)];
+			v[4] = data[vdata.getVoxelOffset(x0, y0, z1)]; v[5] = data[vdata.getVoxelOffset(x1, y0, z1)];
+			v[6] = data[vdata.getVoxelOffset(x0, y1, z1)]; v[7] = data[vdata.getVoxelOffset(x1, y1, z1)];
+		}
+
+		const float c00 = glm::lerp(v[0], v[1], tx);
+		const float c10 = glm::lerp(v[2], v[3], tx);
+		const float c01 = glm::lerp(v[4], v[5], tx);
+		const float c11 = glm::lerp(v[6], v[7], tx);
+
+		return glm::lerp(glm::lerp(c00, c10, ty), glm::lerp(c01, c11, ty), tz);
+	}
+
+	// Trilinear fetch of the gradient volume of the level, same convention as sampleVolume :
+	// direction in xyz (to be normalized), magnitude in w
+	inline glm::vec4 sampleGradient(const VolumeData& vdata, float x, float y, float z)
+	{
+		const glm::int3& dims = vdata._nxyz;
+		const glm::vec3 p = glm::vec3(x, y, z) - 0.5f;
+		const glm::vec3 f = glm::floor(p);
+		const glm::vec3 t = p - f;
+
+		const int xs[2] = { glm::clamp((int)f.x, 0, dims.x - 1), glm::clamp((int)f.x + 1, 0, dims.x - 1) };
+		const int ys[2] = { glm::clamp((int)f.y, 0, dims.y - 1), glm::clamp((int)f.y + 1, 0, dims.y - 1) };
+		const int zs[2] = { glm::clamp((int)f.z, 0, dims.z - 1), glm::clamp((int)f.z + 1, 0, dims.z - 1) };
+
+		glm::vec4 v[8];
+		for (int i = 0; i < 8; i++)
+			v[i] = glm::vec4(vdata._gradients[((size_t)zs[i >> 2] * dims.y + ys[(i >> 1) & 1]) * dims.x + xs[i & 1]]);
+
+		const glm::vec4 c00 = glm::mix(v[0], v[1], t.x);
+		const glm::vec4 c10 = glm::mix(v[2], v[3], t.x);
+		const glm::vec4 c01 = glm::mix(v[4], v[5], t.x);
+		const glm::vec4 c11 = glm::mix(v[6], v[7], t.x);
+		const glm::vec4 packed = glm::mix(glm::mix(c00, c10, t.y), glm::mix(c01, c11, t.y), t.z) / 255.0f;
+
+		return glm::vec4(glm::vec3(packed) * 2.0f - 1.0f, packed.w * vdata._gradientScale);
+	}
+
+	// feedback of the rays, a store only when it changes : many of them miss the same brick
+	inline void recordBrickRequest(std::atomic<unsigned char>* brickRequests, size_t brickIndex)
+	{
+		if (brickRequests[brickIndex].load(std::memory_order_relaxed) == 0)
+			brickRequests[brickIndex].store(1, std::memory_order_relaxed);
+	}
+
+	// The 8 neighbours of a streamed volume, false when one of their bricks is not resident,
+	// the missing ones are then recorded in brickRequests
+	template <typename T>
+	inline bool gatherResidentVoxels(const StreamedVolumeData& vdata, std::atomic<unsigned char>* brickRequests, const int xs[2], const int ys[2], const int zs[2], float v[8])
+	{
+		if ((((xs[0] ^ xs[1]) | (ys[0] ^ ys[1]) | (zs[0] ^ zs[1])) >> vdata._brickShift) == 0)
+		{
+			// a single page table lookup when they share a brick
+			const size_t brickIndex = vdata.getBrickIndex(xs[0], ys[0], zs[0]);
+			const T* brick = (const T*)vdata.findResidentBrick(brickIndex);
+			if (brick == nullptr)
+			{
+				recordBrickRequest(brickRequests, brickIndex);
+				return false;
+			}
+
+			for (int i = 0; i < 8; i++)
+				v[i] = brick[vdata.getOffsetInBrick(xs[i & 1], ys[(i >> 1) & 1], zs[i >> 2])];
+			return true;
+		}
+
+		bool resident = true;
+		for (int i = 0; i < 8; i++)
+		{
+			const int x = xs[i & 1], y = ys[(i >> 1) & 1], z = zs[i >> 2];
+			const size_t brickIndex = vdata.getBrickIndex(x, y, z);
+			const T* brick = (const T*)vdata.findResidentBrick(brickIndex);
+			if (brick == nullptr)
+			{
+				recordBrickRequest(brickRequests, brickIndex);
+				resident = false;
+				continue;
+			}
+			v[i] = brick[vdata.getOffsetInBrick(x, y, z)];
+		}
+		return resident;
+	}
+
+	// Same as sampleVolume for a streamed volume, through its resident bricks only : a sample missing one of them
+	// is taken from the fallback level instead (coordinates scaled by fallbackScale), or is empty without one
+	template <typename T>
+	inline float sampleStreamedVolume(const StreamedVolumeData& vdata, std::atomic<unsigned char>* brickRequests, const VolumeData* fallback, const glm::vec3& fallbackScale, float x, float y, float z)
+	{
+		const glm::int3& dims = vdata._nxyz;
+
+		const float fx = std::floor(x - 0.5f), fy = std::floor(y - 0.5f), fz = std::floor(z - 0.5f);
+		const float tx = x - 0.5f - fx, ty = y - 0.5f - fy, tz = z - 0.5f - fz;
+
+		const int xs[2] = { glm::clamp((int)fx, 0, dims.x - 1), glm::clamp((int)fx + 1, 0, dims.x - 1) };
+		const int ys[2] = { glm::clamp((int)fy, 0, dims.y - 1), glm::clamp((int)fy + 1, 0, dims.y - 1) };
+		const int zs[2] = { glm::clamp((int)fz, 0, dims.z - 1), glm::clamp((int)fz + 1, 0, dims.z - 1) };
+
+		float v[8];
+		if (!gatherResidentVoxels<T>(vdata, brickRequests, xs, ys, zs, v))
+			return fallback != nullptr ? sampleVolume<T>(*fallback, x * fallbackScale.x, y * fallbackScale.y, z * fallbackScale.z) : 0.0f;
+
+		const float c00 = glm::lerp(v[0], v[1], tx);
+		const float c10 = glm::lerp(v[2], v[3], tx);
+		const float c01 = glm::lerp(v[4], v[5], tx);
+		const float c11 = glm::lerp(v[6], v[7], tx);
+
+		return glm::lerp(glm::lerp(c00, c10, ty), glm::lerp(c01, c11, ty), tz);
+	}
+
+	// Linearly filtered transfer function fetch, density in [0, 1]
+	inline void lookupTransferFunction(const float* tf, float density, float& r, float& g, float& b, float& a)
+	{
+		const int resolution = CPUVolumeRenderer::TFResolution;
+		const float x = glm::clamp(density * resolution - 0.5f, 0.0f, (float)(resolution - 1));
+		const int i0 = (int)x;
+		const int i1 = std::min(i0 + 1, resolution - 1);
+		const float t = x - i0;
+
+		const float* c0 = tf + i0 * 4;
+		const float* c1 = tf + i1 * 4;
+
+		r = c0[0] + (c1[0] - c0[0]) * t;
+		g = c0[1] + (c1[1] - c0[1]) * t;
+		b = c0[2] + (c1[2] - c0[2]) * t;
+		a = c0[3] + (c1[3] - c0[3]) * t;
+	}
+}
+
+void CPUVolumeRenderer::init()
+{
+	// spawn the worker threads up front rather than on the first frame
+	TaskScheduler::getInstance();
+}
+
+void CPUVolumeRenderer::cleanup()
+{
+	_framebuffer.clear();
+	_framebuffer.shrink_to_fit();
+}
+
+void CPUVolumeRenderer::setViewport(int x, int y, int w, int h)
+{
+	AbstractVolumeRenderer::setViewport(x, y, w, h);
+
+	_framebuffer.assign(4 * (size_t)w * (size_t)h, 0);
+	_numTilesX = (w + TileSize - 1) / TileSize;
+	_numTilesY = (h + TileSize - 1) / TileSize;
+
+	requestBuffersUpdate();
+}
+
+void CPUVolumeRenderer::setTransferFunction(const TransferFunction& colors)
+{
+	TRACE_SCOPE("CPUVolumeRenderer::setTransferFunction");
+	_numTFControlPoints = colors.size();
+
+	_transferFunction.resize(TFResolution * 4);
+	bakeTransferFunction(colors, TFResolution, _transferFunction.data());
+
+	_transferFunctionOpacities.resize(TFResolution);
+	for (int i = 0; i < TFResolution; i++)
+		_transferFunctionOpacities[i] = _transferFunction[i * 4 + 3];
+
+	updateCorrectedOpacities();
+	requestBuffersUpdate();
+}
+
+void CPUVolumeRenderer::setStepSize(float stepSize)
+{
+	AbstractVolumeRenderer::setStepSize(stepSize);
+	updateCorrectedOpacities();
+}
+
+const unsigned char* CPUVolumeRenderer::getFramebuffer() const
+{
+	return _framebuffer.data();
+}
+
+bool CPUVolumeRenderer::readFramebuffer(unsigned char* rgbaPixels)
+{
+	if (_framebuffer.empty()) return false;
+	memcpy(rgbaPixels, _framebuffer.data(), _framebuffer.size());
+	return true;
+}
+
+void CPUVolumeRenderer::updateCorrectedOpacities()
+{
+	// the opacities of the transfer function are defined for a one voxel step
+	_correctedStepSize = getLevelStepSize();
+	for (size_t i = 0; i < _transferFunctionOpacities.size(); i++)
+		_transferFunction[i * 4 + 3] = 1.0f - std::pow(1.0f - _transferFunctionOpacities[i], _correctedStepSize);
+}
+
+float CPUVolumeRenderer::getLevelStepSize() const
+{
+	// coarser levels are marched with proportionally longer steps
+	if (_vdata == nullptr) return _stepSize;
+	const int level = std::min(_levelOfDetail, _vdata->getNumLevels() - 1);
+	return _stepSize * (float)(1 << level);
+}
+
+void CPUVolumeRenderer::setVolumeData(VolumeData* vdata)
+{
+	// nothing left to do when it was prepared while loading
+	prepareVolumeData(vdata);
+	AbstractVolumeRenderer::setVolumeData(vdata);
+}
+
+void CPUVolumeRenderer::prepareVolumeData(VolumeData* vdata) const
+{
+	if (vdata == nullptr) return;
+	// the mapped levels keep their layout, bricking them would copy them out of the shared mapping :
+	// they are sampled bricked once converted to a bricked store
+	for (int i = 0; i < vdata->getNumLevels(); i++)
+	{
+		if (!vdata->getLevel(i)->isMapped())
+			vdata->getLevel(i)->toBricked();
+	}
+	AbstractVolumeRenderer::prepareVolumeData(vdata);
+}
+
+void CPUVolumeRenderer::render()
+{
+	if (!_renderingStatus) return;
+	if (updateStreaming()) _updateRequested = true;
+	if (!_updateRequested) return;
+	if (_vdata == nullptr || (_vdata->_data == nullptr && !_vdata->isStreamed())) return;
+	if (_numTFControlPoints < 2) return;
+	if (_framebuffer.empty()) return;
+
+	TRACE_SCOPE("CPUVolumeRenderer::render");
+	const double start = getTime();
+
+	if (getLevelStepSize() != _correctedStepSize)
+		updateCorrectedOpacities();
+
+	// one request flag per brick of a streamed level, cleared after every frame
+	const VolumeData* levelData = getLevelData();
+	if (levelData->isStreamed() && _numBrickRequests != levelData->_brickTable.size())
+	{
+		_numBrickRequests = levelData->_brickTable.size();
+		_brickRequests.reset(new std::atomic<unsigned char>[_numBrickRequests]);
+		for (size_t b = 0; b < _numBrickRequests; b++)
+			_brickRequests[b] = 0;
+	}
+
+	TaskScheduler::getInstance().parallelFor(_numTilesX * _numTilesY, [this](size_t tileIndex, unsigned int)
+		{
+			renderTile((int)tileIndex);
+		});
+
+	uploadFramebuffer();
+
+	if (levelData->isStreamed())
+		requestMissingBricks(static_cast<const StreamedVolumeData*>(levelData));
+
+	// the frame is complete when render() returns
+	FrameTimings timings;
+	timings.host = timings.frame = (float)(getTime() - start);
+	recordTimings(timings);
+
+	_updateRequested = false;
+}
+
+void CPUVolumeRenderer::requestMissingBricks(const StreamedVolumeData* levelData)
+{
+	std::vector<size_t> brickIndices;
+	for (size_t b = 0; b < _numBrickRequests; b++)
+	{
+		if (_brickRequests[b].load(std::memory_order_relaxed) != 0)
+		{
+			brickIndices.push_back(b);
+			_brickRequests[b] = 0;
+		}
+	}
+
+	// the loading thread only serves what the last frame missed, nearest first
+	sortBricksFrontToBack(levelData, levelData->getBrickSize(), brickIndices);
+	levelData->clearRequests();
+	levelData->prefetch(brickIndices);
+}
+
+void CPUVolumeRenderer::renderTile(int tileIndex)
+{
+	const int x0 = (tileIndex % _numTilesX) * TileSize;
+	const int y0 = (tileIndex / _numTilesX) * TileSize;
+	const int x1 = std::min(x0 + TileSize, _width);
+	const int y1 = std::min(y0 + TileSize, _height);
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x += PacketSize)
+		{
+			switch (_vdata->_voxelType)
+			{
+			case VolumeData::UInt8: renderPacket<unsigned char>(x, y, std::min(PacketSize, x1 - x)); break;
+			case VolumeData::UInt16: renderPacket<unsigned short>(x, y, std::min(PacketSize, x1 - x)); break;
+			case VolumeData::Float32: renderPacket<float>(x, y, std::min(PacketSize, x1 - x)); break;
+			}
+		}
+	}
+}
+
+template <typename T>
+void CPUVolumeRenderer::renderPacket(int px, int py, int count)
+{
+	const glm::vec3 pMax = glm::vec3(_vdata->_nxyz) * 0.5f;
+	const glm::vec3 pMin = -pMax;
+	const glm::vec3 origin = _position;
+
+	// SoA ray state, one lane per ray
+	alignas(32) float dirX[PacketSize], dirY[PacketSize], dirZ[PacketSize];
+	alignas(32) float tNear[PacketSize], tFar[PacketSize], t[PacketSize], tHit[PacketSize];
+	alignas(32) float accumR[PacketSize], accumG[PacketSize], accumB[PacketSize], accumA[PacketSize];
+	alignas(32) float active[PacketSize];
+
+	int numActive = 0;
+
+	for (int l = 0; l < PacketSize; l++)
+	{
+		// partial packets replicate their last ray, the extra lanes are masked out
+		const int x = px + std::min(l, count - 1);
+
+		glm::vec4 ndc((float)(x - _x) / (float)_width, (float)(py - _y) / (float)_height, 1.0f, 1.0f);
+		ndc = ndc * 2.0f - 1.0f;
+
+		glm::vec4 projectedPosition = _invModelViewProjectionMatrix * ndc;
+		projectedPosition /= projectedPosition.w;
+
+		const glm::vec3 direction = glm::normalize(glm::vec3(projectedPosition) - origin);
+		const glm::vec3 invDirection = 1.0f / direction;
+		const glm::vec3 t1 = (pMin - origin) * invDirection;
+		const glm::vec3 t2 = (pMax - origin) * invDirection;
+		const glm::vec3 tMin = glm::min(t1, t2);
+		const glm::vec3 tMax = glm::max(t1, t2);
+
+		dirX[l] = direction.x;
+		dirY[l] = direction.y;
+		dirZ[l] = direction.z;
+		tNear[l] = std::max(std::max(std::max(tMin.x, tMin.y), tMin.z), 0.0f);
+		tFar[l] = std::min(std::min(tMax.x, tMax.y), tMax.z);
+		t[l] = tNear[l];
+		tHit[l] = -1.0f;
+		accumR[l] = accumG[l] = accumB[l] = accumA[l] = 0.0f;
+		active[l] = (l < count && tFar[l] > tNear[l]) ? 1.0f : 0.0f;
+		numActive += (int)active[l];
+	}
+
+	// the rays are marched in full resolution voxels, the samples are rescaled to the rendered level
+	const VolumeData& vdata = *getLevelData();
+	const glm::vec3 levelScale = glm::vec3(vdata._nxyz) / glm::vec3(_vdata->_nxyz);
+	const float stepSize = _correctedStepSize;
+
+	// streamed levels are sampled through their resident bricks, the first level in memory fills the gaps
+	const StreamedVolumeData* streamedData = vdata.isStreamed() ? static_cast<const StreamedVolumeData*>(&vdata) : nullptr;
+	const VolumeData* fallback = streamedData != nullptr ? _vdata->getLevel(_vdata->getFirstInCoreLevel()) : nullptr;
+	if (fallback != nullptr && fallback->isStreamed()) fallback = nullptr;
+	const glm::vec3 fallbackScale = fallback != nullptr ? glm::vec3(fallback->_nxyz) / glm::vec3(vdata._nxyz) : glm::vec3(1.0f);
+	std::atomic<unsigned char>* brickRequests = _brickRequests.get();
+
+	auto sample = [&](float x, float y, float z)
+	{
+		return streamedData != nullptr ? sampleStreamedVolume<T>(*streamedData, brickRequests, fallback, fallbackScale, x, y, z) : sampleVolume<T>(vdata, x, y, z);
+	};
+
+	// stored value to transfer function coordinate, as the UNORM image and min_max_values do in the kernel
+	const glm::float2 range = _vdata->getNormalizedRange();
+	const float densityScale = _vdata->getNormalizedScale() / (range.y - range.x);
+	const float densityOffset = -range.x / (range.y - range.x);
+	const float* tf = _transferFunction.data();
+	const float maxOpacity = 0.95f; // the opacity threshold
+	const float hitOpacity = 0.5f; // the accumulated opacity at which the surface used for shading is located
+	const glm::vec3 volumeOrigin = origin + pMax; // the eye position in voxel coordinates
+
+	while (numActive > 0)
+	{
+		alignas(32) float density[PacketSize];
+		alignas(32) float r[PacketSize], g[PacketSize], b[PacketSize], a[PacketSize];
+
+		// gather the samples of the active lanes
+		for (int l = 0; l < PacketSize; l++)
+		{
+			density[l] = active[l] > 0.0f ? sample(
+				(volumeOrigin.x + dirX[l] * t[l]) * levelScale.x,
+				(volumeOrigin.y + dirY[l] * t[l]) * levelScale.y,
+				(volumeOrigin.z + dirZ[l] * t[l]) * levelScale.z) * densityScale + densityOffset : 0.0f;
+		}
+
+		for (int l = 0; l < PacketSize; l++)
+		{
+			lookupTransferFunction(tf, density[l], r[l], g[l], b[l], a[l]);
+		}
+
+		// front to back compositing, inactive lanes have a zero weight
+		numActive = 0;
+		for (int l = 0; l < PacketSize; l++)
+		{
+			const float weight = active[l] * (1.0f - accumA[l]) * a[l];
+			accumR[l] += weight * r[l];
+			accumG[l] += weight * g[l];
+			accumB[l] += weight * b[l];
+			accumA[l] += weight;
+
+			tHit[l] = (tHit[l] < 0.0f && accumA[l] >= hitOpacity) ? t[l] : tHit[l];
+			t[l] += stepSize;
+
+			// early ray termination
+			active[l] = (active[l] > 0.0f && t[l] < tFar[l] && accumA[l] < maxOpacity) ? 1.0f : 0.0f;
+			numActive += (int)active[l];
+		}
+	}
+
+	// resolve the packet into the framebuffer
+	const glm::vec3 gradientTop = glm::vec3(211.0f, 0.0f, 211.0f) / 255.0f;
+	const glm::vec3 gradientBottom = glm::vec3(1.0f);
+	const float gradientT = (float)py / (float)_height;
+	const glm::vec3 background = gradientT * gradientBottom + gradientTop * (1.0f - gradientT);
+
+	unsigned char* pixels = &_framebuffer[4 * ((size_t)py * _width + px)];
+
+	for (int l = 0; l < count; l++)
+	{
+		glm::vec3 color(accumR[l], accumG[l], accumB[l]);
+		float opacity = accumA[l];
+
+		switch (_renderType)
+		{
+		case Shaded:
+			if (tHit[l] >= 0.0f)
+			{
+				// the gradient volume of the level at the surface, or central differences without one, lit by a headlight
+				const glm::vec3 rayDir(dirX[l], dirY[l], dirZ[l]);
+				const glm::vec3 p = (volumeOrigin + rayDir * tHit[l]) * levelScale;
+				const glm::vec3 gradient = vdata.hasGradients() ? -glm::vec3(sampleGradient(vdata, p.x, p.y, p.z)) : glm::vec3(
+					sample(p.x - 1.0f, p.y, p.z) - sample(p.x + 1.0f, p.y, p.z),
+					sample(p.x, p.y - 1.0f, p.z) - sample(p.x, p.y + 1.0f, p.z),
+					sample(p.x, p.y, p.z - 1.0f) - sample(p.x, p.y, p.z + 1.0f));
+
+				const float gradientLength = glm::length(gradient);
+				const float lighting = gradientLength > 0.0f ?
+					glm::clamp(glm::dot(-rayDir, gradient / gradientLength), 0.135f, 1.0f) : 1.0f;
+				color *= lighting;
+			}
+			break;
+		case Unshaded:
+			break;
+		case Opacity:
+			color = glm::vec3(opacity);
+			opacity = 1.0f;
+			break;
+		case Depth:
+			color = glm::vec3(tHit[l] >= 0.0f ? (tHit[l] - tNear[l]) / (tFar[l] - tNear[l]) : 0.0f);
+			opacity = 1.0f;
+			break;
+		}
+
+		const glm::vec3 finalColor = glm::clamp(background * (1.0f - opacity) + color, 0.0f, 1.0f) * 255.0f;
+
+		pixels[l * 4] = (unsigned char)finalColor.r;
+		pixels[l * 4 + 1] = (unsigned char)finalColor.g;
+		pixels[l * 4 + 2] = (unsigned char)finalColor.b;
+		pixels[l * 4 + 3] = 255;
+	}
+}
+
+void CPUVolumeRenderer::uploadFramebuffer()
+{
+	if (_headless || _glTexture == (unsigned int)-1) return;
+
+	glBindTexture(GL_TEXTURE_2D, _glTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, _framebuffer.data());
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "AbstractVolumeRenderer.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class StreamedVolumeData;
+
+// Native ray marching backend, renders into a host RGBA8 framebuffer.
+// The screen is split in tiles scheduled with work stealing on all the cores,
+// and every tile is marched in packets of PacketSize rays laid out as SoA lanes.
+class CPUVolumeRenderer : public AbstractVolumeRenderer
+{
+public:
+	static const int TileSize = 16;
+	static const int PacketSize = 8;
+	static const int TFResolution = 1024;
+
+	virtual void init() override;
+	virtual void cleanup() override;
+	virtual void render() override;
+	virtual void setViewport(int x, int y, int w, int h) override;
+	virtual void setVolumeData(VolumeData* vdata) override;
+	// the volume is converted to the bricked layout, rays then hit as few pages whatever their direction
+	virtual void prepareVolumeData(VolumeData* vdata) const override;
+	virtual void setTransferFunction(const TransferFunction& colors) override;
+	virtual bool readFramebuffer(unsigned char* rgbaPixels) override;
+	virtual void setStepSize(float stepSize) override;
+
+	// RGBA8 pixels of the last rendered frame, row 0 being the bottom of the viewport
+	const unsigned char* getFramebuffer() const;
+protected:
+	void renderTile(int tileIndex);
+	template <typename T> void renderPacket(int px, int py, int count);
+	void updateCorrectedOpacities();
+	float getLevelStepSize() const; // in full resolution voxels, for the rendered level
+	void uploadFramebuffer();
+	// queues the bricks of a streamed level the rays missed in the frame
+	void requestMissingBricks(const StreamedVolumeData* levelData);
+
+	std::vector<unsigned char> _framebuffer;
+	std::vector<float> _transferFunction; // RGBA, the alpha channel is corrected for _stepSize
+	std::vector<float> _transferFunctionOpacities; // uncorrected alpha channel
+	float _correctedStepSize = 1.0f; // step the corrected opacities are computed for
+	int _numTilesX = 0, _numTilesY = 0;
+
+	// feedback of the rays : one flag per brick of the streamed level rendered, set when a sample missed it
+	std::unique_ptr<std::atomic<unsigned char>[]> _brickRequests;
+	size_t _numBrickRequests = 0;
+};
@@ -212,7 +212,8 @@ void CurveEditorWidget::updateGraphs()
 {
 	_pointsGraph->data()->set(_points);
 	_curveGraph->data()->set(_points);
-	replot();
+	// redrawn once per event loop iteration however many moves came in, the renderer applies the edits per frame
+	replot(QCustomPlot::rpQueuedReplot);
 	emit colorsUpdated(getTransferFunction());
 }
 
@@ -261,6 +262,21 @@ QVector<QPair<QPointF, QColor>> CurveEditorWidget::getTransferFunction() const
 	return std::move(points);
 }
 
+void CurveEditorWidget::setTransferFunction(const QVector<QPair<QPointF, QColor>>& points)
+{
+	if (points.size() < 2) return;
+
+	_points.clear();
+	_colors.clear();
+	for (const auto& point : points)
+	{
+		addPoint(point.first.x(), point.first.y(), point.second.rgb());
+	}
+
+	_selectedPointIndex = -1;
+	updateGraphs();
+}
+
 int CurveEditorWidget::getSelectedPoint(int x, int y)
 {
 	const float w = width();
@@ -30,6 +30,7 @@ public:
 	void setHistogram(unsigned int numBins, unsigned int* bins);
 
 	QVector<QPair<QPointF, QColor>> getTransferFunction() const;
+	void setTransferFunction(const QVector<QPair<QPointF, QColor>>& points);
 protected slots:
 	void onMouseDoubleClick(QMouseEvent* e);
 	void onMousePress(QMouseEvent* e);
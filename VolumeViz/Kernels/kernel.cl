@@ -77,7 +77,51 @@ int3 clampVolume(const int3 index, const int3 dims)
 const sampler_t volume_image_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
 const sampler_t map_image_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
 const sampler_t tf_image_sampler = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+const sampler_t page_table_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// The level is either a single image, or with PAGED_VOLUME the atlas of the device brick cache (volumeDataImage)
+// and its page table : one RGBA16UI entry per brick (slot x, y, z, resident), pagingInfo being (brick size, slot size).
+// The bricks that are not resident are sampled from fallbackImage, a coarser level the device holds entirely.
+// Every brick sampled is flagged in brickRequests, the host makes them resident for the next frame.
+#ifdef PAGED_VOLUME
+#define VOLUME_PARAMS __read_only image3d_t volumeDataImage, int3 numCells, __read_only image3d_t pageTable, __read_only image3d_t fallbackImage, int4 pagingInfo, float4 fallbackScale, __global uchar* brickRequests
+#define VOLUME_ARGS volumeDataImage, numCells, pageTable, fallbackImage, pagingInfo, fallbackScale, brickRequests
+#else
+#define VOLUME_PARAMS __read_only image3d_t volumeDataImage, int3 numCells
+#define VOLUME_ARGS volumeDataImage, numCells
+#endif
+
+float sampleVolume(float3 position, VOLUME_PARAMS)
+{
+#ifdef PAGED_VOLUME
+	// clamped like the edges of an image, the linear filter then stays within the apron of the slot
+	const float3 p = clamp(position, (float3)(0.5f), convert_float3(numCells) - 0.5f);
+	const int brickSize = pagingInfo.x;
+	const int3 brick = min(convert_int3(p) / brickSize, (numCells - 1) / brickSize);
+	const uint4 entry = read_imageui(pageTable, page_table_sampler, (int4)(brick, 0));
+
+	// a store only when it changes, the neighbouring rays hit the same bricks
+	const int3 numBricks = (numCells + brickSize - 1) / brickSize;
+	const int brickIndex = (brick.z * numBricks.y + brick.y) * numBricks.x + brick.x;
+	if (brickRequests[brickIndex] == 0)
+		brickRequests[brickIndex] = 1;
+
+	if (entry.w == 0)
+		return read_imagef(fallbackImage, volume_image_sampler, (float4)(position * fallbackScale.xyz, 0.0f)).x;
+
+	const float3 atlasPosition = p + convert_float3(convert_int3(entry.xyz) * pagingInfo.y - brick * brickSize + 1);
+	return read_imagef(volumeDataImage, volume_image_sampler, (float4)(atlasPosition, 0.0f)).x;
+#else
+	return read_imagef(volumeDataImage, volume_image_sampler, (float4)(position, 0.0f)).x;
+#endif
+}
+
 
+// the density mapped to the transfer function coordinate, 16 bits and float volumes rarely span their whole range
+float sampleDensity(float3 position, float2 min_max_values, VOLUME_PARAMS)
+{
+	return (sampleVolume(position, VOLUME_ARGS) - min_max_values.x) / (min_max_values.y - min_max_values.x);
+}
 
 __kernel void ssaoKernel(
 	__write_only image2d_t occlusionMap,
@@ -220,47 +264,72 @@ void clearMaps(int2 pixelCoords,
 	write_imagef(positionMap, pixelCoords, 0.0f);
 }
 
-float3 computeNormal(float3 intersectionPoint,
-	int2 pixelCoords,
-	__read_only image1d_t tf_image,
-	__read_only image3d_t volumeDataImage) {
-	const float eps = 1.25f;
-
-	// pseudo sobel operator
-	float operatorValues[3][3] = {
-		{1, 2, 1},
-		{2, 4, 2},
-		{1, 2, 1}
-	};
-
-	float values[3][3][3];
-
-	for (int i = 0; i < 3; i++) {
-		for (int j = 0; j < 3; j++) {
-			for (int k = 0; k < 3; k++) {
-				float3 offset = (float3)(i - 1, j - 1, k - 1);
-				float4 samplePos = (float4)(intersectionPoint.xyz + offset * eps, 0.0f);
-				float density = read_imagef(volumeDataImage, volume_image_sampler, samplePos).x;
-				//float opacity = read_imagef(tf_image, tf_image_sampler, density).w;
-				values[i][j][k] = density;
-			}
-		}
+// Gradient of the transfer function coordinate at position : direction in xyz, magnitude in w.
+// A single fetch of the gradient volume of the level (RGBA8 : direction mapped to [0, 1], magnitude / gradientScale)
+// when there is one (gradientScale > 0), central differences of 6 samples otherwise.
+float4 computeGradient(float3 position,
+	__read_only image3d_t gradientImage,
+	float gradientScale,
+	float2 min_max_values,
+	VOLUME_PARAMS) {
+	if (gradientScale > 0.0f) {
+		const float4 packed = read_imagef(gradientImage, volume_image_sampler, (float4)(position, 0.0f));
+		const float3 direction = packed.xyz * 2.0f - 1.0f;
+		const float directionLength = length(direction);
+		return (float4)(directionLength > 0.0f ? direction / directionLength : direction, packed.w * gradientScale);
 	}
 
-	float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+	const float3 gradient = (float3)(
+		sampleVolume(position + (float3)(1.0f, 0.0f, 0.0f), VOLUME_ARGS) - sampleVolume(position - (float3)(1.0f, 0.0f, 0.0f), VOLUME_ARGS),
+		sampleVolume(position + (float3)(0.0f, 1.0f, 0.0f), VOLUME_ARGS) - sampleVolume(position - (float3)(0.0f, 1.0f, 0.0f), VOLUME_ARGS),
+		sampleVolume(position + (float3)(0.0f, 0.0f, 1.0f), VOLUME_ARGS) - sampleVolume(position - (float3)(0.0f, 0.0f, 1.0f), VOLUME_ARGS))
+		* 0.5f / (min_max_values.y - min_max_values.x);
+	const float magnitude = length(gradient);
+	return (float4)(magnitude > 0.0f ? gradient / magnitude : gradient, magnitude);
+}
 
-	for (int i = 0; i < 3; i++) {
-		for (int j = 0; j < 3; j++) {
-			gx += operatorValues[i][j] * (values[0][i][j] - values[2][i][j]);
-			gy += operatorValues[i][j] * (values[i][0][j] - values[i][2][j]);
-			gz += operatorValues[i][j] * (values[i][j][0] - values[i][j][2]);
+// Empty space skipping : the bricks of the min/max grid (occupancyInfo : grid size, brick size) the transfer function
+// makes fully transparent are crossed brick after brick along the ray (DDA). Returns how far to move along direction
+// to the first occupied brick, or out of the grid, 0 when position is already in an occupied one.
+float skipEmptySpace(float3 position, float3 direction, __global const uchar* occupancy, int4 occupancyInfo)
+{
+	if (occupancyInfo.w == 0) return 0.0f;
+
+	const int3 gridSize = occupancyInfo.xyz;
+	const float brickSize = (float)occupancyInfo.w;
+	int3 brick = convert_int3(floor(position / brickSize));
+
+	// distance to the next face along every axis, and between two faces
+	const int3 forward = direction > 0.0f;
+	const int3 parallelAxes = fabs(direction) < 0.000001f;
+	const int3 step = select((int3)(-1), (int3)(1), forward);
+	const float3 faces = (convert_float3(brick) + select((float3)(0.0f), (float3)(1.0f), forward)) * brickSize;
+	float3 next = select((faces - position) / direction, (float3)(FLT_MAX), parallelAxes);
+	const float3 delta = select(brickSize / fabs(direction), (float3)(FLT_MAX), parallelAxes);
+	float distance = 0.0f;
+
+	while (all(brick >= 0) && all(brick < gridSize) &&
+		occupancy[(brick.z * gridSize.y + brick.y) * gridSize.x + brick.x] == 0) {
+		// into the brick behind the nearest face
+		if (next.x <= next.y && next.x <= next.z) {
+			distance = next.x;
+			brick.x += step.x;
+			next.x += delta.x;
+		}
+		else if (next.y <= next.z) {
+			distance = next.y;
+			brick.y += step.y;
+			next.y += delta.y;
+		}
+		else {
+			distance = next.z;
+			brick.z += step.z;
+			next.z += delta.z;
 		}
 	}
-
-	return normalize((float3)(gx, gy, gz));
+	return fmax(distance, 0.0f);
 }
 
-
 // Progressive volume rendering kernel
 __kernel void volumeRenderingKernelProgressiveAlt(
 	__constant const float4* invModelViewProjMatrix,
@@ -277,7 +346,21 @@ __kernel void volumeRenderingKernelProgressiveAlt(
 	__read_write image2d_t normalMap,
 	__read_write image2d_t densityMap,
 	__read_write image2d_t positionMap,
-	int updateRequested)
+	int updateRequested,
+	__global const uchar* occupancy,
+	int4 occupancyInfo,
+	__read_only image3d_t gradientImage,
+	float gradientScale,
+	__read_only image2d_t preIntegrationTable,
+	float2 stepInfo
+#ifdef PAGED_VOLUME
+	, __read_only image3d_t pageTable,
+	__read_only image3d_t fallbackImage,
+	int4 pagingInfo,
+	float4 fallbackScale,
+	__global uchar* brickRequests
+#endif
+)
 {
 	const int2 pixelCoords = (int2)(get_global_id(0), get_global_id(1));
 	const int width = get_image_width(colorMap);
@@ -328,52 +411,115 @@ __kernel void volumeRenderingKernelProgressiveAlt(
 			const float3 deltaStep3f = ((pMax - pMin) / largeDist) * ray.direction;
 			const float deltaStep1f = length(deltaStep3f);
 
-			while (true) {
-				// read the density at the current intersectionPoint
-				float density = read_imagef(volumeDataImage,
-					volume_image_sampler,
-					(float4)(intersectionPoint.xyz, 0.0f)).x;
+			if (stepInfo.x > 0.0f) {
+				// Pre-integrated : the segment between two samples (stepInfo.x apart) is composited at once from the table
+				// of its front and back densities, its opacity is exact whatever the step.
+				// The extinctions are per full resolution voxel, stepInfo.y being the size of a voxel of the level.
+				const float stepLength = deltaStep1f * stepInfo.x;
+				const float extinctionScale = stepLength * stepInfo.y;
+
+				// premultiplied while marching
+				accumColor *= accumOpacity;
+				accumDensity *= accumOpacity;
+				float frontDensity = sampleDensity(intersectionPoint, min_max_values, VOLUME_ARGS);
+
+				while (true) {
+					// jump over the bricks the transfer function makes transparent
+					const float skip = skipEmptySpace(intersectionPoint, deltaStep3f, occupancy, occupancyInfo);
+					if (skip > 0.0f) {
+						depth += deltaStep1f * skip;
+						if (depth >= maxDepth) {
+							break;
+						}
+						intersectionPoint += deltaStep3f * skip;
+						frontDensity = sampleDensity(intersectionPoint, min_max_values, VOLUME_ARGS);
+					}
 
-				//density = (density - min_max_values.x) / (min_max_values.y - min_max_values.x);
+					depth += stepLength;
+					if (depth >= maxDepth) {
+						break;
+					}
+					intersectionPoint += deltaStep3f * stepInfo.x;
 
-				// compute the corresponding color in the transfer function for the current density
-				float4 color = read_imagef(tf_image, tf_image_sampler, density);
-				float opacity = color.w;
+					const float backDensity = sampleDensity(intersectionPoint, min_max_values, VOLUME_ARGS);
+					const float4 segment = read_imagef(preIntegrationTable, tf_image_sampler, (float2)(frontDensity, backDensity));
+					const float weight = (1.0f - accumOpacity) * (1.0f - exp(-segment.w * extinctionScale));
 
-				float stepAcceleration = 2.25f;
+					accumColor.xyz += weight * segment.xyz;
+					accumDensity += weight * 0.5f * (frontDensity + backDensity);
+					accumOpacity += weight;
 
-				if (opacity > 0.001f) {
+					// early ray termination
+					if (accumOpacity >= maxOpacity) {
+						break;
+					}
+					frontDensity = backDensity;
+				}
+
+				if (accumOpacity > 0.0f) {
+					accumColor /= accumOpacity;
+					accumDensity /= accumOpacity;
+				}
+			}
+			else {
+				while (true) {
+					// jump over the bricks the transfer function makes transparent
+					const float skip = skipEmptySpace(intersectionPoint, deltaStep3f, occupancy, occupancyInfo);
+					if (skip > 0.0f) {
+						depth += deltaStep1f * skip;
+						if (depth >= maxDepth) {
+							break;
+						}
+						intersectionPoint += deltaStep3f * skip;
+					}
 
-					float stepsCount = 1.0f / (0.000001f + pow(opacity, 128.0f));
+					// read the density at the current intersectionPoint
+					float density = sampleVolume(intersectionPoint, VOLUME_ARGS);
 
-					float3 nextIntersectionPoint = ceil(intersectionPoint + ray.direction * stepAcceleration);
+					// 16 bits and float volumes rarely span their whole range
+					density = (density - min_max_values.x) / (min_max_values.y - min_max_values.x);
 
-					float segmentLength = pow(length(nextIntersectionPoint - intersectionPoint), 2.0f);
+					// compute the corresponding color in the transfer function for the current density
+					// the opacities of the transfer function are for a full resolution voxel,
+					// a sample of a coarser level stands for stepInfo.y of them
+					float4 color = read_imagef(tf_image, tf_image_sampler, density);
+					float opacity = 1.0f - pow(1.0f - color.w, stepInfo.y);
 
-					stepAcceleration = segmentLength;
+					float stepAcceleration = 2.25f;
 
-					float oneMinusOpacity = 1.0f - opacity;
-					float oneMinusOpacityPowerN = pow(oneMinusOpacity, stepsCount);
+					if (opacity > 0.001f) {
 
-					accumDensity = accumDensity * oneMinusOpacityPowerN + density * (1.0f - oneMinusOpacityPowerN);
+						float stepsCount = 1.0f / (0.000001f + pow(opacity, 128.0f));
 
-					accumColor = accumColor * oneMinusOpacityPowerN + color * (1.0f - oneMinusOpacityPowerN);
-					accumOpacity = accumOpacity * oneMinusOpacityPowerN + (1.0f - oneMinusOpacityPowerN);
+						float3 nextIntersectionPoint = ceil(intersectionPoint + ray.direction * stepAcceleration);
 
-					// stop the raymarching if the pixel is fully opaque
-					// this technique is called "Early ray termination"
-					if (accumOpacity >= maxOpacity) {
-						break;
+						float segmentLength = pow(length(nextIntersectionPoint - intersectionPoint), 2.0f);
+
+						stepAcceleration = segmentLength;
+
+						float oneMinusOpacity = 1.0f - opacity;
+						float oneMinusOpacityPowerN = pow(oneMinusOpacity, stepsCount);
+
+						accumDensity = accumDensity * oneMinusOpacityPowerN + density * (1.0f - oneMinusOpacityPowerN);
+
+						accumColor = accumColor * oneMinusOpacityPowerN + color * (1.0f - oneMinusOpacityPowerN);
+						accumOpacity = accumOpacity * oneMinusOpacityPowerN + (1.0f - oneMinusOpacityPowerN);
+
+						// stop the raymarching if the pixel is fully opaque
+						// this technique is called "Early ray termination"
+						if (accumOpacity >= maxOpacity) {
+							break;
+						}
 					}
-				}
 
-				depth += deltaStep1f * (stepAcceleration)*globalStepAcceleration;
+					depth += deltaStep1f * (stepAcceleration)*globalStepAcceleration;
 
-				if (depth >= maxDepth) {
-					break;
-				}
+					if (depth >= maxDepth) {
+						break;
+					}
 
-				intersectionPoint += deltaStep3f * (stepAcceleration)*globalStepAcceleration;
+					intersectionPoint += deltaStep3f * (stepAcceleration)*globalStepAcceleration;
+				}
 			}
 
 			write_imagef(positionMap, pixelCoords, (float4)(intersectionPoint, 0.0f)); // write the current position to the positionMap			
@@ -382,8 +528,9 @@ __kernel void volumeRenderingKernelProgressiveAlt(
 			write_imagef(opacityMap, pixelCoords, accumOpacity); // write the current opacity to the opacityMap
 			write_imagef(colorMap, pixelCoords, (float4)(accumColor.xyz, accumOpacity)); // write the current color to the colorMap
 
-			float3 normal = computeNormal(intersectionPoint, pixelCoords, tf_image, volumeDataImage);
-			write_imagef(normalMap, pixelCoords, (float4)(normal, 0.0f)); // write the computed normal vector to the normalMap
+			// the normal faces the lower densities, the gradient magnitude is kept in w
+			float4 gradient = computeGradient(intersectionPoint, gradientImage, gradientScale, min_max_values, VOLUME_ARGS);
+			write_imagef(normalMap, pixelCoords, (float4)(-gradient.xyz, gradient.w)); // write the computed normal vector to the normalMap
 		}
 	}
 	else { // no intersection found
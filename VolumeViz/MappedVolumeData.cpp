@@ -0,0 +1,107 @@
+#include "MappedVolumeData.h"
+#include <QDebug>
+
+MappedVolumeData::MappedVolumeData()
+{
+}
+
+MappedVolumeData::~MappedVolumeData()
+{
+	unmap();
+}
+
+bool MappedVolumeData::map(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType)
+{
+	if (!mapFile(path, offset, (qint64)getVoxelSize(voxelType) * nx * ny * nz))
+		return false;
+
+	_nxyz = glm::int3(nx, ny, nz);
+	_sxyz = glm::float3(sx, sy, sz);
+	_voxelType = voxelType;
+	_layout = Linear;
+	_brickShift = 0;
+	_numBricks = glm::int3(0);
+	_brickTable.clear();
+	_data = (VolumeData::DataType*)_mapping;
+
+	return true;
+}
+
+bool MappedVolumeData::mapBricked(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize)
+{
+	_nxyz = glm::int3(nx, ny, nz);
+	_sxyz = glm::float3(sx, sy, sz);
+	_voxelType = voxelType;
+	setBrickedLayout(brickSize);
+
+	if (!mapFile(path, offset, (qint64)getDataSize()))
+	{
+		_layout = Linear;
+		_brickShift = 0;
+		_numBricks = glm::int3(0);
+		_brickTable.clear();
+		return false;
+	}
+
+	_data = (VolumeData::DataType*)_mapping;
+	return true;
+}
+
+bool MappedVolumeData::mapFile(const QString& path, qint64 offset, qint64 size)
+{
+	unmap();
+
+	if (_data != nullptr)
+	{
+		delete[] _data;
+		_data = nullptr;
+	}
+
+	_file.setFileName(path);
+	if (!_file.open(QIODevice::OpenModeFlag::ReadOnly))
+		return false;
+
+	if (offset + size > _file.size())
+	{
+		qDebug() << "Truncated volume file" << path;
+		_file.close();
+		return false;
+	}
+
+	// Qt takes care of page aligning the offset
+	_mapping = _file.map(offset, size, QFileDevice::MapPrivateOption);
+	if (_mapping == nullptr)
+	{
+		qDebug() << "Cannot map" << path << ":" << _file.errorString();
+		_file.close();
+		return false;
+	}
+	return true;
+}
+
+void MappedVolumeData::unmap()
+{
+	if (_mapping == nullptr) return;
+
+	_file.unmap(_mapping);
+	_file.close();
+	_mapping = nullptr;
+	_data = nullptr; // not owned, must not reach delete[]
+}
+
+bool MappedVolumeData::isMapped() const
+{
+	return _mapping != nullptr;
+}
+
+void MappedVolumeData::init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, bool clear)
+{
+	unmap();
+	VolumeData::init(nx, ny, nz, sx, sy, sz, voxelType, clear);
+}
+
+void MappedVolumeData::replaceData(DataType* data)
+{
+	unmap();
+	VolumeData::replaceData(data);
+}
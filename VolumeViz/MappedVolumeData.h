@@ -0,0 +1,32 @@
+#pragma once
+
+#include "VolumeData.h"
+#include <QFile>
+
+// Volume whose voxels are read straight from a memory mapping of a file.
+// The pages are loaded on demand and shared through the page cache by every
+// process mapping the same file, the mapping is private so it never writes back.
+class MappedVolumeData : public VolumeData
+{
+public:
+	MappedVolumeData();
+	virtual ~MappedVolumeData();
+
+	// maps the nx * ny * nz voxels stored at offset in the file
+	bool map(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType = UInt8);
+	// same for voxels stored in the bricked layout (the bricks of a .bin v3 level), brickSize must be a power of two
+	bool mapBricked(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize);
+	void unmap();
+	virtual bool isMapped() const override;
+
+	// replaces the mapping by a regular allocation
+	virtual void init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType = UInt8, bool clear = true) override;
+protected:
+	// a layout conversion leaves the mapping for a regular allocation
+	virtual void replaceData(DataType* data) override;
+
+	bool mapFile(const QString& path, qint64 offset, qint64 size);
+
+	QFile _file;
+	uchar* _mapping = nullptr;
+};
@@ -0,0 +1,331 @@
+#include "OpenCLBrickCache.h"
+#include "StreamedVolumeData.h"
+#include <algorithm>
+#include <cmath>
+
+void checkOCLError(cl_int error);
+
+cl::ImageFormat OpenCLBrickCache::getImageFormat(VolumeData::VoxelType voxelType)
+{
+	// the voxels are uploaded as they are, the kernel normalizes them with min_max_values
+	cl_channel_type channelType = CL_UNORM_INT8;
+	if (voxelType == VolumeData::UInt16) channelType = CL_UNORM_INT16;
+	else if (voxelType == VolumeData::Float32) channelType = CL_FLOAT;
+	return cl::ImageFormat(CL_INTENSITY, channelType);
+}
+
+void OpenCLBrickCache::init(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& commandQueue, VolumeData::VoxelType voxelType, size_t budget)
+{
+	cleanup();
+
+	_context = context;
+	_commandQueue = commandQueue;
+	_voxelType = voxelType;
+	_slotBytes = (size_t)SlotSize * SlotSize * SlotSize * VolumeData::getVoxelSize(voxelType);
+
+	// a single allocation, as cubic as the image limits allow
+	budget = std::min<size_t>(budget, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+	const glm::int3 maxSlots = glm::int3(
+		(int)(device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>() / SlotSize),
+		(int)(device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>() / SlotSize),
+		(int)(device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>() / SlotSize));
+	const size_t numSlots = std::max<size_t>(budget / _slotBytes, 1);
+	const int side = (int)std::ceil(std::cbrt((double)numSlots));
+
+	_numSlots.x = std::max(std::min(side, maxSlots.x), 1);
+	_numSlots.y = std::max(std::min(side, maxSlots.y), 1);
+	_numSlots.z = std::max(std::min((int)(numSlots / ((size_t)_numSlots.x * _numSlots.y)), maxSlots.z), 1);
+
+	_atlas = cl::Image3D(_context, CL_MEM_READ_ONLY, getImageFormat(voxelType),
+		_numSlots.x * SlotSize, _numSlots.y * SlotSize, _numSlots.z * SlotSize);
+
+	const int capacity = getCapacity();
+	_slotBricks.assign(capacity, -1);
+	_slotLastUsed.assign(capacity, 0);
+	_stagingBuffer.resize(MaxUploadsPerFrame * _slotBytes);
+}
+
+void OpenCLBrickCache::cleanup()
+{
+	waitForTransfers();
+	setLevel(nullptr);
+	_atlas = cl::Image3D();
+	_numSlots = glm::int3(0);
+	_slotBricks.clear();
+	_slotLastUsed.clear();
+	_stagingBuffer.clear();
+	_boxBuffer.clear();
+}
+
+bool OpenCLBrickCache::isInitialized() const
+{
+	return getCapacity() > 0;
+}
+
+void OpenCLBrickCache::setLevel(const VolumeData* level)
+{
+	if (level == _level) return;
+
+	// the requests in flight were for the previous level
+	waitForTransfers();
+	_requestsEvent = cl::Event();
+	_level = level;
+	_numBricks = level != nullptr ? (level->_nxyz + BrickSize - 1) / BrickSize : glm::int3(0);
+
+	const size_t numBricks = (size_t)_numBricks.x * _numBricks.y * _numBricks.z;
+	_brickSlots.assign(numBricks, -1);
+	_pageTableEntries.assign(numBricks * 4, 0);
+	std::fill(_slotBricks.begin(), _slotBricks.end(), -1);
+	std::fill(_slotLastUsed.begin(), _slotLastUsed.end(), 0);
+	_numResidentBricks = 0;
+
+	_requests.assign(numBricks, 0);
+
+	if (level == nullptr)
+	{
+		_pageTable = cl::Image3D();
+		_requestsBuffer = cl::Buffer();
+		_pageTableDirty = false;
+		return;
+	}
+
+	// nothing resident, from the first frame sampling the level
+	_pageTable = cl::Image3D(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT16),
+		_numBricks.x, _numBricks.y, _numBricks.z, 0, 0, _pageTableEntries.data());
+	_requestsBuffer = cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, numBricks, _requests.data());
+	_pageTableDirty = false;
+}
+
+const VolumeData* OpenCLBrickCache::getLevel() const
+{
+	return _level;
+}
+
+void OpenCLBrickCache::enqueueRequestsRead(const std::vector<cl::Event>& waitEvents, cl::Event& clearEvent)
+{
+	if (_level == nullptr) return;
+
+	// a read left unconsumed is overwritten, its bricks are flagged again by the next frames
+	std::vector<cl::Event> readWaitEvents = waitEvents;
+	if (_requestsEvent() != nullptr)
+		readWaitEvents.push_back(_requestsEvent);
+
+	int result = _commandQueue.enqueueReadBuffer(_requestsBuffer, false, 0, _requests.size(), _requests.data(),
+		readWaitEvents.empty() ? nullptr : &readWaitEvents, &_requestsEvent);
+	checkOCLError(result);
+
+	const cl_uchar zero = 0;
+	const std::vector<cl::Event> clearWaitEvents(1, _requestsEvent);
+	result = _commandQueue.enqueueFillBuffer(_requestsBuffer, zero, 0, _requests.size(), &clearWaitEvents, &clearEvent);
+	checkOCLError(result);
+}
+
+bool OpenCLBrickCache::readRequests(std::vector<size_t>& brickIndices)
+{
+	brickIndices.clear();
+	if (_level == nullptr || _requestsEvent() == nullptr) return false;
+
+	int result = _requestsEvent.wait();
+	checkOCLError(result);
+	_requestsEvent = cl::Event();
+
+	for (size_t b = 0; b < _requests.size(); b++)
+	{
+		if (_requests[b] != 0)
+			brickIndices.push_back(b);
+	}
+	return true;
+}
+
+bool OpenCLBrickCache::update(const std::vector<size_t>& brickIndices, std::vector<cl::Event>& uploadEvents)
+{
+	if (_level == nullptr || !isInitialized()) return false;
+
+	// the staging buffer and the page table entries are rewritten, the kernels of the last frame waited for their writes
+	if (!_uploadEvents.empty())
+	{
+		int result = cl::Event::waitForEvents(_uploadEvents);
+		checkOCLError(result);
+		_uploadEvents.clear();
+	}
+
+	_frame++;
+	const size_t numWanted = std::min(brickIndices.size(), _slotBricks.size());
+
+	// the wanted bricks already resident are kept, the other slots are free or evicted least recently used first
+	for (size_t i = 0; i < numWanted; i++)
+	{
+		const int slot = _brickSlots[brickIndices[i]];
+		if (slot >= 0) _slotLastUsed[slot] = _frame;
+	}
+
+	std::vector<std::pair<unsigned int, int>> candidates;
+	for (int slot = 0; slot < (int)_slotLastUsed.size(); slot++)
+	{
+		if (_slotLastUsed[slot] != _frame)
+			candidates.emplace_back(_slotLastUsed[slot], slot);
+	}
+	const size_t numCandidates = std::min(candidates.size(), (size_t)MaxUploadsPerFrame);
+	std::partial_sort(candidates.begin(), candidates.begin() + numCandidates, candidates.end());
+
+	int numUploads = 0;
+	bool pending = false;
+	int result = CL_SUCCESS;
+
+	for (size_t i = 0; i < numWanted; i++)
+	{
+		const size_t brickIndex = brickIndices[i];
+		if (_brickSlots[brickIndex] >= 0) continue;
+
+		if (numUploads == (int)numCandidates)
+		{
+			pending = true;
+			break;
+		}
+
+		VolumeData::DataType* data = _stagingBuffer.data() + numUploads * _slotBytes;
+		if (!readBrick(brickIndex, data)) continue;
+
+		const int slot = candidates[numUploads].second;
+		if (_slotBricks[slot] >= 0)
+		{
+			_brickSlots[_slotBricks[slot]] = -1;
+			setPageTableEntry(_slotBricks[slot], -1);
+			_numResidentBricks--;
+		}
+
+		cl::size_t<3> origin, region;
+		origin[0] = (slot % _numSlots.x) * SlotSize;
+		origin[1] = (slot / _numSlots.x % _numSlots.y) * SlotSize;
+		origin[2] = (slot / (_numSlots.x * _numSlots.y)) * SlotSize;
+		region[0] = region[1] = region[2] = SlotSize;
+
+		// the staging buffer outlives the writes, until the next update
+		cl::Event event;
+		result = _commandQueue.enqueueWriteImage(_atlas, false, origin, region, 0, 0, data, nullptr, &event);
+		checkOCLError(result);
+		_uploadEvents.push_back(event);
+
+		_slotBricks[slot] = (int)brickIndex;
+		_slotLastUsed[slot] = _frame;
+		_brickSlots[brickIndex] = slot;
+		setPageTableEntry(brickIndex, slot);
+		_numResidentBricks++;
+		numUploads++;
+	}
+
+	if (_pageTableDirty)
+	{
+		cl::size_t<3> origin, region;
+		region[0] = _numBricks.x;
+		region[1] = _numBricks.y;
+		region[2] = _numBricks.z;
+
+		cl::Event event;
+		result = _commandQueue.enqueueWriteImage(_pageTable, false, origin, region, 0, 0, _pageTableEntries.data(), nullptr, &event);
+		checkOCLError(result);
+		_uploadEvents.push_back(event);
+		_pageTableDirty = false;
+	}
+
+	uploadEvents.insert(uploadEvents.end(), _uploadEvents.begin(), _uploadEvents.end());
+	return pending || numUploads > 0;
+}
+
+int OpenCLBrickCache::getCapacity() const
+{
+	return _numSlots.x * _numSlots.y * _numSlots.z;
+}
+
+int OpenCLBrickCache::getNumResidentBricks() const
+{
+	return _numResidentBricks;
+}
+
+glm::int3 OpenCLBrickCache::getNumBricks() const
+{
+	return _numBricks;
+}
+
+size_t OpenCLBrickCache::getBrickIndex(int bx, int by, int bz) const
+{
+	return ((size_t)bz * _numBricks.y + by) * _numBricks.x + bx;
+}
+
+const cl::Image3D& OpenCLBrickCache::getAtlas() const
+{
+	return _atlas;
+}
+
+const cl::Image3D& OpenCLBrickCache::getPageTable() const
+{
+	return _pageTable;
+}
+
+const cl::Buffer& OpenCLBrickCache::getRequestsBuffer() const
+{
+	return _requestsBuffer;
+}
+
+bool OpenCLBrickCache::readBrick(size_t brickIndex, VolumeData::DataType* dst)
+{
+	const glm::int3 brick = glm::int3((int)(brickIndex % _numBricks.x), (int)(brickIndex / _numBricks.x % _numBricks.y),
+		(int)(brickIndex / ((size_t)_numBricks.x * _numBricks.y)));
+	const glm::int3 origin = brick * BrickSize - 1;
+	const glm::int3 begin = glm::max(origin, glm::int3(0));
+	const glm::int3 end = glm::min(origin + SlotSize, _level->_nxyz);
+	const glm::int3 size = end - begin;
+
+	if (_level->isStreamed() && !static_cast<const StreamedVolumeData*>(_level)->isBoxResident(begin, size))
+		return false;
+
+	if (size == glm::int3(SlotSize))
+	{
+		_level->readBox(begin, size, dst);
+		return true;
+	}
+
+	// clipped by the edges of the volume, the apron outside of it is never weighted by the filter
+	const size_t voxelSize = VolumeData::getVoxelSize(_voxelType);
+	const glm::int3 offset = begin - origin;
+	_boxBuffer.resize(_slotBytes);
+	_level->readBox(begin, size, _boxBuffer.data());
+	memset(dst, 0, _slotBytes);
+
+	for (int z = 0; z < size.z; z++)
+	{
+		for (int y = 0; y < size.y; y++)
+			memcpy(dst + (((size_t)(z + offset.z) * SlotSize + (y + offset.y)) * SlotSize + offset.x) * voxelSize,
+				_boxBuffer.data() + ((size_t)z * size.y + y) * size.x * voxelSize, size.x * voxelSize);
+	}
+	return true;
+}
+
+void OpenCLBrickCache::waitForTransfers()
+{
+	std::vector<cl::Event> events;
+	events.swap(_uploadEvents);
+	if (_requestsEvent() != nullptr)
+		events.push_back(_requestsEvent);
+	if (events.empty()) return;
+
+	int result = cl::Event::waitForEvents(events);
+	checkOCLError(result);
+}
+
+void OpenCLBrickCache::setPageTableEntry(size_t brickIndex, int slot)
+{
+	cl_ushort* entry = _pageTableEntries.data() + brickIndex * 4;
+	if (slot < 0)
+	{
+		entry[3] = 0;
+	}
+	else
+	{
+		entry[0] = (cl_ushort)(slot % _numSlots.x);
+		entry[1] = (cl_ushort)(slot / _numSlots.x % _numSlots.y);
+		entry[2] = (cl_ushort)(slot / (_numSlots.x * _numSlots.y));
+		entry[3] = 1;
+	}
+	_pageTableDirty = true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "VolumeData.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_TARGET_OPENCL_VERSION 120
+#define CL_VERSION_1_2
+#define NOMINMAX
+#include <cl/cl.hpp>
+
+#include <vector>
+
+// Device side cache of the bricks of one level (virtual texturing), for the levels the device cannot hold at once.
+// A fixed size atlas image holds BrickSize^3 bricks surrounded by a one voxel apron, the linear filtering then
+// never reads across two slots, and a page table image maps every brick of the level to its slot
+// (RGBA16UI : slot x, y, z and 1 when resident). The kernel flags the bricks its rays sample in a feedback buffer,
+// they are uploaded for the next frame, the least recently used ones making room for them.
+class OpenCLBrickCache
+{
+public:
+	static const int BrickSize = 32;
+	static const int SlotSize = BrickSize + 2; // apron included
+	static const int MaxUploadsPerFrame = 256; // bounds the time a frame spends uploading
+	static const size_t DefaultBudget = (size_t)512 << 20; // in bytes
+
+	// CL_INTENSITY in the channel type of the voxels, for the atlas and the images of the levels alike
+	static cl::ImageFormat getImageFormat(VolumeData::VoxelType voxelType);
+
+	// allocates the atlas within the budget and the limits of the device
+	void init(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& commandQueue, VolumeData::VoxelType voxelType, size_t budget = DefaultBudget);
+	void cleanup();
+	bool isInitialized() const;
+
+	// the level mapped by the page table, the cache is emptied when it changes
+	void setLevel(const VolumeData* level);
+	const VolumeData* getLevel() const;
+
+	// Reads the flags back once the kernels of waitEvents are done, without waiting for them, then clears them :
+	// the kernels flagging the next frame must wait for clearEvent.
+	void enqueueRequestsRead(const std::vector<cl::Event>& waitEvents, cl::Event& clearEvent);
+	// the bricks flagged in the last read, blocks until it is complete. False when no read was enqueued since the last call.
+	bool readRequests(std::vector<size_t>& brickIndices);
+
+	// makes the bricks resident, the first ones first, within the capacity of the atlas and MaxUploadsPerFrame.
+	// Returns true when some were uploaded or left for later, the frame is then worth rendering again.
+	// The writes are not waited for, their events are added to uploadEvents for the kernels sampling the cache.
+	// The bricks of a streamed level that are not in memory yet are requested from its loading thread instead,
+	// their arrival is reported by updateResidency.
+	bool update(const std::vector<size_t>& brickIndices, std::vector<cl::Event>& uploadEvents);
+
+	int getCapacity() const; // in bricks
+	int getNumResidentBricks() const;
+	glm::int3 getNumBricks() const; // of the level
+	size_t getBrickIndex(int bx, int by, int bz) const;
+	const cl::Image3D& getAtlas() const;
+	const cl::Image3D& getPageTable() const;
+	const cl::Buffer& getRequestsBuffer() const; // one uchar flag per brick
+protected:
+	// the brick and its apron from the host, false when a streamed level does not hold them yet
+	bool readBrick(size_t brickIndex, VolumeData::DataType* dst);
+	void setPageTableEntry(size_t brickIndex, int slot); // slot -1 when evicted
+	// blocks until the device is done with the host copies : the feedback, the staging buffer and the page table entries
+	void waitForTransfers();
+
+	cl::Context _context;
+	cl::CommandQueue _commandQueue;
+	cl::Image3D _atlas, _pageTable;
+	cl::Buffer _requestsBuffer;
+	std::vector<cl_uchar> _requests; // host copy of the feedback
+	cl::Event _requestsEvent; // the read of _requests in flight, null once it is consumed
+	std::vector<cl::Event> _uploadEvents; // the writes of the last update
+	VolumeData::VoxelType _voxelType = VolumeData::UInt8;
+	glm::int3 _numSlots = glm::int3(0);
+	size_t _slotBytes = 0;
+
+	const VolumeData* _level = nullptr;
+	glm::int3 _numBricks = glm::int3(0);
+	std::vector<int> _brickSlots; // slot of every brick of the level, -1 when not resident
+	std::vector<int> _slotBricks; // brick held by every slot, -1 when free
+	std::vector<unsigned int> _slotLastUsed; // frame, 0 when free
+	std::vector<cl_ushort> _pageTableEntries; // host copy, 4 per brick
+	bool _pageTableDirty = false;
+	unsigned int _frame = 0;
+	int _numResidentBricks = 0;
+
+	std::vector<VolumeData::DataType> _stagingBuffer; // the bricks uploaded in a frame
+	std::vector<VolumeData::DataType> _boxBuffer; // the bricks clipped by the volume edges
+};
@@ -1,7 +1,15 @@
 #include "OpenCLVolumeRenderer.h"
+#include "StreamedVolumeData.h"
+#include "Tracer.h"
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <GL/glx.h>
+#endif
 #include <qopengl.h>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
 #include <QDebug>
 
 const char* getOCLErrorString(cl_int error)
@@ -90,9 +98,26 @@ void checkOCLError(cl_int error)
 	assert(error != CL_SUCCESS);
 }
 
+bool OpenCLVolumeRenderer::isAvailable(bool headless)
+{
+	std::vector<cl::Platform> platforms;
+	if (cl::Platform::get(&platforms) != CL_SUCCESS) return false;
+
+	// the devices init() accepts
+	const cl_device_type deviceType = headless ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_GPU;
+	for (auto& platform : platforms)
+	{
+		std::vector<cl::Device> devices;
+		if (platform.getDevices(deviceType, &devices) == CL_SUCCESS && !devices.empty())
+			return true;
+	}
+	return false;
+}
+
 void OpenCLVolumeRenderer::setGLTexture(unsigned int textureId)
 {
 	AbstractVolumeRenderer::setGLTexture(textureId);
+	if (_headless) return;
 	_outputImage = cl::ImageGL(_context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, textureId);
 }
 
@@ -101,59 +126,176 @@ void OpenCLVolumeRenderer::init()
 	std::vector<cl::Platform> platforms;
 	cl::Platform::get(&platforms);
 
-	// Select the default platform and create a context using this platform and the GPU
-	cl_context_properties cps[] = {
-		// opencl platform
-		CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[platforms.size() - 1])(),
-		// opengl platform
-		CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-		CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-		0, 0
-	};
+	if (_headless)
+	{
+		// No GL interop, prefer a GPU but accept any device (e.g. a CPU runtime on render nodes)
+		const cl_device_type deviceTypes[] = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL };
 
-	_context = cl::Context(CL_DEVICE_TYPE_GPU, cps);
+		for (auto deviceType : deviceTypes)
+		{
+			for (auto& platform : platforms)
+			{
+				std::vector<cl::Device> devices;
+				if (platform.getDevices(deviceType, &devices) == CL_SUCCESS && !devices.empty())
+				{
+					_context = cl::Context(devices);
+					break;
+				}
+			}
+			if (_context() != nullptr) break;
+		}
+	}
+	else
+	{
+		// Select the default platform and create a context using this platform and the GPU
+		cl_context_properties cps[] = {
+			// opencl platform
+			CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[platforms.size() - 1])(),
+			// opengl platform
+#ifdef _WIN32
+			CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+			CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+#else
+			CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
+			CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+#endif
+			0, 0
+		};
+
+		_context = cl::Context(CL_DEVICE_TYPE_GPU, cps);
+	}
 
 	// Get a list of devices on this platform
 	auto _devices = _context.getInfo<CL_CONTEXT_DEVICES>();
+	_device = _devices[0];
 
 	// Create a command queue and use the first device
-	_commandQueue = cl::CommandQueue(_context, _devices[0], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+	// the profiling of the events costs little, the timings can be turned on at any time
+	_commandQueue = cl::CommandQueue(_context, _device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE);
 
 	// Read the kernel source from the file
 	std::ifstream fhandle("kernels/kernel.cl");
 	std::string kernel_src = std::string(std::istreambuf_iterator<char>(fhandle), std::istreambuf_iterator<char>());
 
-	// Create and build the program
+	// Create and build the program, a second time for the levels sampled through the brick cache
 	cl::Program program = cl::Program(_context, kernel_src);
 	auto error = program.build();
 
 	if (error != CL_SUCCESS)
 	{
-		qDebug() << "Compilation error : " << error << program.getBuildInfo< CL_PROGRAM_BUILD_LOG>(_devices[0]).c_str();
+		qDebug() << "Compilation error : " << error << program.getBuildInfo< CL_PROGRAM_BUILD_LOG>(_device).c_str();
+		checkOCLError(error);
+	}
+
+	cl::Program pagedProgram = cl::Program(_context, kernel_src);
+	error = pagedProgram.build("-D PAGED_VOLUME");
+
+	if (error != CL_SUCCESS)
+	{
+		qDebug() << "Compilation error : " << error << pagedProgram.getBuildInfo< CL_PROGRAM_BUILD_LOG>(_device).c_str();
 		checkOCLError(error);
 	}
 
 	_volumeRenderingKernel = cl::Kernel(program, "volumeRenderingKernelProgressiveAlt");
+	_pagedVolumeRenderingKernel = cl::Kernel(pagedProgram, "volumeRenderingKernelProgressiveAlt");
 	_postProcessingKernel = cl::Kernel(program, "postProcessingKernel");
 	_ssaoKernel = cl::Kernel(program, "ssaoKernel");
 
 	// Create the buffers
 	_invModelViewProjectionMatrixBuffer = cl::Buffer(_context, CL_MEM_READ_ONLY, sizeof(glm::float4) * 4);
+
+	// bound in place of the gradient volume of the levels without one
+	const glm::u8vec4 emptyGradient(0);
+	_emptyGradientImage = cl::Image3D(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNORM_INT8), 1, 1, 1, 0, 0, (void*)&emptyGradient);
+
+	_transferFunctionImage = cl::Image1D(_context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), TFResolution);
+	_preIntegrationTableImage = cl::Image2D(_context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), PreIntegrationSize, PreIntegrationSize);
+	_transferFunction.clear();
 }
 
 void OpenCLVolumeRenderer::cleanup()
 {
-
+	waitForUploads();
+	_brickCache.cleanup();
 }
 
 void OpenCLVolumeRenderer::setVolumeData(VolumeData* vdata)
 {
+	TRACE_SCOPE("OpenCLVolumeRenderer::setVolumeData");
 	if (vdata == nullptr) return;
-	_volumeDataImage = cl::Image3D(_context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		cl::ImageFormat(CL_INTENSITY, CL_UNORM_INT8),
-		vdata->_nxyz.x, vdata->_nxyz.y, vdata->_nxyz.z,
-		0, 0, vdata->_data);
+
+	// nothing left to do when it was prepared while loading
+	prepareVolumeData(vdata);
+	_occupancyLevel = -1;
+	_pagedLevel = nullptr;
+
+	// the device holds the whole levels it can, the coarsest first, within half of its memory and its image limits.
+	// The finer ones are paged through the brick cache, the coarsest one always fits.
+	const size_t maxAllocSize = _device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	const glm::int3 maxImageSize = glm::int3(
+		(int)_device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>(),
+		(int)_device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>(),
+		(int)_device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>());
+	size_t deviceBudget = _device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 2;
+	deviceBudget -= std::min(deviceBudget, OpenCLBrickCache::DefaultBudget);
+
+	const int numLevels = vdata->getNumLevels();
+	_volumeDataImages.assign(numLevels, cl::Image3D());
+	_brickCache.setLevel(nullptr);
+	bool paged = false;
+
+	for (int i = numLevels - 1; i >= 0; i--)
+	{
+		const VolumeData* level = vdata->getLevel(i);
+		const size_t size = level->getNumVoxels() * level->getVoxelSize();
+		const bool fits = size <= maxAllocSize && size <= deviceBudget &&
+			level->_nxyz.x <= maxImageSize.x && level->_nxyz.y <= maxImageSize.y && level->_nxyz.z <= maxImageSize.z;
+
+		// streamed levels are paged whatever their size, they are not in memory to begin with
+		if (i < numLevels - 1 && (!fits || level->isStreamed()))
+		{
+			paged = true;
+			continue;
+		}
+
+		// the image is linear, bricked volumes are flattened for the upload
+		std::vector<VolumeData::DataType> linearData;
+		if (level->_layout != VolumeData::Linear)
+		{
+			linearData.resize(size);
+			level->copyToLinear(linearData.data());
+		}
+
+		_volumeDataImages[i] = cl::Image3D(_context,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			OpenCLBrickCache::getImageFormat(level->_voxelType),
+			level->_nxyz.x, level->_nxyz.y, level->_nxyz.z,
+			0, 0, linearData.empty() ? level->_data : linearData.data());
+		deviceBudget -= std::min(deviceBudget, size);
+	}
+
+	// the gradient volumes with what remains, for the levels held as images : the others use central differences
+	_gradientImages.assign(numLevels, cl::Image3D());
+	for (int i = numLevels - 1; i >= 0; i--)
+	{
+		const VolumeData* level = vdata->getLevel(i);
+		const size_t size = level->getGradientDataSize();
+		if (_volumeDataImages[i]() == nullptr || !level->hasGradients() || size > maxAllocSize || size > deviceBudget)
+			continue;
+
+		_gradientImages[i] = cl::Image3D(_context,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			cl::ImageFormat(CL_RGBA, CL_UNORM_INT8),
+			level->_nxyz.x, level->_nxyz.y, level->_nxyz.z,
+			0, 0, (void*)level->_gradients.data());
+		deviceBudget -= size;
+	}
+
+	if (paged)
+		_brickCache.init(_context, _device, _commandQueue, vdata->_voxelType);
+	else
+		_brickCache.cleanup();
+
 	AbstractVolumeRenderer::setVolumeData(vdata);
 	//requestBuffersUpdate();
 }
@@ -169,71 +311,275 @@ void OpenCLVolumeRenderer::setViewport(int x, int y, int w, int h)
 	_densityMapImage = cl::Image2D(_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_INTENSITY, CL_FLOAT), w, h);
 	_positionMapImage = cl::Image2D(_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), w, h);
 	_occlusionMapImage = cl::Image2D(_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_INTENSITY, CL_FLOAT), w, h);
+
+	if (_headless)
+		_headlessOutputImage = cl::Image2D(_context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_UNORM_INT8), w, h);
+
 	requestBuffersUpdate();
 }
 
 void OpenCLVolumeRenderer::mainRenderPass()
 {
+	TRACE_SCOPE("OpenCLVolumeRenderer::mainRenderPass");
 	int result = 0;
 
-	cl::Event event;
+	cl::Event event, matrixEvent;
 
 	////////////////////////////////////////////////////////////////////////////////////////////
 	// Ray marching kernel
 
 	// Write the parameters to the gpu
-	result = _commandQueue.enqueueWriteBuffer(_invModelViewProjectionMatrixBuffer, true, 0, sizeof(glm::float4) * 4, &_invModelViewProjectionMatrix[0], nullptr);
+	// The kernel marches in voxels of the level it samples : coarser levels are rendered
+	// by scaling the scene down to their size, the rays stay the same.
+	const int level = std::min(_levelOfDetail, _vdata->getNumLevels() - 1);
+	const VolumeData* levelData = _vdata->getLevel(level);
+	const glm::vec3 levelScale = glm::vec3(levelData->_nxyz) / glm::vec3(_vdata->_nxyz);
+	_levelInvModelViewProjectionMatrix = glm::scale(levelScale) * _invModelViewProjectionMatrix;
+
+	// the levels without an image go through the brick cache, the bricks missing from it are
+	// sampled from the first level held whole, and uploaded for the next frame
+	const bool paged = _volumeDataImages[level]() == nullptr;
+	cl::Kernel& kernel = paged ? _pagedVolumeRenderingKernel : _volumeRenderingKernel;
+	_pagedLevel = paged ? levelData : nullptr;
+
+	if (paged)
+		_brickCache.setLevel(levelData);
+
+	result = _commandQueue.enqueueWriteBuffer(_invModelViewProjectionMatrixBuffer, false, 0, sizeof(glm::float4) * 4, &_levelInvModelViewProjectionMatrix[0], nullptr, &matrixEvent);
 	checkOCLError(result);
+	_pendingUploads.push_back(matrixEvent);
 
 	// Set the kernel arguments
-	result = _volumeRenderingKernel.setArg(0, _invModelViewProjectionMatrixBuffer);
+	result = kernel.setArg(0, _invModelViewProjectionMatrixBuffer);
+	checkOCLError(result);
+	result = kernel.setArg(1, glm::float4(_position * levelScale, 0.0f));
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(1, glm::float4(_position, 0.0f));
+	result = kernel.setArg(2, glm::int4(_x, _y, _width, _height));
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(2, glm::int4(_x, _y, _width, _height));
+	result = kernel.setArg(3, paged ? _brickCache.getAtlas() : _volumeDataImages[level]);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(3, _volumeDataImage);
+	result = kernel.setArg(4, glm::int4(levelData->_nxyz, 0));
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(4, glm::int4(_vdata->_nxyz, 0));
+	result = kernel.setArg(5, glm::float4(levelData->_sxyz, 0));
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(5, glm::float4(_vdata->_sxyz, 0));
+	result = kernel.setArg(6, _vdata->getNormalizedRange());
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(6, glm::float2(_vdata->_min, _vdata->_max));
+	result = kernel.setArg(7, _transferFunctionImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(7, _transferFunctionImage);
+	result = kernel.setArg(8, _depthMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(8, _depthMapImage);
+	result = kernel.setArg(9, _opacityMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(9, _opacityMapImage);
+	result = kernel.setArg(10, _colorMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(10, _colorMapImage);
+	result = kernel.setArg(11, _normalMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(11, _normalMapImage);
+	result = kernel.setArg(12, _densityMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(12, _densityMapImage);
+	result = kernel.setArg(13, _positionMapImage);
 	checkOCLError(result);
-	result = _volumeRenderingKernel.setArg(13, _positionMapImage);
+
+	result = kernel.setArg(14, (int)_updateRequested);
+	checkOCLError(result);
+
+	if (level != _occupancyLevel)
+		updateOccupancy(level);
+
+	result = kernel.setArg(15, _occupancyBuffer);
+	checkOCLError(result);
+	result = kernel.setArg(16, _occupancyInfo);
 	checkOCLError(result);
 
-	result = _volumeRenderingKernel.setArg(14, (int)_updateRequested);
+	// gradientScale 0 has the kernel fall back to central differences
+	const bool gradients = _gradientImages[level]() != nullptr;
+	result = kernel.setArg(17, gradients ? _gradientImages[level] : _emptyGradientImage);
+	checkOCLError(result);
+	result = kernel.setArg(18, gradients ? levelData->_gradientScale : 0.0f);
 	checkOCLError(result);
 
-	//*/
-	// Launch the kernel
-	cl::NDRange localRange(8, 8);
-	cl::NDRange globalRange(2048, 2048);
+	// stepSize 0 has every sample composited on its own, its opacity corrected for the voxel size of the level.
+	// The extinctions of the table are per full resolution voxel
+	if (_preIntegration && _preIntegrationTableDirty)
+		updatePreIntegrationTable();
 
-	result = _commandQueue.enqueueNDRangeKernel(_volumeRenderingKernel, cl::NullRange, globalRange, localRange, nullptr, &event);
+	result = kernel.setArg(19, _preIntegrationTableImage);
 	checkOCLError(result);
-	result = event.wait();
+	result = kernel.setArg(20, glm::float2(_preIntegration ? _stepSize : 0.0f, 1.0f / levelScale.x));
+	checkOCLError(result);
+
+	if (paged)
+	{
+		int fallbackLevel = level + 1;
+		while (_volumeDataImages[fallbackLevel]() == nullptr) fallbackLevel++;
+		const glm::vec3 fallbackScale = glm::vec3(_vdata->getLevel(fallbackLevel)->_nxyz) / glm::vec3(levelData->_nxyz);
+
+		result = kernel.setArg(21, _brickCache.getPageTable());
+		checkOCLError(result);
+		result = kernel.setArg(22, _volumeDataImages[fallbackLevel]);
+		checkOCLError(result);
+		result = kernel.setArg(23, glm::int4(OpenCLBrickCache::BrickSize, OpenCLBrickCache::SlotSize, 0, 0));
+		checkOCLError(result);
+		result = kernel.setArg(24, glm::float4(fallbackScale, 0.0f));
+		checkOCLError(result);
+		result = kernel.setArg(25, _brickCache.getRequestsBuffer());
+		checkOCLError(result);
+	}
+
+	// Launch the kernel over the viewport, after the uploads it reads
+	if (_tiledDispatch)
+	{
+		dispatchTiles(kernel, _pendingUploads);
+	}
+	else
+	{
+		result = _commandQueue.enqueueNDRangeKernel(kernel, cl::NullRange, getGlobalRange(_width, _height), cl::NDRange(LocalSize, LocalSize), &_pendingUploads, &event);
+		checkOCLError(result);
+		_passEvents.assign(1, event);
+	}
+	_pendingUploads.clear();
+}
+
+cl::NDRange OpenCLVolumeRenderer::getGlobalRange(int width, int height)
+{
+	// the kernels discard the pixels past the edges of the maps
+	return cl::NDRange((width + LocalSize - 1) / LocalSize * LocalSize, (height + LocalSize - 1) / LocalSize * LocalSize);
+}
+
+void OpenCLVolumeRenderer::dispatchTiles(cl::Kernel& kernel, const std::vector<cl::Event>& waitEvents)
+{
+	std::vector<cl::Event> tileWaitEvents = waitEvents;
+	int result = CL_SUCCESS;
+
+	// a new view starts over from the center, the maps are cleared as a whole since the kernel only clears the tiles it marches
+	if (_updateRequested)
+	{
+		const cl_float4 zero = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+		cl::size_t<3> origin, region;
+		region[0] = _width;
+		region[1] = _height;
+		region[2] = 1;
+
+		for (const cl::Image2D* image : { &_depthMapImage, &_opacityMapImage, &_colorMapImage, &_normalMapImage, &_densityMapImage, &_positionMapImage })
+		{
+			cl::Event event;
+			result = _commandQueue.enqueueFillImage(*image, zero, origin, region, waitEvents.empty() ? nullptr : &waitEvents, &event);
+			checkOCLError(result);
+			tileWaitEvents.push_back(event);
+		}
+
+		getTiles(_tiles);
+		_nextTile = 0;
+	}
+
+	const size_t end = _tileBudget > 0 ? std::min(_nextTile + (size_t)_tileBudget, _tiles.size()) : _tiles.size();
+
+	// every tile waits for the previous one, the out of order queue would otherwise run them in any order
+	std::vector<cl::Event> tileEvents;
+	for (; _nextTile < end; _nextTile++)
+	{
+		const glm::int4& tile = _tiles[_nextTile];
+		cl::Event event;
+		result = _commandQueue.enqueueNDRangeKernel(kernel, cl::NDRange(tile.x, tile.y), getGlobalRange(tile.z, tile.w), cl::NDRange(LocalSize, LocalSize),
+			tileWaitEvents.empty() ? nullptr : &tileWaitEvents, &event);
+		checkOCLError(result);
+		tileWaitEvents.assign(1, event);
+		tileEvents.push_back(event);
+	}
+
+	// all of them for the timings, waiting for the last one is enough otherwise
+	_passEvents = tileEvents.empty() ? tileWaitEvents : tileEvents;
+}
+
+void OpenCLVolumeRenderer::getTiles(std::vector<glm::int4>& tiles) const
+{
+	// screen bounds of the box of the volume, the whole viewport when a corner is behind the eye
+	glm::vec2 boundsMin(0.0f), boundsMax((float)_width, (float)_height);
+	const glm::vec3 halfSize = glm::vec3(_vdata->_nxyz) * 0.5f;
+	const glm::mat4x4 modelViewProjectionMatrix = _projectionMatrix * _modelViewMatrix;
+	glm::vec2 cornersMin(FLT_MAX), cornersMax(-FLT_MAX);
+	bool behind = false;
+
+	for (int c = 0; c < 8 && !behind; c++)
+	{
+		const glm::vec4 corner = modelViewProjectionMatrix * glm::vec4(
+			(c & 1) ? halfSize.x : -halfSize.x, (c & 2) ? halfSize.y : -halfSize.y, (c & 4) ? halfSize.z : -halfSize.z, 1.0f);
+		behind = corner.w <= 0.0f;
+
+		// the inverse of the pixel to ray mapping of the kernel
+		const glm::vec2 pixel = (glm::vec2(corner) / corner.w * 0.5f + 0.5f) * glm::vec2((float)_width, (float)_height) + glm::vec2((float)_x, (float)_y);
+		cornersMin = glm::min(cornersMin, pixel);
+		cornersMax = glm::max(cornersMax, pixel);
+	}
+
+	if (!behind)
+	{
+		boundsMin = glm::max(glm::floor(cornersMin), boundsMin);
+		boundsMax = glm::min(glm::ceil(cornersMax) + 1.0f, boundsMax);
+	}
+
+	tiles.clear();
+	if (boundsMin.x >= boundsMax.x || boundsMin.y >= boundsMax.y) return;
+
+	for (int y = (int)boundsMin.y / TileSize * TileSize; y < (int)boundsMax.y; y += TileSize)
+	{
+		for (int x = (int)boundsMin.x / TileSize * TileSize; x < (int)boundsMax.x; x += TileSize)
+			tiles.push_back(glm::int4(x, y, std::min(TileSize, _width - x), std::min(TileSize, _height - y)));
+	}
+
+	// what the user looks at first
+	const glm::vec2 center = glm::vec2((float)_width, (float)_height) * 0.5f;
+	auto distance = [&](const glm::int4& tile) { return glm::length(glm::vec2(tile.x, tile.y) + glm::vec2(tile.z, tile.w) * 0.5f - center); };
+	std::sort(tiles.begin(), tiles.end(), [&](const glm::int4& a, const glm::int4& b) { return distance(a) < distance(b); });
+}
+
+void OpenCLVolumeRenderer::updateOccupancy(int level)
+{
+	TRACE_SCOPE("OpenCLVolumeRenderer::updateOccupancy");
+	// one flag per brick of the min/max grid, the skipping is disabled (w = 0) for the levels without a grid
+	const VolumeData* levelData = _vdata->getLevel(level);
+	const size_t previousSize = _occupancy.size();
+	waitForUploads();
+	classifyMinMaxGrid(levelData, _transferFunction.data(), (int)_transferFunction.size() / 4, _occupancy);
+
+	const glm::int3 gridSize = levelData->getMinMaxGridSize();
+	_occupancyInfo = _occupancy.empty() ? glm::int4(0) : glm::int4(gridSize, VolumeData::MinMaxBrickSize);
+	if (_occupancy.empty()) _occupancy.push_back(1);
+	_occupancyLevel = level;
+
+	// reallocated only when the level changes size, a new transfer function is a plain upload
+	if (_occupancyBuffer() == nullptr || _occupancy.size() != previousSize)
+	{
+		_occupancyBuffer = cl::Buffer(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, _occupancy.size(), _occupancy.data());
+		return;
+	}
+
+	cl::Event event;
+	int result = _commandQueue.enqueueWriteBuffer(_occupancyBuffer, false, 0, _occupancy.size(), _occupancy.data(), &_frameEvents, &event);
 	checkOCLError(result);
+	_pendingUploads.push_back(event);
+}
+
+bool OpenCLVolumeRenderer::updateBrickCache(const VolumeData* levelData)
+{
+	TRACE_SCOPE("OpenCLVolumeRenderer::updateBrickCache");
+	// the bricks the rays sampled, nearest first : the atlas keeps the front of the volume when it cannot hold all of them
+	std::vector<size_t> brickIndices;
+	if (!_brickCache.readRequests(brickIndices)) return false;
+	sortBricksFrontToBack(levelData, OpenCLBrickCache::BrickSize, brickIndices);
+
+	// a streamed level only loads what this frame needs, the cache requests the bricks missing on the host
+	if (levelData->isStreamed())
+		static_cast<const StreamedVolumeData*>(levelData)->clearRequests();
+
+	return _brickCache.update(brickIndices, _pendingUploads);
 }
 
 void OpenCLVolumeRenderer::ssaoPass()
 {
-	// Launch the kernel
-	cl::NDRange localRange(8, 8);
-	cl::NDRange globalRange(2048, 2048);
+	TRACE_SCOPE("OpenCLVolumeRenderer::ssaoPass");
+	// Launch the kernel over the viewport
+	cl::NDRange localRange(LocalSize, LocalSize);
+	cl::NDRange globalRange = getGlobalRange(_width, _height);
 	cl::Event event;
 
 	int result = _ssaoKernel.setArg(0, _occlusionMapImage);
@@ -243,15 +589,16 @@ void OpenCLVolumeRenderer::ssaoPass()
 	result = _ssaoKernel.setArg(2, _opacityMapImage);
 	checkOCLError(result);
 
-	// launch the kernel
-	result = _commandQueue.enqueueNDRangeKernel(_ssaoKernel, cl::NullRange, globalRange, localRange, nullptr, &event);
-	checkOCLError(result);
-	result = event.wait();
+	// launch the kernel after the ray marching
+	result = _commandQueue.enqueueNDRangeKernel(_ssaoKernel, cl::NullRange, globalRange, localRange, &_passEvents, &event);
 	checkOCLError(result);
+	_passEvents.assign(1, event);
+	_ssaoEvent = event;
 }
 
 void OpenCLVolumeRenderer::postProcessingPass()
 {
+	TRACE_SCOPE("OpenCLVolumeRenderer::postProcessingPass");
 	////////////////////////////////////////////////////////////////////////////////////////////
 	// Post Processing kernel
 	// Enqueue the OpenGL shared objects
@@ -260,18 +607,29 @@ void OpenCLVolumeRenderer::postProcessingPass()
 
 	cl::Event event;
 
-	// Launch the kernel
-	cl::NDRange localRange(8, 8);
-	cl::NDRange globalRange(2048, 2048);
+	// Launch the kernel over the viewport
+	cl::NDRange localRange(LocalSize, LocalSize);
+	cl::NDRange globalRange = getGlobalRange(_width, _height);
 
-	// Acquire the opengl texture so it can be used by the kernel
-	int result = _commandQueue.enqueueAcquireGLObjects(&memObjects, nullptr, &event);
-	checkOCLError(result);
-	result = event.wait();
-	checkOCLError(result);
+	int result = CL_SUCCESS;
+
+	if (_headless)
+	{
+		result = _postProcessingKernel.setArg(0, _headlessOutputImage);
+		checkOCLError(result);
+	}
+	else
+	{
+		// Acquire the opengl texture so it can be used by the kernel, once GL is done drawing the previous frame from it
+		glFinish();
+		result = _commandQueue.enqueueAcquireGLObjects(&memObjects, nullptr, &_acquireEvent);
+		checkOCLError(result);
+		_passEvents.push_back(_acquireEvent);
+
+		result = _postProcessingKernel.setArg(0, _outputImage);
+		checkOCLError(result);
+	}
 
-	result = _postProcessingKernel.setArg(0, _outputImage);
-	checkOCLError(result);
 	result = _postProcessingKernel.setArg(1, _depthMapImage);
 	checkOCLError(result);
 	result = _postProcessingKernel.setArg(2, _opacityMapImage);
@@ -289,104 +647,225 @@ void OpenCLVolumeRenderer::postProcessingPass()
 	result = _postProcessingKernel.setArg(8, _transferFunctionImage);
 	checkOCLError(result);
 
-	// launch the kernel
-	result = _commandQueue.enqueueNDRangeKernel(_postProcessingKernel, cl::NullRange, globalRange, localRange, nullptr, &event);
-	checkOCLError(result);
-	result = event.wait();
+	// launch the kernel after the occlusion, and the acquisition of the texture
+	result = _commandQueue.enqueueNDRangeKernel(_postProcessingKernel, cl::NullRange, globalRange, localRange, &_passEvents, &event);
 	checkOCLError(result);
+	_passEvents.assign(1, event);
+	_postProcessingEvent = event;
+
+	if (_headless) return;
 
-	// Wait for the kernel to finish and release the OpenGL shared objects
-	result = _commandQueue.enqueueReleaseGLObjects(&memObjects, nullptr, nullptr);
+	// release the OpenGL shared objects once the kernel is done
+	result = _commandQueue.enqueueReleaseGLObjects(&memObjects, &_passEvents, &_releaseEvent);
 	checkOCLError(result);
-	result = event.wait();
+	_passEvents.assign(1, _releaseEvent);
+}
+
+void OpenCLVolumeRenderer::setPreIntegration(bool enabled)
+{
+	if (enabled == _preIntegration) return;
+	_preIntegration = enabled;
+	requestBuffersUpdate();
+}
+
+bool OpenCLVolumeRenderer::isPreIntegrated() const
+{
+	return _preIntegration;
+}
+
+void OpenCLVolumeRenderer::setTiledDispatch(bool enabled, int tilesPerFrame)
+{
+	tilesPerFrame = std::max(tilesPerFrame, 0);
+	if (enabled == _tiledDispatch && tilesPerFrame == _tileBudget) return;
+	_tiledDispatch = enabled;
+	_tileBudget = tilesPerFrame;
+	_tiles.clear();
+	_nextTile = 0;
+	requestBuffersUpdate();
+}
+
+bool OpenCLVolumeRenderer::isTiledDispatch() const
+{
+	return _tiledDispatch;
+}
+
+int OpenCLVolumeRenderer::getTileBudget() const
+{
+	return _tileBudget;
+}
+
+bool OpenCLVolumeRenderer::readFramebuffer(unsigned char* rgbaPixels)
+{
+	TRACE_SCOPE("OpenCLVolumeRenderer::readFramebuffer");
+	if (!_headless || _width == 0 || _height == 0) return false;
+
+	cl::size_t<3> origin, region;
+	region[0] = _width;
+	region[1] = _height;
+	region[2] = 1;
+
+	int result = _commandQueue.enqueueReadImage(_headlessOutputImage, true, origin, region, 0, 0, rgbaPixels, &_frameEvents);
 	checkOCLError(result);
+	return result == CL_SUCCESS;
 }
 
 void OpenCLVolumeRenderer::setTransferFunction(const QVector<QPair<QPointF, QColor>>& colors)
 {
-	// OpenCL structures
-	struct TFControlPoint
-	{
-		cl_float4 value_opacity;
-		cl_float4 rgb;
-	};
-
+	TRACE_SCOPE("OpenCLVolumeRenderer::setTransferFunction");
 	_numTFControlPoints = colors.size();
 
-	TFControlPoint* controlPoints = new TFControlPoint[_numTFControlPoints];
-	for (int i = 0; i < _numTFControlPoints; i++)
+	const int nchannels = 4; // RGBA 4-channels
+
+	_bakedTransferFunction.resize(TFResolution * nchannels);
+	bakeTransferFunction(colors, TFResolution, _bakedTransferFunction.data());
+
+	// the range of entries that changed, all of them the first time
+	int first = 0, last = TFResolution - 1;
+	if (_transferFunction.size() == _bakedTransferFunction.size())
 	{
-		auto& cPoint = controlPoints[i];
-		const auto& inputCPoint = colors[i];
-		cPoint.value_opacity.x = inputCPoint.first.x();
-		cPoint.value_opacity.y = inputCPoint.first.y();
-		cPoint.rgb.x = inputCPoint.second.redF();
-		cPoint.rgb.y = inputCPoint.second.greenF();
-		cPoint.rgb.z = inputCPoint.second.blueF();
-		cPoint.rgb.w = inputCPoint.first.y();
+		const size_t entrySize = nchannels * sizeof(float);
+		while (first <= last && memcmp(&_transferFunction[first * nchannels], &_bakedTransferFunction[first * nchannels], entrySize) == 0) first++;
+		while (last >= first && memcmp(&_transferFunction[last * nchannels], &_bakedTransferFunction[last * nchannels], entrySize) == 0) last--;
+		if (first > last) return;
 	}
 
-	const int resolution = 1024; // the resolution of the 1d texture that holds the transfer function colors
-	const int nchannels = 4; // RGBA 4-channels
+	// kept on the host for the classification of the empty bricks and the pre-integration
+	waitForUploads();
+	_transferFunction.resize(_bakedTransferFunction.size());
+	std::copy(_bakedTransferFunction.begin() + first * nchannels, _bakedTransferFunction.begin() + (last + 1) * nchannels, _transferFunction.begin() + first * nchannels);
 
-	const float invResolution = 1.0f / (float)resolution;
+	cl::size_t<3> origin, region;
+	origin[0] = first;
+	region[0] = last - first + 1;
+	region[1] = region[2] = 1;
 
-	float* tfColorsBuffer = new float[resolution * nchannels];
+	cl::Event event;
+	int result = _commandQueue.enqueueWriteImage(_transferFunctionImage, false, origin, region, 0, 0, &_transferFunction[first * nchannels], &_frameEvents, &event);
+	checkOCLError(result);
+	_pendingUploads.push_back(event);
 
-	for (int i = 0; i < resolution; i++)
-	{
-		const int colorIndex = i * nchannels;
-		const float t = i * invResolution;
-		
-		// linear interpolation
-		
-		bool segmentFound = false;
-		for (int j = 0; j < _numTFControlPoints - 1; j++)
-		{
-			if (controlPoints[j].value_opacity.x <= t && controlPoints[j + 1].value_opacity.x >= t)
-			{
-				const auto& currentCP = controlPoints[j];
-				const auto& nextCP = controlPoints[j + 1];
+	_preIntegrationTableDirty = true;
+	_occupancyLevel = -1;
+	requestBuffersUpdate();
+}
 
-				const float interp = (t - currentCP.value_opacity.x) / (nextCP.value_opacity.x - currentCP.value_opacity.x);
+void OpenCLVolumeRenderer::updatePreIntegrationTable()
+{
+	TRACE_SCOPE("OpenCLVolumeRenderer::updatePreIntegrationTable");
+	waitForUploads();
+	_preIntegrationTable.resize(PreIntegrationSize * PreIntegrationSize * 4);
+	preIntegrateTransferFunction(_transferFunction.data(), TFResolution, PreIntegrationSize, _preIntegrationTable.data());
 
-				tfColorsBuffer[colorIndex] = glm::lerp(currentCP.rgb.x, nextCP.rgb.x, interp);
-				tfColorsBuffer[colorIndex + 1] = glm::lerp(currentCP.rgb.y, nextCP.rgb.y, interp);
-				tfColorsBuffer[colorIndex + 2] = glm::lerp(currentCP.rgb.z, nextCP.rgb.z, interp);
-				tfColorsBuffer[colorIndex + 3] = glm::lerp(currentCP.value_opacity.y, nextCP.value_opacity.y, interp);
-				segmentFound = true;
-				break;
-			}
-		}
+	cl::size_t<3> origin, region;
+	region[0] = region[1] = PreIntegrationSize;
+	region[2] = 1;
 
-		if (!segmentFound)
-		{
-			const auto& lastCP = controlPoints[_numTFControlPoints - 1];
-			tfColorsBuffer[colorIndex] = lastCP.rgb.x;
-			tfColorsBuffer[colorIndex + 1] = lastCP.rgb.y;
-			tfColorsBuffer[colorIndex + 2] = lastCP.rgb.z;
-			tfColorsBuffer[colorIndex + 3] = lastCP.value_opacity.y;
-		}
-		//*/
-	}
-	_transferFunctionImage = cl::Image1D(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_FLOAT), resolution, tfColorsBuffer);
+	cl::Event event;
+	int result = _commandQueue.enqueueWriteImage(_preIntegrationTableImage, false, origin, region, 0, 0, _preIntegrationTable.data(), &_frameEvents, &event);
+	checkOCLError(result);
+	_pendingUploads.push_back(event);
+	_preIntegrationTableDirty = false;
+}
 
-	delete[] tfColorsBuffer;
-	delete[] controlPoints;
+void OpenCLVolumeRenderer::waitForUploads()
+{
+	// the uploads of the frame in flight are done with it
+	finishFrame();
+	if (_pendingUploads.empty()) return;
 
-	requestBuffersUpdate();
+	TRACE_SCOPE("OpenCLVolumeRenderer::waitForUploads");
+
+	int result = cl::Event::waitForEvents(_pendingUploads);
+	checkOCLError(result);
+	_pendingUploads.clear();
 }
 
 void OpenCLVolumeRenderer::render()
 {
 	if (!_renderingStatus) return;
-	if (!_updateRequested) return;
+	if (updateStreaming()) _updateRequested = true;
+	// the requests of the last frame were read back while it ran, their bricks are uploaded ahead of the next one
+	if (_pagedLevel != nullptr && updateBrickCache(_pagedLevel)) _updateRequested = true;
+	// the tiles of the view left out by the budget are marched by the next frames
+	if (!_updateRequested && !(_tiledDispatch && _nextTile < _tiles.size())) return;
 	if (_vdata == nullptr) return;
 	if (_numTFControlPoints < 2) return;
 
+	TRACE_SCOPE("OpenCLVolumeRenderer::render");
+
+	// the host copies the previous frame uploads from are reused
+	finishFrame();
+
+	_frameStart = getTime();
+	_acquireEvent = _releaseEvent = cl::Event();
+
 	mainRenderPass();
+	const std::vector<cl::Event> rayMarchingEvents = _passEvents;
+	_rayMarchingEvents = rayMarchingEvents;
 	ssaoPass();
-	postProcessingPass();	
+	postProcessingPass();
+	_frameEvents.swap(_passEvents);
+	_passEvents.clear();
 
+	// the feedback of this frame is read back without waiting for it, the next render() uploads the bricks
+	if (_pagedLevel != nullptr)
+	{
+		cl::Event clearEvent;
+		_brickCache.enqueueRequestsRead(rayMarchingEvents, clearEvent);
+		_pendingUploads.push_back(clearEvent);
+	}
 	_updateRequested = false;
+
+	_frameTimings.host = (float)(getTime() - _frameStart);
+	_frameTimed = _timingsEnabled;
+}
+
+void OpenCLVolumeRenderer::finishFrame()
+{
+	if (_frameEvents.empty()) return;
+
+	TRACE_SCOPE("OpenCLVolumeRenderer::finishFrame");
+
+	int result = cl::Event::waitForEvents(_frameEvents);
+	checkOCLError(result);
+	_frameEvents.clear();
+
+	if (!_frameTimed) return;
+	_frameTimed = false;
+
+	// from the first command queued to the last one complete, on the device clock : the frame is only waited for
+	// at the next paint, the time until then is not the frame's
+	std::vector<cl::Event> frameEvents = _rayMarchingEvents;
+	frameEvents.push_back(_ssaoEvent);
+	frameEvents.push_back(_postProcessingEvent);
+	if (_acquireEvent() != nullptr)
+	{
+		frameEvents.push_back(_acquireEvent);
+		frameEvents.push_back(_releaseEvent);
+	}
+	_frameTimings.frame = getDuration(frameEvents, CL_PROFILING_COMMAND_QUEUED);
+	_frameTimings.rayMarching = getDuration(_rayMarchingEvents);
+	_frameTimings.occlusion = getDuration({ _ssaoEvent });
+	_frameTimings.postProcessing = getDuration({ _postProcessingEvent });
+	_frameTimings.interop = _acquireEvent() != nullptr ? getDuration({ _acquireEvent }) + getDuration({ _releaseEvent }) : 0.0f;
+	recordTimings(_frameTimings);
+}
+
+float OpenCLVolumeRenderer::getDuration(const std::vector<cl::Event>& events, cl_profiling_info startInfo)
+{
+	// from the first command started (or queued) to the last one ended, in milliseconds
+	cl_ulong start = ~(cl_ulong)0, end = 0;
+	for (const cl::Event& event : events)
+	{
+		cl_ulong commandStart = 0, commandEnd = 0;
+		int result = event.getProfilingInfo(startInfo, &commandStart);
+		checkOCLError(result);
+		result = event.getProfilingInfo(CL_PROFILING_COMMAND_END, &commandEnd);
+		checkOCLError(result);
+		if (result != CL_SUCCESS) return 0.0f;
+
+		start = std::min(start, commandStart);
+		end = std::max(end, commandEnd);
+	}
+	return end > start ? (float)((end - start) * 1e-6) : 0.0f;
 }
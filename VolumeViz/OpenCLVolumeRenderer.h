@@ -1,43 +1,118 @@
 #pragma once
 
 #include "AbstractVolumeRenderer.h"
-
-#define CL_HPP_ENABLE_EXCEPTIONS
-#define CL_TARGET_OPENCL_VERSION 120
-#define CL_VERSION_1_2
-#define NOMINMAX
-#include <cl/cl.hpp>
+#include "OpenCLBrickCache.h"
 
 
 class OpenCLVolumeRenderer : public AbstractVolumeRenderer
 {
 public:
+	static const int TFResolution = 1024; // entries of the transfer function image
+	static const int PreIntegrationSize = 256; // entries per side of the pre-integration table
+	static const int LocalSize = 8; // work groups of LocalSize x LocalSize pixels
+	static const int TileSize = 128; // in pixels, a multiple of LocalSize
+
+	// true when an OpenCL platform exposing a GPU device is installed, or any device for the headless
+	// rendering, which has no GL context to share (e.g. a CPU runtime on render nodes)
+	static bool isAvailable(bool headless = false);
+
 	virtual void render() override;
+	virtual void finishFrame() override;
 	virtual void setGLTexture(unsigned int) override;
 	virtual void init() override;
 	virtual void cleanup() override;
 	virtual void setVolumeData(VolumeData* vdata) override;
 	virtual void setViewport(int x, int y, int w, int h) override;
+	virtual bool readFramebuffer(unsigned char* rgbaPixels) override;
+
+	// Composites the segments between two samples from the pre-integration table, the default :
+	// the images stay stable at step sizes of a few voxels. Otherwise every sample is composited on its own.
+	void setPreIntegration(bool enabled);
+	bool isPreIntegrated() const;
+
+	// Marches the frame in TileSize tiles, the center of the viewport first, and skips the tiles
+	// the volume does not cover on screen. Otherwise the viewport is marched in a single dispatch.
+	// A budget of tilesPerFrame has every render() march the next tiles only : a new view then fills
+	// from the center out over the next frames, each of them short. 0 marches all the tiles in one frame.
+	void setTiledDispatch(bool enabled, int tilesPerFrame = 0);
+	bool isTiledDispatch() const;
+	int getTileBudget() const;
 private:
 	void mainRenderPass();
+	// uploads the bricks the rays of the last frame asked for on the paged level, the next kernels wait for them.
+	// Returns true when some were uploaded or left for later, the frame is then worth rendering again.
+	bool updateBrickCache(const VolumeData* levelData);
+	// classifies the min/max grid of the level with the transfer function
+	void updateOccupancy(int level);
+	// rebuilds the pre-integration table from _transferFunction
+	void updatePreIntegrationTable();
+	// blocks until the device is done with the host copies of the pending uploads, and of the frame in flight
+	void waitForUploads();
+	// the global range covering width x height pixels, in whole work groups
+	static cl::NDRange getGlobalRange(int width, int height);
+	// marches the next tiles of the view within the budget, in order, after waitEvents, their events go to _passEvents
+	void dispatchTiles(cl::Kernel& kernel, const std::vector<cl::Event>& waitEvents);
+	// the tiles (x, y, width, height) overlapping the screen bounds of the volume, the nearest to the center first
+	void getTiles(std::vector<glm::int4>& tiles) const;
 	void ssaoPass();
 	void postProcessingPass();
+	// device time spanned by the profiled events, in milliseconds
+	static float getDuration(const std::vector<cl::Event>& events, cl_profiling_info startInfo = CL_PROFILING_COMMAND_START);
 
 protected:
 	cl::Context _context;
+	cl::Device _device;
 	cl::CommandQueue _commandQueue;
 	cl::Kernel _volumeRenderingKernel;
+	cl::Kernel _pagedVolumeRenderingKernel; // samples the levels the device cannot hold through _brickCache
 	cl::Kernel _postProcessingKernel;
 	cl::Kernel _ssaoKernel;
 
+	// The passes of a frame are submitted at once, each waiting for the events of the previous one (_passEvents).
+	// The host only waits for the frame when its output is drawn or read (_frameEvents).
+	std::vector<cl::Event> _passEvents;
+	std::vector<cl::Event> _frameEvents;
+
+	// profiled events of the frame in flight, read by finishFrame when the timings are enabled
+	std::vector<cl::Event> _rayMarchingEvents;
+	cl::Event _ssaoEvent, _postProcessingEvent, _acquireEvent, _releaseEvent;
+	FrameTimings _frameTimings; // the host ones
+	double _frameStart = 0.0;
+	bool _frameTimed = false;
+
 	// OpenCL Buffers
 	cl::Buffer _invModelViewProjectionMatrixBuffer;
-	cl::Image3D _volumeDataImage;
+	glm::mat4x4 _levelInvModelViewProjectionMatrix; // host copy of the buffer, read by the upload until the frame is done
+	std::vector<cl::Image3D> _volumeDataImages; // one per mip level, empty for the levels paged through _brickCache
+	std::vector<cl::Image3D> _gradientImages; // one per mip level, empty for the levels shaded with central differences
+	cl::Image3D _emptyGradientImage;
+	OpenCLBrickCache _brickCache;
+	const VolumeData* _pagedLevel = nullptr; // the level the last frame sampled through the cache, null when it has an image
+	// The transfer function images are allocated once, the edits only upload the entries that changed.
+	// The uploads do not block, the next kernel waits for them (_pendingUploads).
 	cl::Image1D _transferFunctionImage;
+	std::vector<float> _transferFunction; // RGBA, the host copy of the image
+	std::vector<float> _bakedTransferFunction; // RGBA, the last edit, compared with _transferFunction
+	cl::Image2D _preIntegrationTableImage;
+	std::vector<float> _preIntegrationTable;
+	bool _preIntegrationTableDirty = false; // rebuilt once per frame, however many edits came in between
+	bool _preIntegration = true;
+	bool _tiledDispatch = false;
+	int _tileBudget = 0; // tiles per frame, 0 for all of them
+	std::vector<glm::int4> _tiles; // of the current view, marched up to _nextTile
+	size_t _nextTile = 0;
+	std::vector<cl::Event> _pendingUploads;
+
+	// empty space skipping : one flag per brick of the min/max grid of the rendered level
+	cl::Buffer _occupancyBuffer;
+	std::vector<unsigned char> _occupancy; // host copy of _occupancyBuffer
+	glm::int4 _occupancyInfo; // grid size, brick size (0 without a grid)
+	int _occupancyLevel = -1; // level _occupancyBuffer was classified for, -1 when outdated
 
 	cl::Image2D _depthMapImage, _colorMapImage, _opacityMapImage, _normalMapImage, _densityMapImage, _positionMapImage, _occlusionMapImage;
 
 	cl::ImageGL _outputImage;
+	cl::Image2D _headlessOutputImage; // replaces the shared GL texture in headless mode
 
 	int _numTFControlPoints = 0;
 	cl_float3 _volumeScale;
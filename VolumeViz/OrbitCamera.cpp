@@ -0,0 +1,28 @@
+#include "OrbitCamera.h"
+
+glm::vec3 OrbitCamera::getPosition() const
+{
+	const glm::quat rotation(glm::float3(angleX, angleY, 0));
+	const glm::float3 position(0, 0, zoom), target(0, 0, 0);
+
+	return target + rotation * (target - position);
+}
+
+glm::mat4 OrbitCamera::getViewMatrix() const
+{
+	const glm::quat rotation(glm::float3(angleX, angleY, 0));
+	const glm::vec3 upVector(0, 1, 0);
+
+	return glm::lookAt(getPosition(), glm::vec3(0, 0, 0), rotation * upVector);
+}
+
+glm::mat4 OrbitCamera::getProjectionMatrix(float aspectRatio) const
+{
+	return glm::perspective(fieldOfView * 3.14f / 180.0f, aspectRatio, 1.0f, 999999.0f);
+}
+
+void OrbitCamera::apply(AbstractVolumeRenderer* volumeRenderer, float aspectRatio) const
+{
+	volumeRenderer->setViewPosition(getPosition());
+	volumeRenderer->setMatrices(getViewMatrix(), getProjectionMatrix(aspectRatio));
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "AbstractVolumeRenderer.h"
+
+// Camera orbiting around the center of the volume, as driven by the mouse in RenderWidget
+struct OrbitCamera
+{
+	float angleX = 0.0f, angleY = 0.0f;
+	float zoom = 500.0f; // distance to the center of the volume
+	float fieldOfView = 35.0f; // vertical, in degrees
+
+	glm::vec3 getPosition() const;
+	glm::mat4 getViewMatrix() const;
+	glm::mat4 getProjectionMatrix(float aspectRatio) const;
+
+	// sets the view position and the matrices of the renderer
+	void apply(AbstractVolumeRenderer* volumeRenderer, float aspectRatio) const;
+};
@@ -0,0 +1,182 @@
+#include "RawVolumeDataLoader.h"
+#include "TaskScheduler.h"
+#include "Tracer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <atomic>
+
+// Plain shifts over whole arrays, the compilers turn these loops into byte shuffles
+static void swapBytes(unsigned short* data, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		data[i] = (unsigned short)((data[i] >> 8) | (data[i] << 8));
+}
+
+static void swapBytes(quint32* data, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const quint32 v = data[i];
+		data[i] = (v >> 24) | ((v >> 8) & 0x0000ff00u) | ((v << 8) & 0x00ff0000u) | (v << 24);
+	}
+}
+
+static bool isHostBigEndian()
+{
+	const quint32 one = 1;
+	return *(const unsigned char*)&one == 0;
+}
+
+static void toHostEndianness(VolumeData::DataType* data, size_t count, VolumeData::VoxelType voxelType, bool bigEndian)
+{
+	if (bigEndian == isHostBigEndian()) return;
+
+	switch (voxelType)
+	{
+	case VolumeData::UInt16: swapBytes((unsigned short*)data, count); break;
+	case VolumeData::Float32: swapBytes((quint32*)data, count); break;
+	default: break;
+	}
+}
+
+RawVolumeDataLoader::RawVolumeDataLoader()
+{
+}
+
+RawVolumeDataLoader::RawVolumeDataLoader(const Settings& settings) : _settings(settings)
+{
+}
+
+void RawVolumeDataLoader::setSettings(const Settings& settings)
+{
+	_settings = settings;
+}
+
+const RawVolumeDataLoader::Settings& RawVolumeDataLoader::getSettings() const
+{
+	return _settings;
+}
+
+VolumeData* RawVolumeDataLoader::load(const QString& path)
+{
+	TRACE_SCOPE("RawVolumeDataLoader::load");
+	glm::int3 dimensions = _settings.dimensions;
+
+	if (!_settings.slicePattern.isEmpty() && dimensions.z <= 0)
+	{
+		// as many slices as there are consecutive files
+		QDir directory(path);
+		dimensions.z = 0;
+		while (QFile::exists(directory.absoluteFilePath(_settings.slicePattern.arg(_settings.firstSliceNumber + dimensions.z))))
+			dimensions.z++;
+	}
+
+	if (dimensions.x <= 0 || dimensions.y <= 0 || dimensions.z <= 0)
+	{
+		qDebug() << "Invalid raw volume dimensions" << dimensions.x << dimensions.y << dimensions.z << path;
+		return nullptr;
+	}
+
+	// every voxel is read over, or the volume is dropped
+	auto vdata = new VolumeData;
+	vdata->init(dimensions.x, dimensions.y, dimensions.z, _settings.spacing.x, _settings.spacing.y, _settings.spacing.z, _settings.voxelType, false);
+
+	const bool success = _settings.slicePattern.isEmpty() ? readSlices(path, vdata) : readSliceFiles(path, vdata);
+
+	if (!success || isCanceled())
+	{
+		delete vdata;
+		return nullptr;
+	}
+
+	vdata->computeHistogram(2048);
+	reportProgress(0.85f);
+	vdata->buildMipLevels();
+	reportProgress(1.0f);
+
+	return vdata;
+}
+
+bool RawVolumeDataLoader::readSlices(const QString& path, VolumeData* vdata)
+{
+	const qint64 sliceSize = (qint64)vdata->_nxyz.x * vdata->_nxyz.y * vdata->getVoxelSize();
+	const int numSlices = vdata->_nxyz.z;
+
+	{
+		QFile file(path);
+		if (file.size() < _settings.headerOffset + sliceSize * numSlices)
+		{
+			qDebug() << "Truncated raw volume" << path;
+			return false;
+		}
+	}
+
+	// slabs of slices, every task reads through its own file handle
+	const int slicesPerTask = std::max(1, (int)((16 << 20) / sliceSize));
+	const int numTasks = (numSlices + slicesPerTask - 1) / slicesPerTask;
+	std::atomic<bool> failed(false);
+	std::atomic<int> numRead(0);
+
+	TaskScheduler::getInstance().parallelFor(numTasks, [&](size_t taskIndex, unsigned int)
+		{
+			if (failed || isCanceled()) return;
+
+			const int firstSlice = (int)taskIndex * slicesPerTask;
+			const int count = std::min(slicesPerTask, numSlices - firstSlice);
+			const qint64 size = sliceSize * count;
+			VolumeData::DataType* destination = vdata->_data + sliceSize * firstSlice;
+
+			QFile file(path);
+			if (!file.open(QIODevice::ReadOnly) || !file.seek(_settings.headerOffset + sliceSize * firstSlice) ||
+				file.read((char*)destination, size) != size)
+			{
+				failed = true;
+				return;
+			}
+
+			toHostEndianness(destination, (size_t)size / vdata->getVoxelSize(), vdata->_voxelType, _settings.bigEndian);
+			reportProgress(0.8f * (float)(numRead += count) / (float)numSlices);
+		});
+
+	if (failed)
+		qDebug() << "Cannot read" << path;
+
+	return !failed;
+}
+
+bool RawVolumeDataLoader::readSliceFiles(const QString& path, VolumeData* vdata)
+{
+	QDir directory(path);
+	const qint64 sliceSize = (qint64)vdata->_nxyz.x * vdata->_nxyz.y * vdata->getVoxelSize();
+	const int numSlices = vdata->_nxyz.z;
+
+	QStringList filePaths;
+	for (int i = 0; i < numSlices; i++)
+		filePaths.append(directory.absoluteFilePath(_settings.slicePattern.arg(_settings.firstSliceNumber + i)));
+
+	std::atomic<bool> failed(false);
+	std::atomic<int> numRead(0);
+
+	TaskScheduler::getInstance().parallelFor(numSlices, [&](size_t slice, unsigned int)
+		{
+			if (failed || isCanceled()) return;
+
+			VolumeData::DataType* destination = vdata->_data + sliceSize * slice;
+
+			QFile file(filePaths[(int)slice]);
+			if (!file.open(QIODevice::ReadOnly) || !file.seek(_settings.headerOffset) ||
+				file.read((char*)destination, sliceSize) != sliceSize)
+			{
+				qDebug() << "Cannot read the slice" << filePaths[(int)slice];
+				failed = true;
+				return;
+			}
+
+			toHostEndianness(destination, (size_t)sliceSize / vdata->getVoxelSize(), vdata->_voxelType, _settings.bigEndian);
+			reportProgress(0.8f * (float)(++numRead) / (float)numSlices);
+		});
+
+	return !failed;
+}
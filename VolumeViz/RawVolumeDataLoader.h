@@ -0,0 +1,35 @@
+#pragma once
+
+#include "VolumeDataLoader.h"
+
+// Imports headerless voxel dumps : either a single file holding every slice,
+// or one file per slice named after a pattern. The slices are read in parallel
+// straight into the volume, and byte swapped in place when their endianness differs.
+class RawVolumeDataLoader : public AbstractVolumeDataLoader
+{
+public:
+	struct Settings
+	{
+		glm::int3 dimensions = glm::int3(0); // a zero depth counts the slice files
+		glm::float3 spacing = glm::float3(1.0f);
+		VolumeData::VoxelType voxelType = VolumeData::UInt8;
+		bool bigEndian = false;
+		qint64 headerOffset = 0; // bytes skipped at the start of every file
+		QString slicePattern; // e.g. "CThead.%1", %1 being the slice number, empty for a single file
+		int firstSliceNumber = 1;
+	};
+
+	RawVolumeDataLoader();
+	RawVolumeDataLoader(const Settings& settings);
+
+	void setSettings(const Settings& settings);
+	const Settings& getSettings() const;
+
+	// path is the file holding the volume, or the directory of the slice files
+	virtual VolumeData* load(const QString& path) override;
+protected:
+	bool readSlices(const QString& path, VolumeData* vdata);
+	bool readSliceFiles(const QString& path, VolumeData* vdata);
+
+	Settings _settings;
+};
@@ -0,0 +1,103 @@
+#include "RenderSettingsFile.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDebug>
+
+static bool readJsonFile(const QString& path, QJsonObject& object)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::OpenModeFlag::ReadOnly))
+	{
+		qDebug() << "Cannot open" << path;
+		return false;
+	}
+
+	QJsonParseError error;
+	auto document = QJsonDocument::fromJson(file.readAll(), &error);
+	if (error.error != QJsonParseError::NoError)
+	{
+		qDebug() << "Cannot parse" << path << ":" << error.errorString();
+		return false;
+	}
+
+	object = document.object();
+	return true;
+}
+
+static OrbitCamera readCamera(const QJsonObject& object)
+{
+	OrbitCamera camera;
+	camera.angleX = object.value("angleX").toDouble(camera.angleX);
+	camera.angleY = object.value("angleY").toDouble(camera.angleY);
+	camera.zoom = object.value("zoom").toDouble(camera.zoom);
+	camera.fieldOfView = object.value("fieldOfView").toDouble(camera.fieldOfView);
+	return camera;
+}
+
+bool RenderSettingsFile::loadTransferFunction(const QString& path, TransferFunction& transferFunction)
+{
+	QJsonObject root;
+	if (!readJsonFile(path, root)) return false;
+
+	transferFunction.clear();
+	for (const auto& value : root.value("transferFunction").toArray())
+	{
+		const auto point = value.toObject();
+		transferFunction.append(qMakePair(
+			QPointF(point.value("value").toDouble(), point.value("opacity").toDouble()),
+			QColor(point.value("color").toString())));
+	}
+
+	return transferFunction.size() >= 2;
+}
+
+bool RenderSettingsFile::saveTransferFunction(const QString& path, const TransferFunction& transferFunction)
+{
+	QJsonArray points;
+	for (const auto& controlPoint : transferFunction)
+	{
+		QJsonObject point;
+		point.insert("value", controlPoint.first.x());
+		point.insert("opacity", controlPoint.first.y());
+		point.insert("color", controlPoint.second.name());
+		points.append(point);
+	}
+
+	QJsonObject root;
+	root.insert("transferFunction", points);
+
+	QFile file(path);
+	if (!file.open(QIODevice::OpenModeFlag::WriteOnly)) return false;
+	file.write(QJsonDocument(root).toJson());
+	return true;
+}
+
+bool RenderSettingsFile::loadCameras(const QString& path, QVector<OrbitCamera>& cameras)
+{
+	QJsonObject root;
+	if (!readJsonFile(path, root)) return false;
+
+	cameras.clear();
+	for (const auto& value : root.value("cameras").toArray())
+	{
+		cameras.append(readCamera(value.toObject()));
+	}
+
+	if (root.contains("turntable"))
+	{
+		const auto turntable = root.value("turntable").toObject();
+		const OrbitCamera base = readCamera(turntable);
+		const int frames = turntable.value("frames").toInt(360);
+
+		for (int i = 0; i < frames; i++)
+		{
+			OrbitCamera camera = base;
+			camera.angleY = base.angleY + 2.0f * 3.14159265f * (float)i / (float)frames;
+			cameras.append(camera);
+		}
+	}
+
+	return !cameras.isEmpty();
+}
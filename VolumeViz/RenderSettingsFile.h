@@ -0,0 +1,20 @@
+#pragma once
+
+#include "AbstractVolumeRenderer.h"
+#include "OrbitCamera.h"
+#include <QString>
+#include <QVector>
+
+// JSON files holding the rendering settings that can be replayed in batch mode
+//
+// transfer function : { "transferFunction": [ { "value": 0.5, "opacity": 0.2, "color": "#ff0000" }, ... ] }
+// cameras : { "cameras": [ { "angleX": 0.0, "angleY": 0.0, "zoom": 500.0, "fieldOfView": 35.0 }, ... ],
+//             "turntable": { "frames": 360, "angleX": 0.3, "zoom": 500.0, "fieldOfView": 35.0 } }
+// the turntable is optional and appends a full revolution around the Y axis to the explicit cameras
+class RenderSettingsFile
+{
+public:
+	static bool loadTransferFunction(const QString& path, TransferFunction& transferFunction);
+	static bool saveTransferFunction(const QString& path, const TransferFunction& transferFunction);
+	static bool loadCameras(const QString& path, QVector<OrbitCamera>& cameras);
+};
@@ -1,10 +1,12 @@
 #include "RenderWidget.h"
+#include "Tracer.h"
 #include <qdebug.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <QPainter>
 #include <QSurface>
 #include <QSurfaceFormat>
 
@@ -28,6 +30,13 @@ RenderWidget::RenderWidget(QWidget* parent) : QOpenGLWidget(parent)
 
 	const float fps = 60.0f;
 	_timer.start(1000.0f / fps);
+
+	_interactionTimer.setSingleShot(true);
+	_interactionTimer.setInterval(250);
+	connect(&_interactionTimer, &QTimer::timeout, [=]()
+		{
+			endInteraction();
+		});
 }
 
 RenderWidget::~RenderWidget()
@@ -55,6 +64,8 @@ void RenderWidget::setVolumeRenderer(AbstractVolumeRenderer* volumeRenderer)
 	if (_volumeRenderer != nullptr)
 	{
 		_volumeRenderer->setGLTexture(_textureId);
+		_volumeRenderer->setTimingsEnabled(_timingsOverlayVisible);
+		_transferFunctionPending = _transferFunction.size() >= 2;
 		//_volumeRenderer->setTransferFunction(_transferFunction);
 		//_volumeRenderer->setVolumeData(_volumeData);
 	}
@@ -64,12 +75,10 @@ void RenderWidget::setTransferFunction(const TransferFunction& tfColors)
 {
 	if (tfColors.size() < 2) return;
 
+	// the edits are coalesced : the latest one is applied once, right before the next frame
 	_transferFunction = tfColors;
-
-	if (_volumeRenderer != nullptr)
-	{
-		_volumeRenderer->setTransferFunction(tfColors);
-	}
+	_transferFunctionPending = true;
+	update();
 }
 
 AbstractVolumeRenderer* RenderWidget::getCurrentVolumeRenderer() const
@@ -77,6 +86,19 @@ AbstractVolumeRenderer* RenderWidget::getCurrentVolumeRenderer() const
 	return _volumeRenderer;
 }
 
+void RenderWidget::setTimingsOverlayVisible(bool visible)
+{
+	_timingsOverlayVisible = visible;
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->setTimingsEnabled(visible);
+	update();
+}
+
+bool RenderWidget::isTimingsOverlayVisible() const
+{
+	return _timingsOverlayVisible;
+}
+
 void RenderWidget::initializeGL()
 {
 	initializeOpenGLFunctions();
@@ -94,31 +116,19 @@ void RenderWidget::resizeGL(int w, int h)
 
 void RenderWidget::paintGL()
 {
-	glm::quat rotation(glm::float3(_angleX, _angleY, 0));
-
-	const glm::vec3 upVector(0, 1, 0);
-	glm::float3 _position(0, 0, _zoom), _target(0, 0, 0);
-
-	glm::float3 vecDir3 = _target - _position;
-	_position = _target + rotation * vecDir3;
-
-	const glm::mat4 viewMatrix = glm::lookAt(_position, _target, rotation * upVector);
+	TRACE_SCOPE("RenderWidget::paintGL");
+	_paintInterval = _paintTimer.isValid() ? (float)_paintTimer.nsecsElapsed() * 1e-6f : 0.0f;
+	_paintTimer.start();
 
 	if (_volumeRenderer != nullptr)
 	{
-		_volumeRenderer->setViewPosition(_position);
-		_volumeRenderer->setMatrices(
-			viewMatrix,
-			glm::perspective(35.0f * 3.14f / 180.0f, float(width()) / float(height()), 1.0f, 999999.0f));
-	}
+		_camera.apply(_volumeRenderer, float(width()) / float(height()));
 
-	glClearColor(0, 0, 0, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	if (_volumeRenderer != nullptr) // check if there's a volume renderer
-	{
-		// perform rendering
-		_volumeRenderer->render();
+		if (_transferFunctionPending)
+		{
+			_volumeRenderer->setTransferFunction(_transferFunction);
+			_transferFunctionPending = false;
+		}
 	}
 
 	//////////////////////////////////////////////////////////////////////////
@@ -127,6 +137,11 @@ void RenderWidget::paintGL()
 
 	glUseProgram(_shaderProgram);
 
+	// the frame submitted by the previous paint had the time in between to complete, it is drawn
+	// while the next one renders : the paint only waits for what is left of it
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->finishFrame();
+
 	auto texture_uniform = glGetUniformLocation(_shaderProgram, "bg_texture");
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, _textureId);
@@ -134,11 +149,65 @@ void RenderWidget::paintGL()
 
 	glBindVertexArray(_vao);
 	glDrawArrays(GL_QUADS, 0, 4);
-	glFinish();
+
+	// submits the next frame, shown by the next paint
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->render();
+
+	_paintTime = (float)_paintTimer.nsecsElapsed() * 1e-6f;
+
+	if (_timingsOverlayVisible && _volumeRenderer != nullptr)
+		drawTimingsOverlay();
+}
+
+void RenderWidget::drawTimingsOverlay()
+{
+	const AbstractVolumeRenderer::FrameTimings average = _volumeRenderer->getAverageTimings();
+	const int numTimings = _volumeRenderer->getNumTimings();
+
+	// averages over the frames recorded, the paint times are those of the previous paintGL
+	const QString text = QString(
+		"frame %1 ms (%2 frames)\n"
+		"  ray marching %3 ms\n"
+		"  occlusion %4 ms\n"
+		"  post processing %5 ms\n"
+		"  GL interop %6 ms\n"
+		"  host %7 ms\n"
+		"paint %8 ms, every %9 ms")
+		.arg(average.frame, 0, 'f', 2).arg(numTimings)
+		.arg(average.rayMarching, 0, 'f', 2)
+		.arg(average.occlusion, 0, 'f', 2)
+		.arg(average.postProcessing, 0, 'f', 2)
+		.arg(average.interop, 0, 'f', 2)
+		.arg(average.host, 0, 'f', 2)
+		.arg(_paintTime, 0, 'f', 2).arg(_paintInterval, 0, 'f', 2);
+
+	QPainter painter(this);
+	painter.setFont(QFont("Monospace", 9));
+	const QRect textRect = painter.boundingRect(QRect(10, 10, width(), height()), Qt::AlignLeft | Qt::AlignTop, text);
+	painter.fillRect(textRect.adjusted(-5, -5, 5, 5), QColor(0, 0, 0, 160));
+	painter.setPen(Qt::white);
+	painter.drawText(textRect, Qt::AlignLeft | Qt::AlignTop, text);
+
+	// the frame times of the history, the last frame on the right, 1 pixel per millisecond
+	const int graphHeight = 50;
+	const QRect graphRect(textRect.left(), textRect.bottom() + 10, AbstractVolumeRenderer::TimingsHistorySize, graphHeight);
+	painter.fillRect(graphRect.adjusted(-5, -5, 5, 5), QColor(0, 0, 0, 160));
+	painter.setPen(QColor(255, 200, 0));
+	for (int i = 0; i < numTimings; i++)
+	{
+		const int barHeight = std::min((int)_volumeRenderer->getTimings(i).frame, graphHeight);
+		const int x = graphRect.right() - i;
+		painter.drawLine(x, graphRect.bottom(), x, graphRect.bottom() - barHeight);
+	}
 }
 
 void RenderWidget::createTexture(int w, int h)
 {
+	// the frame in flight writes the texture
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->finishFrame();
+
 	if (glIsTexture(_textureId))
 		glDeleteTextures(1, &_textureId);
 
@@ -270,28 +339,32 @@ void RenderWidget::mousePressEvent(QMouseEvent* event)
 		_rightButtonPressed = true;
 		break;
 	}
+
+	if (_leftButtonPressed || _rightButtonPressed)
+		beginInteraction();
 }
 
 void RenderWidget::mouseReleaseEvent(QMouseEvent* event)
 {
 	_rightButtonPressed = false;
 	_leftButtonPressed = false;
+	endInteraction();
 }
 
 void RenderWidget::mouseMoveEvent(QMouseEvent* event)
 {
 	if (_leftButtonPressed)
 	{
-		_angleY -= 3.75f * 3.14f * (float)(event->pos().x() - _prevClick.x()) / (float)width();
-		_angleX -= 3.75f * 3.14f * (float)(event->pos().y() - _prevClick.y()) / (float)height();
+		_camera.angleY -= 3.75f * 3.14f * (float)(event->pos().x() - _prevClick.x()) / (float)width();
+		_camera.angleX -= 3.75f * 3.14f * (float)(event->pos().y() - _prevClick.y()) / (float)height();
 		_prevClick = event->pos();
 	}
 
 	if (_rightButtonPressed)
 	{
-		_zoom -= 5550.0f * (float)(event->pos().y() - _prevClick.y()) / (float)height();
-		if (_zoom < _minZoom)
-			_zoom = _minZoom;
+		_camera.zoom -= 5550.0f * (float)(event->pos().y() - _prevClick.y()) / (float)height();
+		if (_camera.zoom < _minZoom)
+			_camera.zoom = _minZoom;
 		_prevClick = event->pos();
 	}
 
@@ -301,10 +374,26 @@ void RenderWidget::mouseMoveEvent(QMouseEvent* event)
 
 void RenderWidget::wheelEvent(QWheelEvent* event)
 {
-	_zoom -= (float)event->delta() * 0.5f;
-	if (_zoom < _minZoom)
-		_zoom = _minZoom;
+	_camera.zoom -= (float)event->delta() * 0.5f;
+	if (_camera.zoom < _minZoom)
+		_camera.zoom = _minZoom;
+
+	beginInteraction();
+	_interactionTimer.start();
 
 	if (_volumeRenderer != nullptr)
 		_volumeRenderer->requestBuffersUpdate();
 }
+
+void RenderWidget::beginInteraction()
+{
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->setLevelOfDetail(InteractiveLevel);
+}
+
+void RenderWidget::endInteraction()
+{
+	if (_leftButtonPressed || _rightButtonPressed) return;
+	if (_volumeRenderer != nullptr)
+		_volumeRenderer->setLevelOfDetail(0);
+}
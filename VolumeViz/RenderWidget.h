@@ -5,10 +5,12 @@
 #include <QOpenGLWidget>
 #include <QOpenGLExtraFunctions>
 #include <qtimer.h>
+#include <QElapsedTimer>
 #include <QMouseEvent>
 #include <QWheelEvent>
 
 #include "AbstractVolumeRenderer.h"
+#include "OrbitCamera.h"
 
 class RenderWidget : public QOpenGLWidget, protected QOpenGLExtraFunctions
 {
@@ -19,30 +21,43 @@ public:
 	void setVolumeRenderer(AbstractVolumeRenderer* volumeRenderer);
 	void setTransferFunction(const TransferFunction& tfColors);
 	AbstractVolumeRenderer* getCurrentVolumeRenderer() const;
+	// draws the timings of the renderer over the view, they are recorded while it is shown
+	void setTimingsOverlayVisible(bool visible);
+	bool isTimingsOverlayVisible() const;
 protected:
 	virtual void initializeGL() override;
 	virtual void resizeGL(int w, int h) override;
 	virtual void paintGL() override;
 	void createTexture(int w, int h);
 	void createScreenQuad();
+	void drawTimingsOverlay();
 
 	virtual void mousePressEvent(QMouseEvent* event) override;
 	virtual void mouseReleaseEvent(QMouseEvent* event) override;
 	virtual void mouseMoveEvent(QMouseEvent* event) override;
 	virtual void wheelEvent(QWheelEvent* event) override;
 
+	// the coarser InteractiveLevel is rendered while the camera moves
+	void beginInteraction();
+	void endInteraction();
+
 protected:
 	VolumeData* _volumeData = nullptr;
 	AbstractVolumeRenderer* _volumeRenderer = nullptr;
 	QTimer _timer;
+	QTimer _interactionTimer; // ends the wheel interactions
+	static const int InteractiveLevel = 1;
 	unsigned int _vao, _vbo, _textureId;
 	unsigned int _shaderProgram, _vertexShader, _fragmentShader;
-	float _zoom = 500.0f;
+	OrbitCamera _camera;
 	float _minZoom = 100.0f;
-	float _angleX = 0.0f, _angleY = 0.0f;
 	bool _leftButtonPressed = false;
 	bool _rightButtonPressed = false;
 	QPoint _prevClick;
 	TransferFunction _transferFunction;
+	bool _transferFunctionPending = false; // _transferFunction reaches the renderer with the next frame
+	bool _timingsOverlayVisible = false;
+	QElapsedTimer _paintTimer; // since the previous paintGL
+	float _paintTime = 0.0f, _paintInterval = 0.0f; // milliseconds, of the previous paintGL
 };
 
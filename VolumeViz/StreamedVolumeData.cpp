@@ -0,0 +1,336 @@
+#include "StreamedVolumeData.h"
+#include <QDebug>
+#include <algorithm>
+
+StreamedVolumeData::StreamedVolumeData()
+{
+}
+
+StreamedVolumeData::~StreamedVolumeData()
+{
+	close();
+}
+
+bool StreamedVolumeData::open(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize)
+{
+	close();
+	replaceData(nullptr);
+	clearMipLevels();
+
+	_nxyz = glm::int3(nx, ny, nz);
+	_sxyz = glm::float3(sx, sy, sz);
+	_voxelType = voxelType;
+	setBrickedLayout(brickSize);
+
+	const size_t numBricks = _brickTable.size();
+	_brickBytes = ((size_t)1 << (3 * _brickShift)) * getVoxelSize();
+
+	QFile file(path);
+	if (!file.open(QIODevice::OpenModeFlag::ReadOnly) || offset + (qint64)(numBricks * _brickBytes) > file.size())
+	{
+		qDebug() << "Truncated volume file" << path;
+		_layout = Linear;
+		_brickTable.clear();
+		_nxyz = glm::int3(0);
+		return false;
+	}
+
+	_path = path;
+	_offset = offset;
+
+	_bricks.reset(new std::atomic<DataType*>[numBricks]);
+	_lastUsed.reset(new std::atomic<unsigned int>[numBricks]);
+	_pins.reset(new std::atomic<int>[numBricks]);
+	_requested.reset(new std::atomic<bool>[numBricks]);
+	for (size_t b = 0; b < numBricks; b++)
+	{
+		_bricks[b] = nullptr;
+		_lastUsed[b] = 0;
+		_pins[b] = 0;
+		_requested[b] = false;
+	}
+
+	_quit = false;
+	_loaderThread = std::thread(&StreamedVolumeData::loaderLoop, this);
+	return true;
+}
+
+void StreamedVolumeData::close()
+{
+	if (!isOpen()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+		_requests.clear();
+	}
+	_requestCondition.notify_all();
+	_loaderThread.join();
+	_idleCondition.notify_all();
+
+	for (size_t brickIndex : _residentBricks)
+		delete[] _bricks[brickIndex].load();
+	_residentBricks.clear();
+	_cacheSize = 0;
+
+	_bricks.reset();
+	_lastUsed.reset();
+	_pins.reset();
+	_requested.reset();
+
+	for (auto file : _files)
+		delete file;
+	_files.clear();
+	_path.clear();
+}
+
+bool StreamedVolumeData::isOpen() const
+{
+	return _bricks != nullptr;
+}
+
+void StreamedVolumeData::setCacheBudget(size_t bytes)
+{
+	_cacheBudget = bytes;
+}
+
+size_t StreamedVolumeData::getCacheBudget() const
+{
+	return _cacheBudget;
+}
+
+size_t StreamedVolumeData::getCacheSize() const
+{
+	return _cacheSize;
+}
+
+void StreamedVolumeData::init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, bool clear)
+{
+	close();
+	VolumeData::init(nx, ny, nz, sx, sy, sz, voxelType, clear);
+}
+
+bool StreamedVolumeData::isStreamed() const
+{
+	return isOpen();
+}
+
+const VolumeData::DataType* StreamedVolumeData::lockBrick(size_t brickIndex) const
+{
+	const DataType* brick = nullptr;
+	{
+		// pinned under the lock, an eviction cannot slip between the pin and the read
+		std::lock_guard<std::mutex> lock(_mutex);
+		_pins[brickIndex]++;
+		_lastUsed[brickIndex] = ++_clock;
+		brick = _bricks[brickIndex].load(std::memory_order_acquire);
+	}
+	if (brick != nullptr) return brick;
+
+	QFile* file = acquireFile();
+	DataType* data = readBrick(*file, brickIndex);
+	releaseFile(file);
+
+	return installBrick(brickIndex, data, true);
+}
+
+void StreamedVolumeData::unlockBrick(size_t brickIndex) const
+{
+	_pins[brickIndex]--;
+}
+
+void StreamedVolumeData::prefetch(const std::vector<size_t>& brickIndices) const
+{
+	for (size_t brickIndex : brickIndices)
+	{
+		if (brickIndex < _brickTable.size() && _bricks[brickIndex].load(std::memory_order_relaxed) == nullptr)
+			requestBrick(brickIndex);
+	}
+}
+
+void StreamedVolumeData::clearRequests() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (size_t brickIndex : _requests)
+		_requested[brickIndex] = false;
+	_requests.clear();
+	_idleCondition.notify_all();
+}
+
+bool StreamedVolumeData::isBoxResident(const glm::int3& origin, const glm::int3& size) const
+{
+	const glm::int3 firstBrick = origin >> _brickShift;
+	const glm::int3 lastBrick = (origin + size - 1) >> _brickShift;
+
+	// all of them are looked up, the missing ones arrive together
+	bool resident = true;
+	for (int bz = firstBrick.z; bz <= lastBrick.z; bz++)
+	{
+		for (int by = firstBrick.y; by <= lastBrick.y; by++)
+		{
+			for (int bx = firstBrick.x; bx <= lastBrick.x; bx++)
+				resident &= getResidentBrick(((size_t)bz * _numBricks.y + by) * _numBricks.x + bx) != nullptr;
+		}
+	}
+	return resident;
+}
+
+bool StreamedVolumeData::updateResidency()
+{
+	if (!isOpen()) return false;
+
+	++_clock;
+	if (_cacheSize > _cacheBudget)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		evict(_cacheBudget);
+	}
+	return _arrived.exchange(false);
+}
+
+bool StreamedVolumeData::waitForRequests() const
+{
+	if (!isOpen()) return false;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_idleCondition.wait(lock, [this]() { return _requests.empty() && !_loading; });
+	return _arrived;
+}
+
+void StreamedVolumeData::requestBrick(size_t brickIndex) const
+{
+	// the first miss queues it, the next ones wait for the loading thread
+	if (_requested[brickIndex].exchange(true)) return;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_requests.push_back(brickIndex);
+	}
+	_requestCondition.notify_one();
+}
+
+VolumeData::DataType* StreamedVolumeData::readBrick(QFile& file, size_t brickIndex) const
+{
+	DataType* data = new DataType[_brickBytes];
+	if (!file.seek(_offset + (qint64)(_brickTable[brickIndex] * getVoxelSize())) ||
+		file.read((char*)data, _brickBytes) != (qint64)_brickBytes)
+	{
+		// an unreadable brick is shown empty rather than requested forever
+		qDebug() << "Cannot read brick" << brickIndex << "of" << _path;
+		memset(data, 0, _brickBytes);
+	}
+	return data;
+}
+
+const VolumeData::DataType* StreamedVolumeData::installBrick(size_t brickIndex, DataType* data, bool evictBeyondBudget) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	DataType* expected = nullptr;
+	if (!_bricks[brickIndex].compare_exchange_strong(expected, data, std::memory_order_acq_rel))
+	{
+		delete[] data;
+		return expected;
+	}
+
+	_residentBricks.push_back(brickIndex);
+	_cacheSize += _brickBytes;
+	_arrived = true;
+
+	// a tenth of the budget is freed at once, the sort is then amortized over many loads
+	if (evictBeyondBudget && _cacheSize > _cacheBudget)
+		evict(_cacheBudget - _cacheBudget / 10);
+
+	return data;
+}
+
+void StreamedVolumeData::evict(size_t targetSize) const
+{
+	std::vector<std::pair<unsigned int, size_t>> candidates;
+	candidates.reserve(_residentBricks.size());
+	for (size_t brickIndex : _residentBricks)
+	{
+		if (_pins[brickIndex] == 0)
+			candidates.emplace_back(_lastUsed[brickIndex].load(std::memory_order_relaxed), brickIndex);
+	}
+
+	const size_t excess = (_cacheSize - std::min<size_t>(_cacheSize, targetSize) + _brickBytes - 1) / _brickBytes;
+	const size_t numEvicted = std::min(excess, candidates.size());
+	if (numEvicted == 0) return;
+
+	// least recently used first
+	std::nth_element(candidates.begin(), candidates.begin() + (numEvicted - 1), candidates.end());
+
+	for (size_t i = 0; i < numEvicted; i++)
+	{
+		const size_t brickIndex = candidates[i].second;
+		delete[] _bricks[brickIndex].exchange(nullptr);
+		_cacheSize -= _brickBytes;
+	}
+
+	_residentBricks.erase(std::remove_if(_residentBricks.begin(), _residentBricks.end(),
+		[this](size_t brickIndex) { return _bricks[brickIndex].load(std::memory_order_relaxed) == nullptr; }), _residentBricks.end());
+}
+
+QFile* StreamedVolumeData::acquireFile() const
+{
+	{
+		std::lock_guard<std::mutex> lock(_fileMutex);
+		if (!_files.empty())
+		{
+			QFile* file = _files.back();
+			_files.pop_back();
+			return file;
+		}
+	}
+
+	QFile* file = new QFile(_path);
+	file->open(QIODevice::OpenModeFlag::ReadOnly);
+	return file;
+}
+
+void StreamedVolumeData::releaseFile(QFile* file) const
+{
+	std::lock_guard<std::mutex> lock(_fileMutex);
+	_files.push_back(file);
+}
+
+void StreamedVolumeData::loaderLoop()
+{
+	QFile file(_path);
+	file.open(QIODevice::OpenModeFlag::ReadOnly);
+
+	while (true)
+	{
+		size_t brickIndex = 0;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_requestCondition.wait(lock, [this]() { return _quit || !_requests.empty(); });
+			if (_quit) return;
+
+			brickIndex = _requests.front();
+			_requests.pop_front();
+
+			// past the budget the remaining requests wait for the next frame to evict,
+			// they are dropped and will be made again if the bricks are still needed
+			if (_bricks[brickIndex].load(std::memory_order_relaxed) != nullptr || _cacheSize > _cacheBudget + _cacheBudget / 4)
+			{
+				_requested[brickIndex] = false;
+				if (_requests.empty())
+					_idleCondition.notify_all();
+				continue;
+			}
+			_loading = true;
+		}
+
+		// never evicts, the renderers may be sampling the resident bricks
+		installBrick(brickIndex, readBrick(file, brickIndex), false);
+		_requested[brickIndex] = false;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_loading = false;
+		}
+		_idleCondition.notify_all();
+	}
+}
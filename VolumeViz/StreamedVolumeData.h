@@ -0,0 +1,116 @@
+#pragma once
+
+#include "VolumeData.h"
+#include <QFile>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Out-of-core volume : the bricks stay in a bricked .bin store on disk and are cached in memory
+// within a budget, the least recently used ones being evicted first.
+// Renderers only take resident bricks and queue the missing ones their rays asked for in the last frame (prefetch),
+// CPU side processing locks the bricks it walks and loads them on the spot (lockBrick).
+// _data stays nullptr, getVoxels / getVoxelOffset are meaningless for this class.
+class StreamedVolumeData : public VolumeData
+{
+public:
+	static const size_t DefaultCacheBudget = (size_t)1 << 30; // in bytes
+
+	StreamedVolumeData();
+	virtual ~StreamedVolumeData();
+
+	// streams the nx * ny * nz voxels stored at offset in the file, as full bricks of brickSize^3 voxels, x fastest
+	bool open(const QString& path, qint64 offset, int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize);
+	void close();
+	bool isOpen() const;
+
+	void setCacheBudget(size_t bytes);
+	size_t getCacheBudget() const;
+	size_t getCacheSize() const; // bytes of bricks currently in memory
+
+	// leaves the store for a regular allocation
+	virtual void init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType = UInt8, bool clear = true) override;
+	virtual bool isStreamed() const override;
+
+	// loads the brick synchronously when it is not resident, the bricks locked are never evicted.
+	// May evict other bricks, so it must not run while a renderer samples the volume.
+	virtual const DataType* lockBrick(size_t brickIndex) const override;
+	virtual void unlockBrick(size_t brickIndex) const override;
+
+	// Lock free, safe from the rendering threads : the brick when it is resident, nullptr otherwise.
+	// The rays record the misses in their feedback and the renderer queues them at the end of the frame.
+	const DataType* findResidentBrick(size_t brickIndex) const
+	{
+		const DataType* brick = _bricks[brickIndex].load(std::memory_order_acquire);
+		if (brick == nullptr) return nullptr;
+
+		// a store only when it changes, the rays hit the same bricks from all the threads
+		const unsigned int clock = _clock.load(std::memory_order_relaxed);
+		if (_lastUsed[brickIndex].load(std::memory_order_relaxed) != clock)
+			_lastUsed[brickIndex].store(clock, std::memory_order_relaxed);
+		return brick;
+	}
+
+	// same as findResidentBrick, a missing brick is queued for the loading thread right away
+	const DataType* getResidentBrick(size_t brickIndex) const
+	{
+		const DataType* brick = findResidentBrick(brickIndex);
+		if (brick == nullptr) requestBrick(brickIndex);
+		return brick;
+	}
+
+	// queues the bricks for the loading thread, in this order, ahead of their first use
+	void prefetch(const std::vector<size_t>& brickIndices) const;
+	// drops the queued requests, the renderers make them again from the feedback of the current frame
+	// so the disk is never busy with bricks that went out of view
+	void clearRequests() const;
+
+	// true when all the bricks overlapping the box are resident, the missing ones are queued for the loading thread.
+	// readBox then copies the box without loading anything, until the next updateResidency.
+	bool isBoxResident(const glm::int3& origin, const glm::int3& size) const;
+
+	// To be called between two frames : advances the LRU clock and evicts the bricks beyond the budget.
+	// Returns true when bricks arrived since the last call, the frame is then worth rendering again.
+	bool updateResidency();
+
+	// blocks until the loading thread is done with the queued bricks, returns true when some arrived since the last updateResidency
+	bool waitForRequests() const;
+protected:
+	void requestBrick(size_t brickIndex) const;
+	DataType* readBrick(QFile& file, size_t brickIndex) const;
+	// returns the brick resident in the end, data is deleted when another thread installed it first
+	const DataType* installBrick(size_t brickIndex, DataType* data, bool evictBeyondBudget) const;
+	void evict(size_t targetSize) const; // _mutex held
+	QFile* acquireFile() const;
+	void releaseFile(QFile* file) const;
+	void loaderLoop();
+
+	QString _path;
+	qint64 _offset = 0;
+	size_t _brickBytes = 0;
+	std::atomic<size_t> _cacheBudget{ DefaultCacheBudget };
+
+	// page table, one entry per brick
+	std::unique_ptr<std::atomic<DataType*>[]> _bricks;
+	std::unique_ptr<std::atomic<unsigned int>[]> _lastUsed;
+	std::unique_ptr<std::atomic<int>[]> _pins;
+	std::unique_ptr<std::atomic<bool>[]> _requested;
+
+	mutable std::atomic<unsigned int> _clock{ 1 };
+	mutable std::atomic<size_t> _cacheSize{ 0 };
+	mutable std::atomic<bool> _arrived{ false };
+
+	mutable std::mutex _mutex; // residency and requests
+	mutable std::vector<size_t> _residentBricks;
+	mutable std::deque<size_t> _requests;
+	mutable std::condition_variable _requestCondition, _idleCondition;
+	bool _loading = false; // a brick is being read by the loading thread
+	bool _quit = false;
+	std::thread _loaderThread;
+
+	mutable std::mutex _fileMutex;
+	mutable std::vector<QFile*> _files; // read handles of the synchronous loads, one per concurrent reader
+};
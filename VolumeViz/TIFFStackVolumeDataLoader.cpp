@@ -6,78 +6,204 @@
 #include <qdebug>
 #include <QImage>
 #include <QFile>
+#include <algorithm>
+#include <atomic>
+#include "TaskScheduler.h"
+#include "Tracer.h"
+
+// 8 bits planes : the red channel, as QColor::red() gave it
+static void copySlice8(const QImage& image, unsigned char* plane)
+{
+	const int w = image.width(), h = image.height();
+
+	switch (image.format())
+	{
+	case QImage::Format_Grayscale8:
+		for (int i = 0; i < h; i++)
+			memcpy(plane + (size_t)i * w, image.constScanLine(i), w);
+		break;
+	case QImage::Format_Indexed8:
+	{
+		// grayscale TIFFs often come with a palette
+		unsigned char lut[256] = {};
+		const auto colorTable = image.colorTable();
+		for (int c = 0; c < colorTable.size() && c < 256; c++)
+			lut[c] = qRed(colorTable[c]);
+
+		for (int i = 0; i < h; i++)
+		{
+			const uchar* line = image.constScanLine(i);
+			for (int j = 0; j < w; j++)
+				plane[(size_t)i * w + j] = lut[line[j]];
+		}
+		break;
+	}
+	case QImage::Format_RGB32:
+	case QImage::Format_ARGB32:
+	case QImage::Format_ARGB32_Premultiplied:
+		for (int i = 0; i < h; i++)
+		{
+			const QRgb* line = (const QRgb*)image.constScanLine(i);
+			for (int j = 0; j < w; j++)
+				plane[(size_t)i * w + j] = qRed(line[j]);
+		}
+		break;
+	default:
+		copySlice8(image.convertToFormat(QImage::Format_ARGB32), plane);
+		break;
+	}
+}
+
+// 16 bits planes
+static void copySlice16(const QImage& image, unsigned short* plane)
+{
+	const int w = image.width(), h = image.height();
+
+	if (image.format() != QImage::Format_Grayscale16)
+	{
+		copySlice16(image.convertToFormat(QImage::Format_Grayscale16), plane);
+		return;
+	}
+
+	for (int i = 0; i < h; i++)
+		memcpy(plane + (size_t)i * w, image.constScanLine(i), w * sizeof(unsigned short));
+}
+
+// the preview voxel of every stride x stride block of a plane, box filtered
+template <typename T>
+static void downsamplePlane(const T* plane, int w, int h, int stride, T* dst)
+{
+	const int pw = (w + stride - 1) / stride, ph = (h + stride - 1) / stride;
+	for (int py = 0; py < ph; py++)
+	{
+		for (int px = 0; px < pw; px++)
+		{
+			const int ex = std::min(stride, w - px * stride), ey = std::min(stride, h - py * stride);
+			double sum = 0.0;
+			for (int y = 0; y < ey; y++)
+			{
+				const T* line = plane + (size_t)(py * stride + y) * w + px * stride;
+				for (int x = 0; x < ex; x++)
+					sum += line[x];
+			}
+			dst[(size_t)py * pw + px] = (T)(sum / (ex * ey) + 0.5);
+		}
+	}
+}
 
 VolumeData* TIFFStackVolumeDataLoader::load(const QString& path)
 {
-	VolumeData* vdata = new VolumeData;
+	TRACE_SCOPE("TIFFStackVolumeDataLoader::load");
+	VolumeData* vdata = nullptr;
 
 	QDir directory(path);
 
 	if (directory.exists(QString("%1.bin").arg(directory.dirName())))
 	{
-		QFile file(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
-		if (file.open(QIODevice::OpenModeFlag::ReadOnly))
-		{
-			file.read((char*)(&vdata->_nxyz), sizeof(vdata->_nxyz));
-			file.read((char*)(&vdata->_sxyz), sizeof(vdata->_sxyz));
-			vdata->init(vdata->_nxyz.x, vdata->_nxyz.y, vdata->_nxyz.z,
-				vdata->_sxyz.x, vdata->_sxyz.y, vdata->_sxyz.z);
-			file.read((char*)vdata->_data, sizeof(VolumeData::DataType) * vdata->_nxyz.x * vdata->_nxyz.y * vdata->_nxyz.z);
-			file.read((char*)&vdata->_min, sizeof(float));
-			file.read((char*)&vdata->_max, sizeof(float));
-			file.read((char*)&vdata->_mean, sizeof(float));
-			file.read((char*)&vdata->_std, sizeof(float));
-			//file.read((char*)&vdata->_numBins, sizeof(unsigned int));
-			//vdata->_histogram = new unsigned int[vdata->_numBins];
-			//file.read((char*)&vdata->_histogram, sizeof(unsigned int)*vdata->_numBins);
-			vdata->computeHistogram();
-
-			file.close();
-		}
+		vdata = loadFromBinFormat(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
 	}
 	else
 	{
 		auto entries = directory.entryList(QDir::Filter::Files);
+		if (entries.isEmpty()) return nullptr;
+
+		vdata = new VolumeData;
 
 		int w, h;
 
 		{
 			QImage image(directory.absoluteFilePath(entries[0]));
-			vdata->init(image.width(), image.height(), entries.length(), 1.0f, 1.0f, 1.0f);
+			// 16 bits stacks keep their full precision
+			const auto voxelType = image.format() == QImage::Format_Grayscale16 ? VolumeData::UInt16 : VolumeData::UInt8;
+			vdata->init(image.width(), image.height(), entries.length(), 1.0f, 1.0f, 1.0f, voxelType, false);
 			w = image.width(); h = image.height();
 		}
 
-		int index = 0;
-		for (auto entry : entries)
+		// the slices are decoded concurrently, each one straight into its plane
+		QStringList filePaths;
+		for (const auto& entry : entries)
+			filePaths.append(directory.absoluteFilePath(entry));
+
+		const size_t planeSize = (size_t)w * h;
+		std::atomic<bool> failed(false);
+		std::atomic<int> numDecoded(0);
+
+		auto decodeSlice = [&](int index)
 		{
-			QImage image(directory.absoluteFilePath(entry));
-			if (image.isNull())
+			if (failed || isCanceled()) return;
+
+			QImage image(filePaths[index]);
+			if (image.isNull() || image.width() != w || image.height() != h)
 			{
-				qDebug() << "niet : " << entry;
-				delete vdata;
-				return nullptr;
+				qDebug() << "Cannot read the slice" << filePaths[index] << ", or it is not" << w << "x" << h;
+				failed = true;
+				return;
 			}
-			//*/
 
-			const int planeSize = w * h;
+			if (vdata->_voxelType == VolumeData::UInt16)
+				copySlice16(image, vdata->getVoxels<unsigned short>() + planeSize * index);
+			else
+				copySlice8(image, vdata->_data + planeSize * index);
+
+			reportProgress(0.8f * (float)(++numDecoded) / (float)entries.length());
+		};
+
+		// every stride-th slice is decoded first for a preview of at most MinLevelSize voxels per side,
+		// sent before the remaining slices are decoded
+		int stride = 1;
+		while (std::max(std::max(w, h), entries.length()) > VolumeData::MinLevelSize * stride)
+			stride *= 2;
+		if (!_previewCallback) stride = 1;
 
-			auto* plane = &vdata->_data[planeSize * index];
+		if (stride > 1)
+		{
+			const int numPreviewSlices = (entries.length() + stride - 1) / stride;
+			TaskScheduler::getInstance().parallelFor(numPreviewSlices, [&](size_t index, unsigned int)
+				{
+					decodeSlice((int)index * stride);
+				});
 
-			for (int i = 0; i < h; i++)
+			if (!failed && !isCanceled())
 			{
-				for (int j = 0; j < w; j++)
+				auto preview = new VolumeData;
+				preview->init((w + stride - 1) / stride, (h + stride - 1) / stride, numPreviewSlices,
+					(float)stride, (float)stride, (float)stride, vdata->_voxelType);
+				const size_t previewPlaneSize = (size_t)preview->_nxyz.x * preview->_nxyz.y;
+
+				for (int z = 0; z < numPreviewSlices; z++)
 				{
-					plane[j + i * w] = image.pixelColor(j, i).red();
-					//plane[j + i * w] = index % 256;
+					if (vdata->_voxelType == VolumeData::UInt16)
+						downsamplePlane(vdata->getVoxels<unsigned short>() + planeSize * z * stride, w, h, stride,
+							preview->getVoxels<unsigned short>() + previewPlaneSize * z);
+					else
+						downsamplePlane(vdata->_data + planeSize * z * stride, w, h, stride, preview->_data + previewPlaneSize * z);
 				}
+
+				// the range of the preview maps it onto the transfer function
+				preview->computeHistogram();
+				_previewCallback(preview);
 			}
+		}
 
-			index++;
+		TaskScheduler::getInstance().parallelFor(entries.length(), [&](size_t index, unsigned int)
+			{
+				if (stride == 1 || index % stride != 0)
+					decodeSlice((int)index);
+			});
+
+		if (failed || isCanceled())
+		{
+			delete vdata;
+			return nullptr;
 		}
 
 		vdata->computeHistogram();
+		reportProgress(0.85f);
+		vdata->buildMipLevels();
+		reportProgress(0.95f);
 		
 		AbstractVolumeDataLoader::saveToBinFormat(vdata, path);
+		reportProgress(1.0f);
 	}
 	return vdata;
 }
@@ -0,0 +1,204 @@
+#include "TaskScheduler.h"
+#include <algorithm>
+
+// index of the worker running on the current thread, -1 outside of the scheduler
+static thread_local int currentWorkerIndex = -1;
+
+TaskScheduler& TaskScheduler::getInstance()
+{
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+TaskScheduler::TaskScheduler(unsigned int numThreads)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	_numWorkers = numThreads;
+
+	// worker 0 is the thread calling parallelFor
+	for (unsigned int i = 1; i < _numWorkers; i++)
+	{
+		_threads.emplace_back(&TaskScheduler::workerLoop, this, i);
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(_jobMutex);
+		_quit = true;
+	}
+	_jobCondition.notify_all();
+
+	for (auto& thread : _threads)
+		thread.join();
+}
+
+unsigned int TaskScheduler::getNumWorkers() const
+{
+	return _numWorkers;
+}
+
+void TaskScheduler::parallelFor(size_t numTasks, const TaskFunction& task)
+{
+	if (numTasks == 0) return;
+
+	if (currentWorkerIndex != -1 || _numWorkers == 1 || numTasks == 1)
+	{
+		// the calling thread stands for worker 0, so that the calls made from the task stay serial too
+		const int previousWorkerIndex = currentWorkerIndex;
+		const unsigned int workerIndex = currentWorkerIndex != -1 ? currentWorkerIndex : 0;
+		currentWorkerIndex = workerIndex;
+		for (size_t i = 0; i < numTasks; i++)
+			task(i, workerIndex);
+		currentWorkerIndex = previousWorkerIndex;
+		return;
+	}
+
+	Job job;
+	job.task = &task;
+	job.queues.reset(new WorkerQueue[_numWorkers]);
+	job.pendingTasks = numTasks;
+
+	// distribute the indices evenly, stealing takes care of the imbalance
+	const size_t chunk = numTasks / _numWorkers;
+	const size_t remainder = numTasks % _numWorkers;
+	size_t begin = 0;
+
+	for (unsigned int i = 0; i < _numWorkers; i++)
+	{
+		const size_t count = chunk + (i < remainder ? 1 : 0);
+		job.queues[i].begin = begin;
+		job.queues[i].end = begin + count;
+		begin += count;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_jobMutex);
+		_jobs.push_back(&job);
+		updatePreferredJob();
+	}
+	_jobCondition.notify_all();
+
+	// the calling thread is worker 0 of its own job, whichever other job the workers serve
+	currentWorkerIndex = 0;
+	runTasks(job, 0);
+	currentWorkerIndex = -1;
+
+	// wait for the tasks still running on other workers, and for those workers to let go of the job
+	std::unique_lock<std::mutex> lock(_jobMutex);
+	_doneCondition.wait(lock, [&]() { return job.pendingTasks == 0 && job.busyWorkers == 0; });
+	_jobs.erase(std::find(_jobs.begin(), _jobs.end(), &job));
+	updatePreferredJob();
+}
+
+void TaskScheduler::workerLoop(unsigned int workerIndex)
+{
+	currentWorkerIndex = workerIndex;
+
+	while (true)
+	{
+		Job* job = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(_jobMutex);
+			_jobCondition.wait(lock, [&]() { return _quit || (job = _preferredJob.load()) != nullptr; });
+
+			if (_quit) return;
+
+			job->busyWorkers++;
+		}
+
+		runTasks(*job, workerIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(_jobMutex);
+			job->busyWorkers--;
+		}
+		_doneCondition.notify_all();
+	}
+}
+
+void TaskScheduler::runTasks(Job& job, unsigned int workerIndex)
+{
+	const TaskFunction& task = *job.task;
+	size_t taskIndex = 0;
+
+	while (true)
+	{
+		while (popTask(job, workerIndex, taskIndex))
+		{
+			task(taskIndex, workerIndex);
+
+			if (--job.pendingTasks == 0)
+			{
+				std::lock_guard<std::mutex> lock(_jobMutex);
+				_doneCondition.notify_all();
+			}
+
+			// the pool workers move to a newer job, the indices they leave are stolen by those staying
+			if (workerIndex != 0 && _preferredJob.load(std::memory_order_relaxed) != &job)
+				return;
+		}
+
+		if (!stealTasks(job, workerIndex))
+			break;
+	}
+
+	std::lock_guard<std::mutex> lock(_jobMutex);
+	if (!job.drained)
+	{
+		job.drained = true;
+		updatePreferredJob();
+	}
+}
+
+bool TaskScheduler::popTask(Job& job, unsigned int workerIndex, size_t& taskIndex)
+{
+	auto& queue = job.queues[workerIndex];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+
+	if (queue.begin >= queue.end) return false;
+
+	taskIndex = queue.begin++;
+	return true;
+}
+
+bool TaskScheduler::stealTasks(Job& job, unsigned int workerIndex)
+{
+	for (unsigned int i = 1; i < _numWorkers; i++)
+	{
+		auto& victim = job.queues[(workerIndex + i) % _numWorkers];
+		size_t begin = 0, end = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.begin >= victim.end) continue;
+			const size_t remaining = victim.end - victim.begin;
+
+			// take the back half, the victim keeps working on the front
+			end = victim.end;
+			begin = victim.end - std::max<size_t>(1, remaining / 2);
+			victim.end = begin;
+		}
+
+		auto& queue = job.queues[workerIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.begin = begin;
+		queue.end = end;
+		return true;
+	}
+	return false;
+}
+
+void TaskScheduler::updatePreferredJob()
+{
+	Job* preferredJob = nullptr;
+	for (auto it = _jobs.rbegin(); it != _jobs.rend() && preferredJob == nullptr; ++it)
+	{
+		if (!(*it)->drained)
+			preferredJob = *it;
+	}
+	_preferredJob = preferredJob;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads executing indexed tasks with work stealing.
+// Each worker owns a contiguous range of task indices, and idle workers steal half
+// of the remaining range of a busy one, so uneven tasks (e.g. screen tiles) stay balanced.
+class TaskScheduler
+{
+public:
+	// taskIndex in [0, numTasks), workerIndex in [0, getNumWorkers())
+	using TaskFunction = std::function<void(size_t taskIndex, unsigned int workerIndex)>;
+
+	static TaskScheduler& getInstance();
+
+	TaskScheduler(unsigned int numThreads = 0);
+	~TaskScheduler();
+
+	// number of workers, including the thread calling parallelFor
+	unsigned int getNumWorkers() const;
+
+	// Runs the task for every index and returns when all of them are done.
+	// Calls made from inside a task run serially on the calling worker.
+	// Calls from different threads run at the same time and share the workers, which move to the latest
+	// one between two tasks : a frame is not held up behind a volume being processed in the background.
+	void parallelFor(size_t numTasks, const TaskFunction& task);
+
+private:
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		size_t begin = 0, end = 0;
+	};
+
+	// a parallelFor call, its indices split across one queue per worker
+	struct Job
+	{
+		const TaskFunction* task = nullptr;
+		std::unique_ptr<WorkerQueue[]> queues;
+		std::atomic<size_t> pendingTasks { 0 };
+		unsigned int busyWorkers = 0; // guarded by _jobMutex
+		bool drained = false; // no index left to take, guarded by _jobMutex
+	};
+
+	void workerLoop(unsigned int workerIndex);
+	void runTasks(Job& job, unsigned int workerIndex);
+	bool popTask(Job& job, unsigned int workerIndex, size_t& taskIndex);
+	bool stealTasks(Job& job, unsigned int workerIndex);
+	// the latest job not drained, _jobMutex being held
+	void updatePreferredJob();
+
+	std::vector<std::thread> _threads;
+	unsigned int _numWorkers = 1;
+
+	std::mutex _jobMutex;
+	std::condition_variable _jobCondition, _doneCondition;
+	std::vector<Job*> _jobs; // in submission order
+	std::atomic<Job*> _preferredJob { nullptr };
+	bool _quit = false;
+};
@@ -0,0 +1,80 @@
+#include "Tracer.h"
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+#include <chrono>
+
+static long long getSteadyTime()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer& Tracer::getInstance()
+{
+	static Tracer tracer;
+	return tracer;
+}
+
+void Tracer::start()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_events.clear();
+	_startTime.store(getSteadyTime(), std::memory_order_relaxed);
+	_recording.store(true, std::memory_order_relaxed);
+}
+
+bool Tracer::stop(const QString& path)
+{
+	std::vector<Event> events;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_recording.store(false, std::memory_order_relaxed);
+		events.swap(_events);
+	}
+
+	if (path.isEmpty()) return false;
+
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+	{
+		qDebug() << "Cannot write the trace to" << path;
+		return false;
+	}
+
+	// complete events ("X"), the timestamps and durations in microseconds
+	QTextStream stream(&file);
+	stream << "{\"traceEvents\":[\n";
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const Event& event = events[i];
+		stream << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.threadId
+			<< ",\"ts\":" << QString::number(event.start, 'f', 3) << ",\"dur\":" << QString::number(event.duration, 'f', 3) << "}"
+			<< (i + 1 < events.size() ? ",\n" : "\n");
+	}
+	stream << "],\"displayTimeUnit\":\"ms\"}\n";
+
+	stream.flush();
+	return stream.status() == QTextStream::Ok;
+}
+
+double Tracer::getTime() const
+{
+	return (double)(getSteadyTime() - _startTime.load(std::memory_order_relaxed)) * 1e-3;
+}
+
+void Tracer::addEvent(const char* name, double start, double duration)
+{
+	const int threadId = getThreadId();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	// the scopes still open when the recording stopped are dropped
+	if (!_recording.load(std::memory_order_relaxed)) return;
+	_events.push_back({ name, start, duration, threadId });
+}
+
+int Tracer::getThreadId()
+{
+	static std::atomic<int> numThreads { 0 };
+	thread_local int threadId = ++numThreads;
+	return threadId;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <QString>
+
+// Timeline of the loading, processing and rendering phases, across threads, written as Chrome trace-event JSON
+// (chrome://tracing, ui.perfetto.dev). The scopes stay compiled in : while the tracer is stopped a TRACE_SCOPE
+// costs a relaxed atomic load, while it records one event per scope is appended under a mutex.
+class Tracer
+{
+public:
+	static Tracer& getInstance();
+
+	// clears the events and starts recording
+	void start();
+	// stops recording and writes the events to path, they are discarded when it is empty.
+	// Returns false when they are not written.
+	bool stop(const QString& path);
+	bool isRecording() const { return _recording.load(std::memory_order_relaxed); }
+
+	// microseconds since start()
+	double getTime() const;
+	// name must outlive the tracer (a string literal)
+	void addEvent(const char* name, double start, double duration);
+
+private:
+	struct Event
+	{
+		const char* name;
+		double start, duration; // microseconds
+		int threadId;
+	};
+
+	// small and stable ids, in the order the threads record their first event
+	static int getThreadId();
+
+	std::atomic<bool> _recording { false };
+	std::mutex _mutex;
+	std::vector<Event> _events;
+	std::atomic<long long> _startTime { 0 }; // nanoseconds of the steady clock
+};
+
+// records the duration of the enclosing scope
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name)
+		: _name(Tracer::getInstance().isRecording() ? name : nullptr)
+	{
+		if (_name != nullptr) _start = Tracer::getInstance().getTime();
+	}
+
+	~TraceScope()
+	{
+		if (_name == nullptr) return;
+		Tracer& tracer = Tracer::getInstance();
+		tracer.addEvent(_name, _start, tracer.getTime() - _start);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* _name;
+	double _start = 0.0;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
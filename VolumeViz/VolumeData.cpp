@@ -1,5 +1,10 @@
 #include "VolumeData.h"
-#include <QDebug>
+#include "TaskScheduler.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
 
 VolumeData::VolumeData()
 {
@@ -14,73 +19,918 @@ VolumeData::~VolumeData()
 
 	if (_histogram != nullptr)
 		delete[] _histogram;
+
+	clearMipLevels();
 }
 
-void VolumeData::init(int nx, int ny, int nz, float sx, float sy, float sz)
+void VolumeData::init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, bool clear)
 {
 	if (_data != nullptr)
 		delete[] _data;
 
 	_nxyz = glm::int3(nx, ny, nz);
 	_sxyz = glm::float3(sx, sy, sz);
+	_voxelType = voxelType;
+	_layout = Linear;
+	_brickTable.clear();
+	_minMaxGrid.clear();
+	clearGradients();
+	clearMipLevels();
 
-	_data = new DataType[nx * ny * nz];
-	memset(_data, 0, sizeof(VolumeData::DataType) * nx * ny * nz);
+	_data = new DataType[getDataSize()];
+	if (clear)
+		memset(_data, 0, getDataSize());
 }
 
-void VolumeData::computeHistogram(unsigned int numBins)
+void VolumeData::initBricked(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize, bool clear)
 {
-	if (_histogram != nullptr)
-		delete[] _histogram;
+	_nxyz = glm::int3(nx, ny, nz);
+	_sxyz = glm::float3(sx, sy, sz);
+	_voxelType = voxelType;
+	setBrickedLayout(brickSize);
+	_minMaxGrid.clear();
+	clearGradients();
+	clearMipLevels();
+
+	replaceData(new DataType[getDataSize()]);
+	if (clear)
+		memset(_data, 0, getDataSize());
+}
+
+void VolumeData::setBrickedLayout(int brickSize)
+{
+	int brickShift = 0;
+	while ((1 << brickShift) < brickSize) brickShift++;
+	brickSize = 1 << brickShift;
 
-	_mean = _std = 0.0f;
-	_min = std::numeric_limits<float>::max();
-	_max = -_min;
+	_layout = Bricked;
+	_brickShift = brickShift;
+	_numBricks = (_nxyz + brickSize - 1) / brickSize;
+	_brickTable.resize((size_t)_numBricks.x * _numBricks.y * _numBricks.z);
 
-	for (int w = 0; w < _nxyz.z; w++)
+	const size_t brickVoxels = (size_t)1 << (3 * brickShift);
+	for (size_t b = 0; b < _brickTable.size(); b++)
+		_brickTable[b] = b * brickVoxels;
+}
+
+bool VolumeData::isStreamed() const
+{
+	return false;
+}
+
+bool VolumeData::isMapped() const
+{
+	return false;
+}
+
+const VolumeData::DataType* VolumeData::lockBrick(size_t brickIndex) const
+{
+	return _data + _brickTable[brickIndex] * getVoxelSize();
+}
+
+void VolumeData::unlockBrick(size_t) const
+{
+}
+
+void VolumeData::readBox(const glm::int3& origin, const glm::int3& size, DataType* dst) const
+{
+	if (size.x <= 0 || size.y <= 0 || size.z <= 0) return;
+
+	const size_t voxelSize = getVoxelSize();
+
+	if (_layout == Linear)
 	{
-		const auto* plane = &_data[_nxyz.x*_nxyz.y * w];
+		for (int z = 0; z < size.z; z++)
+		{
+			for (int y = 0; y < size.y; y++)
+				memcpy(dst + ((size_t)z * size.y + y) * size.x * voxelSize,
+					_data + getVoxelOffset(origin.x, origin.y + y, origin.z + z) * voxelSize, size.x * voxelSize);
+		}
+		return;
+	}
+
+	// every brick overlapping the box is locked once
+	const int brickSize = getBrickSize();
+	const glm::int3 firstBrick = origin >> _brickShift;
+	const glm::int3 lastBrick = (origin + size - 1) >> _brickShift;
 
-		for (int u = 0; u < _nxyz.y; u++)
+	for (int bz = firstBrick.z; bz <= lastBrick.z; bz++)
+	{
+		for (int by = firstBrick.y; by <= lastBrick.y; by++)
 		{
-			for (int v = 0; v < _nxyz.x; v++)
+			for (int bx = firstBrick.x; bx <= lastBrick.x; bx++)
 			{
-				auto value = plane[_nxyz.x * u + v];
-				_mean += value;
+				const size_t brickIndex = ((size_t)bz * _numBricks.y + by) * _numBricks.x + bx;
+				const glm::int3 brickOrigin = glm::int3(bx, by, bz) * brickSize;
+				const glm::int3 begin = glm::max(origin, brickOrigin);
+				const glm::int3 end = glm::min(origin + size, brickOrigin + brickSize);
+				const DataType* brick = lockBrick(brickIndex);
+
+				for (int z = begin.z; z < end.z; z++)
+				{
+					for (int y = begin.y; y < end.y; y++)
+						memcpy(dst + (((size_t)(z - origin.z) * size.y + (y - origin.y)) * size.x + (begin.x - origin.x)) * voxelSize,
+							brick + getOffsetInBrick(begin.x, y, z) * voxelSize, (end.x - begin.x) * voxelSize);
+				}
+				unlockBrick(brickIndex);
+			}
+		}
+	}
+}
 
-				if (value < _min)
-					_min = value;
+glm::float2 VolumeData::getNormalizedRange() const
+{
+	if (_voxelType == UInt8 || _max <= _min)
+		return glm::float2(0.0f, 1.0f);
+	return glm::float2(_min, _max) * getNormalizedScale();
+}
+
+size_t VolumeData::getVoxelSize(VoxelType voxelType)
+{
+	switch (voxelType)
+	{
+	case UInt16: return sizeof(unsigned short);
+	case Float32: return sizeof(float);
+	default: return sizeof(unsigned char);
+	}
+}
+
+size_t VolumeData::getVoxelSize() const
+{
+	return getVoxelSize(_voxelType);
+}
+
+size_t VolumeData::getNumVoxels() const
+{
+	return (size_t)_nxyz.x * (size_t)_nxyz.y * (size_t)_nxyz.z;
+}
+
+size_t VolumeData::getDataSize() const
+{
+	if (_layout == Bricked)
+		return _brickTable.size() * ((size_t)1 << (3 * _brickShift)) * getVoxelSize();
+	return getNumVoxels() * getVoxelSize();
+}
+
+int VolumeData::getBrickSize() const
+{
+	return 1 << _brickShift;
+}
 
-				if (value > _max)
-					_max = value;
+size_t VolumeData::getNumChunks() const
+{
+	if (_layout == Bricked)
+		return _brickTable.size();
+	return (getNumVoxels() + LinearChunkSize - 1) / LinearChunkSize;
+}
+
+void VolumeData::toBricked(int brickSize)
+{
+	TRACE_SCOPE("VolumeData::toBricked");
+	if (_data == nullptr) return;
+	if (_layout == Bricked && brickSize == getBrickSize()) return;
+	if (_layout == Bricked) toLinear();
+
+	// the linear voxels are read before the layout switches
+	VolumeData bricked;
+	bricked._nxyz = _nxyz;
+	bricked._voxelType = _voxelType;
+	bricked.setBrickedLayout(brickSize);
+
+	brickSize = bricked.getBrickSize();
+	const size_t brickVoxels = (size_t)1 << (3 * bricked._brickShift);
+	const size_t voxelSize = getVoxelSize();
+
+	// the bricks on the far edges are padded, the padding is never sampled
+	DataType* bricks = new DataType[bricked.getDataSize()];
+
+	TaskScheduler::getInstance().parallelFor(bricked._brickTable.size(), [&](size_t brickIndex, unsigned int)
+		{
+			const glm::int3 origin = bricked.getBrickOrigin(brickIndex);
+			const int bx = origin.x, by = origin.y, bz = origin.z;
+			const int ex = std::min(brickSize, _nxyz.x - bx);
+			const int ey = std::min(brickSize, _nxyz.y - by);
+			const int ez = std::min(brickSize, _nxyz.z - bz);
+
+			DataType* brick = bricks + bricked._brickTable[brickIndex] * voxelSize;
+			if (ex < brickSize || ey < brickSize || ez < brickSize)
+				memset(brick, 0, brickVoxels * voxelSize);
+
+			for (int z = 0; z < ez; z++)
+			{
+				for (int y = 0; y < ey; y++)
+				{
+					const size_t source = (((size_t)(bz + z) * _nxyz.y + by + y) * _nxyz.x + bx) * voxelSize;
+					const size_t destination = (((size_t)z * brickSize + y) * brickSize) * voxelSize;
+					memcpy(brick + destination, _data + source, ex * voxelSize);
+				}
 			}
+		});
+
+	replaceData(bricks);
+	_layout = Bricked;
+	_brickShift = bricked._brickShift;
+	_numBricks = bricked._numBricks;
+	_brickTable.swap(bricked._brickTable);
+}
+
+void VolumeData::toLinear()
+{
+	if (_data == nullptr || _layout == Linear) return;
+
+	DataType* data = new DataType[getNumVoxels() * getVoxelSize()];
+	copyToLinear(data);
+
+	replaceData(data);
+	_layout = Linear;
+	_brickShift = 0;
+	_numBricks = glm::int3(0);
+	_brickTable.clear();
+}
+
+void VolumeData::copyToLinear(DataType* dst) const
+{
+	const size_t voxelSize = getVoxelSize();
+
+	if (_layout == Linear)
+	{
+		if (_data != nullptr)
+			memcpy(dst, _data, getNumVoxels() * voxelSize);
+		return;
+	}
+
+	// brick by brick, so streamed volumes are copied through their cache
+	TaskScheduler::getInstance().parallelFor(getNumChunks(), [&](size_t brickIndex, unsigned int)
+		{
+			const int brickSize = getBrickSize();
+			const glm::int3 origin = getBrickOrigin(brickIndex);
+			const glm::int3 extent = glm::min(_nxyz - origin, glm::int3(brickSize));
+			const DataType* brick = lockBrick(brickIndex);
+
+			for (int z = 0; z < extent.z; z++)
+			{
+				for (int y = 0; y < extent.y; y++)
+					memcpy(dst + (((size_t)(origin.z + z) * _nxyz.y + origin.y + y) * _nxyz.x + origin.x) * voxelSize,
+						brick + ((size_t)z * brickSize + y) * brickSize * voxelSize, extent.x * voxelSize);
+			}
+			unlockBrick(brickIndex);
+		});
+}
+
+void VolumeData::replaceData(DataType* data)
+{
+	if (_data != nullptr)
+		delete[] _data;
+	_data = data;
+}
+
+float VolumeData::getNormalizedScale() const
+{
+	switch (_voxelType)
+	{
+	case UInt8: return 1.0f / 255.0f;
+	case UInt16: return 1.0f / 65535.0f;
+	default: return 1.0f;
+	}
+}
+
+template <typename T>
+static void downsampleRows(const VolumeData& source, VolumeData& target)
+{
+	// 2x2x2 box filter over a linear source, the last voxel is repeated along the odd dimensions
+	const glm::int3 n = source._nxyz;
+	const glm::int3 m = target._nxyz;
+	const float rounding = std::numeric_limits<T>::is_integer ? 0.5f : 0.0f;
+
+	TaskScheduler::getInstance().parallelFor(m.z, [&](size_t z, unsigned int)
+		{
+			const int z0 = 2 * (int)z, z1 = std::min(z0 + 1, n.z - 1);
+			T* output = target.getVoxels<T>() + z * m.x * m.y;
+
+			for (int y = 0; y < m.y; y++)
+			{
+				const int y0 = 2 * y, y1 = std::min(y0 + 1, n.y - 1);
+
+				// four source rows per output row
+				const T* r00 = source.getVoxels<T>() + source.getVoxelOffset(0, y0, z0);
+				const T* r10 = source.getVoxels<T>() + source.getVoxelOffset(0, y1, z0);
+				const T* r01 = source.getVoxels<T>() + source.getVoxelOffset(0, y0, z1);
+				const T* r11 = source.getVoxels<T>() + source.getVoxelOffset(0, y1, z1);
+
+				for (int x = 0; x < m.x; x++)
+				{
+					const int x0 = 2 * x, x1 = std::min(x0 + 1, n.x - 1);
+					const float sum = (float)r00[x0] + (float)r00[x1] + (float)r10[x0] + (float)r10[x1] +
+						(float)r01[x0] + (float)r01[x1] + (float)r11[x0] + (float)r11[x1];
+					output[(size_t)y * m.x + x] = (T)(sum * 0.125f + rounding);
+				}
+			}
+		});
+}
+
+static void downsampleTiles(const VolumeData& source, VolumeData& target)
+{
+	// bricked and streamed sources are read a box at a time, each box making one linear tile of the target
+	const int tileSize = VolumeData::DefaultBrickSize;
+	const glm::int3 numTiles = (target._nxyz + tileSize - 1) / tileSize;
+	const size_t voxelSize = source.getVoxelSize();
+
+	TaskScheduler::getInstance().parallelFor((size_t)numTiles.x * numTiles.y * numTiles.z, [&](size_t tileIndex, unsigned int)
+		{
+			const glm::int3 origin = glm::int3((int)(tileIndex % numTiles.x), (int)((tileIndex / numTiles.x) % numTiles.y),
+				(int)(tileIndex / ((size_t)numTiles.x * numTiles.y))) * tileSize;
+			const glm::int3 size = glm::min(target._nxyz - origin, glm::int3(tileSize));
+			const glm::int3 sourceSize = glm::min(source._nxyz - origin * 2, size * 2);
+
+			std::vector<VolumeData::DataType> sourceBox((size_t)sourceSize.x * sourceSize.y * sourceSize.z * voxelSize);
+			std::vector<VolumeData::DataType> tile((size_t)size.x * size.y * size.z * voxelSize);
+			source.readBox(origin * 2, sourceSize, sourceBox.data());
+			VolumeData::downsampleBox(source._voxelType, sourceBox.data(), sourceSize, tile.data());
+
+			for (int z = 0; z < size.z; z++)
+			{
+				for (int y = 0; y < size.y; y++)
+					memcpy(target._data + target.getVoxelOffset(origin.x, origin.y + y, origin.z + z) * voxelSize,
+						tile.data() + ((size_t)z * size.y + y) * size.x * voxelSize, size.x * voxelSize);
+			}
+		});
+}
+
+template <typename T>
+static void downsampleBox(const T* src, const glm::int3& n, T* dst)
+{
+	const glm::int3 m = (n + 1) / 2;
+	const float rounding = std::numeric_limits<T>::is_integer ? 0.5f : 0.0f;
+
+	for (int z = 0; z < m.z; z++)
+	{
+		const int z0 = 2 * z, z1 = std::min(z0 + 1, n.z - 1);
+		for (int y = 0; y < m.y; y++)
+		{
+			const int y0 = 2 * y, y1 = std::min(y0 + 1, n.y - 1);
+			const T* r00 = src + ((size_t)z0 * n.y + y0) * n.x;
+			const T* r10 = src + ((size_t)z0 * n.y + y1) * n.x;
+			const T* r01 = src + ((size_t)z1 * n.y + y0) * n.x;
+			const T* r11 = src + ((size_t)z1 * n.y + y1) * n.x;
+			T* output = dst + ((size_t)z * m.y + y) * m.x;
+
+			for (int x = 0; x < m.x; x++)
+			{
+				const int x0 = 2 * x, x1 = std::min(x0 + 1, n.x - 1);
+				const float sum = (float)r00[x0] + (float)r00[x1] + (float)r10[x0] + (float)r10[x1] +
+					(float)r01[x0] + (float)r01[x1] + (float)r11[x0] + (float)r11[x1];
+				output[x] = (T)(sum * 0.125f + rounding);
+			}
+		}
+	}
+}
+
+void VolumeData::downsampleBox(VoxelType voxelType, const DataType* src, const glm::int3& srcSize, DataType* dst)
+{
+	switch (voxelType)
+	{
+	case UInt8: ::downsampleBox<unsigned char>(src, srcSize, dst); break;
+	case UInt16: ::downsampleBox<unsigned short>((const unsigned short*)src, srcSize, (unsigned short*)dst); break;
+	case Float32: ::downsampleBox<float>((const float*)src, srcSize, (float*)dst); break;
+	}
+}
+
+void VolumeData::buildMipLevels(int minLevelSize)
+{
+	TRACE_SCOPE("VolumeData::buildMipLevels");
+	clearMipLevels();
+	if (_data == nullptr && !isStreamed()) return;
+
+	const VolumeData* source = this;
+
+	while (std::max(std::max(source->_nxyz.x, source->_nxyz.y), source->_nxyz.z) > minLevelSize)
+	{
+		const glm::int3 n = (source->_nxyz + 1) / 2;
+		const glm::float3 s = source->_sxyz * 2.0f;
+
+		auto level = new VolumeData;
+		level->init(n.x, n.y, n.z, s.x, s.y, s.z, _voxelType);
+
+		if (source->_layout == Linear)
+		{
+			switch (_voxelType)
+			{
+			case UInt8: downsampleRows<unsigned char>(*source, *level); break;
+			case UInt16: downsampleRows<unsigned short>(*source, *level); break;
+			case Float32: downsampleRows<float>(*source, *level); break;
+			}
+		}
+		else
+		{
+			downsampleTiles(*source, *level);
 		}
+
+		addMipLevel(level);
+		source = level;
 	}
+}
 
-	_mean /= (_nxyz.x * _nxyz.y * _nxyz.z);
+void VolumeData::addMipLevel(VolumeData* level)
+{
+	level->_mean = _mean;
+	level->_std = _std;
+	level->_min = _min;
+	level->_max = _max;
+	_mipLevels.push_back(level);
+}
+
+void VolumeData::clearMipLevels()
+{
+	for (auto level : _mipLevels)
+		delete level;
+	_mipLevels.clear();
+}
+
+int VolumeData::getNumLevels() const
+{
+	return 1 + (int)_mipLevels.size();
+}
+
+VolumeData* VolumeData::getLevel(int level)
+{
+	level = std::min(level, (int)_mipLevels.size());
+	return level <= 0 ? this : _mipLevels[level - 1];
+}
+
+const VolumeData* VolumeData::getLevel(int level) const
+{
+	level = std::min(level, (int)_mipLevels.size());
+	return level <= 0 ? this : _mipLevels[level - 1];
+}
+
+int VolumeData::getFirstInCoreLevel() const
+{
+	int level = 0;
+	while (level + 1 < getNumLevels() && getLevel(level)->isStreamed())
+		level++;
+	return level;
+}
+
+// range of the sub box [begin, begin + size) of a box of boxSize voxels
+template <typename T>
+static glm::float2 computeRange(const VolumeData::DataType* box, const glm::int3& boxSize, const glm::int3& begin, const glm::int3& size)
+{
+	const T* voxels = (const T*)box;
+	T minValue = voxels[((size_t)begin.z * boxSize.y + begin.y) * boxSize.x + begin.x], maxValue = minValue;
+	for (int z = begin.z; z < begin.z + size.z; z++)
+	{
+		for (int y = begin.y; y < begin.y + size.y; y++)
+		{
+			const T* row = voxels + ((size_t)z * boxSize.y + y) * boxSize.x;
+			for (int x = begin.x; x < begin.x + size.x; x++)
+			{
+				minValue = std::min(minValue, row[x]);
+				maxValue = std::max(maxValue, row[x]);
+			}
+		}
+	}
+	return glm::float2((float)minValue, (float)maxValue);
+}
+
+void VolumeData::computeMinMaxGrid()
+{
+	TRACE_SCOPE("VolumeData::computeMinMaxGrid");
+	const glm::int3 gridSize = getMinMaxGridSize();
+	const size_t numCells = getNumMinMaxCells();
+
+	if ((_data == nullptr && !isStreamed()) || numCells == 0 || _minMaxGrid.size() == numCells) return;
+
+	// one task per storage brick : its cells are read with their border in a single box,
+	// so a streamed level is read from the disk brick by brick rather than once per cell
+	const int tileCells = std::max(getBrickSize() / MinMaxBrickSize, 1);
+	const glm::int3 numTiles = (gridSize + tileCells - 1) / tileCells;
+	const size_t numTasks = (size_t)numTiles.x * numTiles.y * numTiles.z;
+
+	std::vector<glm::float2> grid(numCells);
+	const size_t voxelSize = getVoxelSize();
+
+	TaskScheduler::getInstance().parallelFor(numTasks, [&](size_t taskIndex, unsigned int)
+		{
+			const glm::int3 tile((int)(taskIndex % numTiles.x), (int)((taskIndex / numTiles.x) % numTiles.y),
+				(int)(taskIndex / ((size_t)numTiles.x * numTiles.y)));
+			const glm::int3 firstCell = tile * tileCells;
+			const glm::int3 lastCell = glm::min(firstCell + tileCells, gridSize);
+			const glm::int3 boxBegin = glm::max(firstCell * MinMaxBrickSize - 1, glm::int3(0));
+			const glm::int3 boxSize = glm::min(lastCell * MinMaxBrickSize + 1, _nxyz) - boxBegin;
+
+			std::vector<DataType> box((size_t)boxSize.x * boxSize.y * boxSize.z * voxelSize);
+			readBox(boxBegin, boxSize, box.data());
+
+			for (int cz = firstCell.z; cz < lastCell.z; cz++)
+			{
+				for (int cy = firstCell.y; cy < lastCell.y; cy++)
+				{
+					for (int cx = firstCell.x; cx < lastCell.x; cx++)
+					{
+						// widened by the voxel past each face
+						const glm::int3 origin = glm::int3(cx, cy, cz) * MinMaxBrickSize;
+						const glm::int3 begin = glm::max(origin - 1, glm::int3(0));
+						const glm::int3 size = glm::min(origin + MinMaxBrickSize + 1, _nxyz) - begin;
+						glm::float2& range = grid[((size_t)cz * gridSize.y + cy) * gridSize.x + cx];
+
+						switch (_voxelType)
+						{
+						case UInt8: range = computeRange<unsigned char>(box.data(), boxSize, begin - boxBegin, size); break;
+						case UInt16: range = computeRange<unsigned short>(box.data(), boxSize, begin - boxBegin, size); break;
+						case Float32: range = computeRange<float>(box.data(), boxSize, begin - boxBegin, size); break;
+						}
+					}
+				}
+			}
+		});
+
+	_minMaxGrid.swap(grid);
+}
+
+glm::int3 VolumeData::getMinMaxGridSize() const
+{
+	return (_nxyz + MinMaxBrickSize - 1) / MinMaxBrickSize;
+}
+
+size_t VolumeData::getNumMinMaxCells() const
+{
+	const glm::int3 gridSize = getMinMaxGridSize();
+	return (size_t)gridSize.x * gridSize.y * gridSize.z;
+}
+
+template <typename T>
+static void convertBox(const VolumeData::DataType* box, size_t count, float* dst)
+{
+	const T* voxels = (const T*)box;
+	for (size_t i = 0; i < count; i++)
+		dst[i] = (float)voxels[i];
+}
+
+void VolumeData::computeGradients()
+{
+	TRACE_SCOPE("VolumeData::computeGradients");
+	if (_data == nullptr || _gradients.size() == getNumVoxels()) return;
+
+	// gradient of the transfer function coordinate, as the UNORM image and min_max_values make it in the kernel
+	const glm::float2 range = getNormalizedRange();
+	const float densityScale = getNormalizedScale() / (range.y - range.x);
+
+	const glm::int3 numTiles = (_nxyz + GradientTileSize - 1) / GradientTileSize;
+	const size_t numTasks = (size_t)numTiles.x * numTiles.y * numTiles.z;
+	const size_t voxelSize = getVoxelSize();
+
+	// calls visit(offset, gradient) for every voxel of the tile
+	auto forEachGradient = [&](size_t taskIndex, auto&& visit)
+		{
+			const glm::int3 origin = glm::int3((int)(taskIndex % numTiles.x), (int)((taskIndex / numTiles.x) % numTiles.y),
+				(int)(taskIndex / ((size_t)numTiles.x * numTiles.y))) * GradientTileSize;
+			const glm::int3 end = glm::min(origin + GradientTileSize, _nxyz);
+
+			// the tile and the voxels around it
+			const glm::int3 begin = glm::max(origin - 1, glm::int3(0));
+			const glm::int3 size = glm::min(end + 1, _nxyz) - begin;
+			const size_t count = (size_t)size.x * size.y * size.z;
+
+			std::vector<DataType> box(count * voxelSize);
+			std::vector<float> values(count);
+			readBox(begin, size, box.data());
+
+			switch (_voxelType)
+			{
+			case UInt8: convertBox<unsigned char>(box.data(), count, values.data()); break;
+			case UInt16: convertBox<unsigned short>(box.data(), count, values.data()); break;
+			case Float32: convertBox<float>(box.data(), count, values.data()); break;
+			}
+
+			auto value = [&](int x, int y, int z) { return values[((size_t)(z - begin.z) * size.y + (y - begin.y)) * size.x + (x - begin.x)]; };
+
+			for (int z = origin.z; z < end.z; z++)
+			{
+				const int z0 = std::max(z - 1, 0), z1 = std::min(z + 1, _nxyz.z - 1);
+				for (int y = origin.y; y < end.y; y++)
+				{
+					const int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, _nxyz.y - 1);
+					for (int x = origin.x; x < end.x; x++)
+					{
+						// one sided at the edges
+						const int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, _nxyz.x - 1);
+						visit(((size_t)z * _nxyz.y + y) * _nxyz.x + x, densityScale * glm::vec3(
+							x1 > x0 ? (value(x1, y, z) - value(x0, y, z)) / (float)(x1 - x0) : 0.0f,
+							y1 > y0 ? (value(x, y1, z) - value(x, y0, z)) / (float)(y1 - y0) : 0.0f,
+							z1 > z0 ? (value(x, y, z1) - value(x, y, z0)) / (float)(z1 - z0) : 0.0f));
+					}
+				}
+			}
+		};
+
+	// The gradients are computed twice rather than keeping a float magnitude per voxel until their maximum is known :
+	// the peak stays at the 4 bytes per voxel of the result, which is what the gradient budget accounts for.
+	std::vector<float> maxMagnitudes(numTasks, 0.0f);
+
+	TaskScheduler::getInstance().parallelFor(numTasks, [&](size_t taskIndex, unsigned int)
+		{
+			float maxMagnitude = 0.0f;
+			forEachGradient(taskIndex, [&](size_t, const glm::vec3& gradient) { maxMagnitude = std::max(maxMagnitude, glm::length(gradient)); });
+			maxMagnitudes[taskIndex] = maxMagnitude;
+		});
+
+	const float gradientScale = *std::max_element(maxMagnitudes.begin(), maxMagnitudes.end());
+	const float quantization = gradientScale > 0.0f ? 255.0f / gradientScale : 0.0f;
+	std::vector<glm::u8vec4> gradients(getNumVoxels());
+
+	TaskScheduler::getInstance().parallelFor(numTasks, [&](size_t taskIndex, unsigned int)
+		{
+			forEachGradient(taskIndex, [&](size_t offset, const glm::vec3& gradient)
+				{
+					const float magnitude = glm::length(gradient);
+					const glm::vec3 direction = magnitude > 0.0f ? gradient / magnitude : glm::vec3(0.0f);
+
+					gradients[offset] = glm::u8vec4(glm::round((direction * 0.5f + 0.5f) * 255.0f), 0.0f);
+					gradients[offset].w = (unsigned char)std::lround(magnitude * quantization);
+				});
+		});
+
+	_gradients.swap(gradients);
+	_gradientScale = gradientScale;
+}
+
+void VolumeData::clearGradients()
+{
+	_gradients.clear();
+	_gradients.shrink_to_fit();
+	_gradientScale = 0.0f;
+}
+
+bool VolumeData::hasGradients() const
+{
+	return !_gradients.empty();
+}
+
+size_t VolumeData::getGradientDataSize() const
+{
+	return _gradients.size() * sizeof(glm::u8vec4);
+}
+
+void VolumeData::computeHistogram(unsigned int numBins)
+{
+	TRACE_SCOPE("VolumeData::computeHistogram");
+	if (_histogram != nullptr)
+		delete[] _histogram;
 
 	_numBins = numBins;
 	_histogram = new unsigned int[_numBins];
 	memset(_histogram, 0, sizeof(unsigned int) * _numBins);
 
-	float deltaBin = (_max - _min);
+	_mean = _std = _min = _max = 0.0f;
+
+	if ((_data == nullptr && !isStreamed()) || getNumVoxels() == 0) return;
 
-	for (int w = 0; w < _nxyz.z; w++)
+	switch (_voxelType)
 	{
-		const auto* plane = &_data[_nxyz.x * _nxyz.y * w];
+	case UInt8:
+		computeIntegerHistogram<unsigned char>();
+		break;
+	case UInt16:
+		computeIntegerHistogram<unsigned short>();
+		break;
+	case Float32:
+		computeFloatHistogram();
+		break;
+	}
 
-		for (int u = 0; u < _nxyz.y; u++)
+	for (auto level : _mipLevels)
+	{
+		level->_mean = _mean;
+		level->_std = _std;
+		level->_min = _min;
+		level->_max = _max;
+	}
+}
+
+// The bins are 32 bits (as stored in the .bin files), the counts are accumulated on 64 bits :
+// past 2^32 voxels (the background of a multi-gigavoxel volume) a bin saturates instead of wrapping.
+static unsigned int saturateBin(unsigned long long count)
+{
+	return (unsigned int)std::min<unsigned long long>(count, std::numeric_limits<unsigned int>::max());
+}
+
+static void mergeMoments(std::vector<VolumeData::Moments>& workerMoments)
+{
+	// pairwise, the result lands in the first element
+	for (size_t step = 1; step < workerMoments.size(); step *= 2)
+	{
+		for (size_t w = 0; w + step < workerMoments.size(); w += 2 * step)
+			workerMoments[w].merge(workerMoments[w + step]);
+	}
+}
+
+template <typename T>
+void VolumeData::computeIntegerHistogram()
+{
+	// Single pass : every worker counts the raw voxel values of its chunks in a private histogram,
+	// min/max/mean/std and the binned histogram are then derived from the merged counts.
+	const int numValues = 1 << (8 * sizeof(T));
+	const size_t numChunks = getNumChunks();
+
+	// four interleaved sub-histograms break the store to load dependency on runs of equal voxels,
+	// wider types use a single one to stay in cache
+	const int numSubHistograms = sizeof(T) == 1 ? 4 : 1;
+
+	// The 32 bits sub-histograms of a worker are kept across its chunks, and merged into its 64 bits counts once at the end,
+	// or before a bin could wrap : clearing and merging 65536 bins per 32^3 brick would outweigh the counting itself.
+	const size_t maxChunkVoxels = std::max(LinearChunkSize, (size_t)1 << (3 * _brickShift));
+	const size_t maxPendingVoxels = std::numeric_limits<unsigned int>::max() - maxChunkVoxels;
+
+	auto& scheduler = TaskScheduler::getInstance();
+	const unsigned int numWorkers = scheduler.getNumWorkers();
+	std::vector<std::vector<unsigned long long>> workerCounts(numWorkers, std::vector<unsigned long long>(numValues, 0));
+	std::vector<std::vector<unsigned int>> workerScratch(numWorkers, std::vector<unsigned int>(numValues * numSubHistograms, 0));
+	std::vector<size_t> workerPendingVoxels(numWorkers, 0);
+
+	auto mergeScratch = [&](unsigned int workerIndex)
 		{
-			for (int v = 0; v < _nxyz.x; v++)
+			auto& scratch = workerScratch[workerIndex];
+			auto& total = workerCounts[workerIndex];
+			for (int s = 0; s < numSubHistograms; s++)
 			{
-				float value = plane[_nxyz.x * u + v];
-				++_histogram[unsigned int((float)_numBins * (value - _min) / deltaBin)];
-				_std += (value - _mean) * (value - _mean);
+				for (int v = 0; v < numValues; v++)
+					total[v] += scratch[s * numValues + v];
 			}
+			std::fill(scratch.begin(), scratch.end(), 0);
+			workerPendingVoxels[workerIndex] = 0;
+		};
+
+	scheduler.parallelFor(numChunks, [&](size_t chunkIndex, unsigned int workerIndex)
+		{
+			if (workerPendingVoxels[workerIndex] > maxPendingVoxels)
+				mergeScratch(workerIndex);
+
+			unsigned int* counts = workerScratch[workerIndex].data();
+			size_t numCounted = 0;
+
+			forEachRun<T>(chunkIndex, [&](const T* data, size_t count, int, int, int)
+				{
+					numCounted += count;
+					size_t i = 0;
+					if (numSubHistograms == 4)
+					{
+						for (; i + 4 <= count; i += 4)
+						{
+							++counts[data[i]];
+							++counts[numValues + data[i + 1]];
+							++counts[2 * numValues + data[i + 2]];
+							++counts[3 * numValues + data[i + 3]];
+						}
+					}
+					for (; i < count; i++)
+						++counts[data[i]];
+				});
+
+			workerPendingVoxels[workerIndex] += numCounted;
+		});
+
+	for (unsigned int w = 0; w < numWorkers; w++)
+		mergeScratch(w);
+
+	// per worker moments, merged pairwise
+	std::vector<Moments> workerMoments(workerCounts.size());
+	for (size_t w = 0; w < workerCounts.size(); w++)
+	{
+		for (int v = 0; v < numValues; v++)
+		{
+			if (workerCounts[w][v] > 0)
+				workerMoments[w].add(v, (double)workerCounts[w][v]);
 		}
 	}
+	mergeMoments(workerMoments);
+
+	std::vector<unsigned long long> counts(numValues, 0);
+	for (const auto& workerCount : workerCounts)
+	{
+		for (int v = 0; v < numValues; v++)
+			counts[v] += workerCount[v];
+	}
+
+	int minValue = 0, maxValue = numValues - 1;
+	while (counts[minValue] == 0) minValue++;
+	while (counts[maxValue] == 0) maxValue--;
+
+	_min = minValue;
+	_max = maxValue;
+	_mean = workerMoments[0].mean;
+	_std = sqrt(workerMoments[0].m2 / workerMoments[0].count);
+
+	const float deltaBin = (_max - _min);
+
+	for (int v = minValue; v <= maxValue; v++)
+	{
+		const unsigned int bin = deltaBin > 0.0f ? std::min(_numBins - 1, (unsigned int)((float)_numBins * (v - _min) / deltaBin)) : 0;
+		_histogram[bin] = saturateBin(_histogram[bin] + counts[v]);
+	}
+}
+
+void VolumeData::computeFloatHistogram()
+{
+	// Float voxels have no bounded set of values, the range is needed before binning :
+	// a first pass computes min/max and the moments (Welford per worker, merged pairwise), a second one bins.
+	// NaN and infinite voxels (fill values of some scanners) are left out of both, they would spoil the range.
+	const size_t numChunks = getNumChunks();
+
+	auto& scheduler = TaskScheduler::getInstance();
+	const unsigned int numWorkers = scheduler.getNumWorkers();
+
+	std::vector<Moments> workerMoments(numWorkers);
+	std::vector<float> workerMin(numWorkers, std::numeric_limits<float>::max());
+	std::vector<float> workerMax(numWorkers, -std::numeric_limits<float>::max());
+
+	scheduler.parallelFor(numChunks, [&](size_t chunkIndex, unsigned int workerIndex)
+		{
+			// plain sums over the chunk vectorize, the chunks are then merged as moments
+			float chunkMin = workerMin[workerIndex], chunkMax = workerMax[workerIndex];
+			double sum = 0.0;
+			size_t count = 0;
+			forEachRun<float>(chunkIndex, [&](const float* data, size_t runCount, int, int, int)
+				{
+					for (size_t i = 0; i < runCount; i++)
+					{
+						if (!std::isfinite(data[i])) continue;
+						chunkMin = std::min(chunkMin, data[i]);
+						chunkMax = std::max(chunkMax, data[i]);
+						sum += data[i];
+						count++;
+					}
+				});
+
+			if (count == 0) return;
+
+			Moments chunkMoments;
+			chunkMoments.count = (double)count;
+			chunkMoments.mean = sum / count;
+			forEachRun<float>(chunkIndex, [&](const float* data, size_t runCount, int, int, int)
+				{
+					for (size_t i = 0; i < runCount; i++)
+					{
+						if (!std::isfinite(data[i])) continue;
+						const double delta = data[i] - chunkMoments.mean;
+						chunkMoments.m2 += delta * delta;
+					}
+				});
+
+			workerMoments[workerIndex].merge(chunkMoments);
+			workerMin[workerIndex] = chunkMin;
+			workerMax[workerIndex] = chunkMax;
+		});
+
+	mergeMoments(workerMoments);
+	if (workerMoments[0].count == 0.0) return;
+
+	_min = *std::min_element(workerMin.begin(), workerMin.end());
+	_max = *std::max_element(workerMax.begin(), workerMax.end());
+	_mean = workerMoments[0].mean;
+	_std = sqrt(workerMoments[0].m2 / workerMoments[0].count);
+
+	const float scale = _max > _min ? (float)_numBins / (_max - _min) : 0.0f;
+	std::vector<std::vector<unsigned long long>> workerCounts(numWorkers, std::vector<unsigned long long>(_numBins, 0));
+
+	scheduler.parallelFor(numChunks, [&](size_t chunkIndex, unsigned int workerIndex)
+		{
+			auto& counts = workerCounts[workerIndex];
+
+			forEachRun<float>(chunkIndex, [&](const float* data, size_t count, int, int, int)
+				{
+					for (size_t i = 0; i < count; i++)
+					{
+						if (!std::isfinite(data[i])) continue;
+						// clamped before the conversion, the rounding may land a hair outside of [0, _numBins)
+						const float bin = std::min(std::max((data[i] - _min) * scale, 0.0f), (float)(_numBins - 1));
+						++counts[(unsigned int)bin];
+					}
+				});
+		});
+
+	for (const auto& counts : workerCounts)
+	{
+		for (unsigned int b = 0; b < _numBins; b++)
+			_histogram[b] = saturateBin(_histogram[b] + counts[b]);
+	}
+}
 
-	_std = sqrtf(_std / (_nxyz.x * _nxyz.y * _nxyz.z));
+void VolumeData::Moments::add(double value, double weight)
+{
+	// weighted Welford update
+	count += weight;
+	const double delta = value - mean;
+	mean += delta * weight / count;
+	m2 += weight * delta * (value - mean);
+}
+
+void VolumeData::Moments::merge(const Moments& other)
+{
+	if (other.count == 0.0) return;
 
-	qDebug() << _mean << _std << _min << _max;
+	const double total = count + other.count;
+	const double delta = other.mean - mean;
+	mean += delta * other.count / total;
+	m2 += other.m2 + delta * delta * count * other.count / total;
+	count = total;
 }
@@ -4,21 +4,214 @@
 #include <QObject>
 #include <glm/glm.hpp>
 #include <glm/gtx/compatibility.hpp>
+#include <vector>
 
 class VolumeData 
 {
 public:
-	using DataType = unsigned char;
+	using DataType = unsigned char; // storage unit of _data, the voxels themselves are of type _voxelType
+
+	enum VoxelType
+	{
+		UInt8,
+		UInt16,
+		Float32
+	};
+
+	// Linear : x fastest, then y, then z.
+	// Bricked : cubes of 2^_brickShift voxels stored contiguously (linear inside), located by _brickTable,
+	// neighbours along any axis are then mostly in the same pages and cache lines.
+	enum Layout
+	{
+		Linear,
+		Bricked
+	};
+
+	static const int DefaultBrickSize = 32;
+	static const int MinLevelSize = 32; // the pyramid stops once a level fits in MinLevelSize^3
+	static const size_t LinearChunkSize = 1 << 20; // in voxels
+	static const int MinMaxBrickSize = 16; // voxels per side of the cells of the min/max grid
+	static const int GradientTileSize = 32; // voxels per side of the tiles the gradients are computed by
+
+	// count, mean and sum of squared deviations, mergeable across threads (Chan et al.)
+	struct Moments
+	{
+		double count = 0.0, mean = 0.0, m2 = 0.0;
+
+		void add(double value, double weight = 1.0);
+		void merge(const Moments& other);
+	};
+
 	glm::int3 _nxyz;
 	glm::float3 _sxyz;
 	DataType* _data = nullptr;
+	VoxelType _voxelType = UInt8;
+	Layout _layout = Linear;
+	int _brickShift = 0;
+	glm::int3 _numBricks = glm::int3(0);
+	std::vector<size_t> _brickTable; // offset in voxels of every brick in _data, x fastest
 	float _mean, _std, _min, _max;
 	unsigned int* _histogram = nullptr;
 	unsigned int _numBins;
+	// min and max stored values of every MinMaxBrickSize^3 brick (x fastest), widened by the voxel the trilinear
+	// filter reads past each face : what any sample inside of the brick can return.
+	// Empty until computeMinMaxGrid, or read with the levels of a bricked store.
+	std::vector<glm::float2> _minMaxGrid;
+	// gradient of every voxel (linear layout) : direction in xyz mapped from [-1, 1] to [0, 255],
+	// magnitude in w, 255 being _gradientScale. In units of the transfer function coordinate per voxel.
+	// Empty until computeGradients.
+	std::vector<glm::u8vec4> _gradients;
+	float _gradientScale = 0.0f;
 
 	VolumeData();
 	virtual ~VolumeData();
 
-	virtual void init(int nx, int ny, int nz, float sx, float sy, float sz);
+	// clear false leaves the voxels uninitialized, for the loaders about to overwrite all of them
+	virtual void init(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType = UInt8, bool clear = true);
+	// allocates the volume straight in the bricked layout, brickSize must be a power of two
+	void initBricked(int nx, int ny, int nz, float sx, float sy, float sz, VoxelType voxelType, int brickSize = DefaultBrickSize, bool clear = true);
 	virtual void computeHistogram(unsigned int numBins = 1024);
-};
\ No newline at end of file
+
+	// true when the voxels live on disk and only a cache of bricks is in memory (see StreamedVolumeData),
+	// _data is then nullptr and the bricks are only reachable through lockBrick
+	virtual bool isStreamed() const;
+	// true when _data points into a memory mapping of a file (see MappedVolumeData), shared with the other
+	// processes mapping it : a layout conversion would replace it by a private copy
+	virtual bool isMapped() const;
+
+	static size_t getVoxelSize(VoxelType voxelType);
+	size_t getVoxelSize() const;
+	size_t getNumVoxels() const;
+	size_t getDataSize() const; // in bytes, bricks padding included
+	int getBrickSize() const;
+
+	// factor applied to the stored values when they are sampled from a normalized (UNORM) image
+	float getNormalizedScale() const;
+	// normalized values mapped to the ends of the transfer function : the full [0, 1] for 8 bits volumes,
+	// the [_min, _max] range of the data otherwise, 16 bits scanners rarely use more than 12 of them
+	glm::float2 getNormalizedRange() const;
+
+	template <typename T> T* getVoxels() { return (T*)_data; }
+	template <typename T> const T* getVoxels() const { return (const T*)_data; }
+
+	// layout conversions, in place
+	void toBricked(int brickSize = DefaultBrickSize); // brickSize must be a power of two
+	void toLinear();
+	// writes the voxels in the linear layout to dst (getNumVoxels() * getVoxelSize() bytes), whatever the current layout
+	void copyToLinear(DataType* dst) const;
+
+	// bricked layout : index of the brick holding (x, y, z), and offset in voxels of (x, y, z) inside of it
+	size_t getBrickIndex(int x, int y, int z) const
+	{
+		return ((size_t)(z >> _brickShift) * _numBricks.y + (y >> _brickShift)) * _numBricks.x + (x >> _brickShift);
+	}
+
+	glm::int3 getBrickOrigin(size_t brickIndex) const
+	{
+		return glm::int3((int)(brickIndex % _numBricks.x), (int)((brickIndex / _numBricks.x) % _numBricks.y),
+			(int)(brickIndex / ((size_t)_numBricks.x * _numBricks.y))) << _brickShift;
+	}
+
+	size_t getOffsetInBrick(int x, int y, int z) const
+	{
+		const int mask = (1 << _brickShift) - 1;
+		return ((((size_t)(z & mask) << _brickShift) + (y & mask)) << _brickShift) + (x & mask);
+	}
+
+	// offset in voxels of (x, y, z) in _data
+	size_t getVoxelOffset(int x, int y, int z) const
+	{
+		if (_layout == Bricked)
+			return _brickTable[getBrickIndex(x, y, z)] + getOffsetInBrick(x, y, z);
+		return ((size_t)z * _nxyz.y + y) * _nxyz.x + x;
+	}
+
+	template <typename T> T getVoxel(int x, int y, int z) const { return getVoxels<T>()[getVoxelOffset(x, y, z)]; }
+
+	// Bricked layout : the voxels of a brick, kept in memory until the matching unlockBrick.
+	// Thread safe, and the only way to reach the voxels of a streamed volume.
+	virtual const DataType* lockBrick(size_t brickIndex) const;
+	virtual void unlockBrick(size_t brickIndex) const;
+
+	// copies the voxels of the box [origin, origin + size) to dst, x fastest, whatever the layout
+	void readBox(const glm::int3& origin, const glm::int3& size, DataType* dst) const;
+
+	// built in parallel, a streamed volume is then read whole : the bricked stores carry the grids of their levels
+	void computeMinMaxGrid();
+	glm::int3 getMinMaxGridSize() const;
+	size_t getNumMinMaxCells() const;
+
+	// central differences, built in parallel for the volumes in memory
+	void computeGradients();
+	void clearGradients();
+	bool hasGradients() const;
+	size_t getGradientDataSize() const; // in bytes, once built
+
+	// Mip pyramid : level 0 is this volume, every next one halves the dimensions (2x2x2 box filter).
+	// The levels share the statistics of level 0 so that they map onto the transfer function alike.
+	void buildMipLevels(int minLevelSize = MinLevelSize);
+	void addMipLevel(VolumeData* level); // takes ownership
+	void clearMipLevels();
+	int getNumLevels() const;
+	VolumeData* getLevel(int level); // clamped to the coarsest level
+	const VolumeData* getLevel(int level) const;
+	int getFirstInCoreLevel() const; // finest level that is not streamed, the coarsest one when they all are
+
+	// 2x2x2 box filter of a box of srcSize voxels into (srcSize + 1) / 2 voxels, both x fastest,
+	// the last voxel is repeated along the odd dimensions
+	static void downsampleBox(VoxelType voxelType, const DataType* src, const glm::int3& srcSize, DataType* dst);
+
+	// Layout independent traversal for CPU side processing : the voxels are split in chunks
+	// (bricks, or spans of LinearChunkSize voxels) made of contiguous runs along x.
+	// func(const T* run, size_t count, int x, int y, int z) is called for every run of the chunk, (x, y, z) being its first voxel.
+	size_t getNumChunks() const;
+	template <typename T, typename Func> void forEachRun(size_t chunkIndex, Func func) const;
+protected:
+	// takes ownership of data, which replaces _data
+	virtual void replaceData(DataType* data);
+	// bricked layout of the current dimensions, the bricks following each other in _data
+	void setBrickedLayout(int brickSize);
+
+	std::vector<VolumeData*> _mipLevels; // levels 1 and beyond
+
+	template <typename T> void computeIntegerHistogram();
+	void computeFloatHistogram();
+};
+
+template <typename T, typename Func>
+void VolumeData::forEachRun(size_t chunkIndex, Func func) const
+{
+	if (_layout == Bricked)
+	{
+		const int brickSize = getBrickSize();
+		const glm::int3 origin = getBrickOrigin(chunkIndex);
+		const int bx = origin.x, by = origin.y, bz = origin.z;
+		const int ex = std::min(brickSize, _nxyz.x - bx);
+		const int ey = std::min(brickSize, _nxyz.y - by);
+		const int ez = std::min(brickSize, _nxyz.z - bz);
+		const T* brick = (const T*)lockBrick(chunkIndex);
+
+		for (int z = 0; z < ez; z++)
+		{
+			for (int y = 0; y < ey; y++)
+				func(brick + ((size_t)z * brickSize + y) * brickSize, (size_t)ex, bx, by + y, bz + z);
+		}
+		unlockBrick(chunkIndex);
+	}
+	else
+	{
+		// a span may start and end anywhere in a row, the runs are split at the row ends
+		const size_t begin = chunkIndex * LinearChunkSize;
+		const size_t end = std::min(begin + LinearChunkSize, getNumVoxels());
+		size_t offset = begin;
+
+		while (offset < end)
+		{
+			const int x = (int)(offset % _nxyz.x);
+			const size_t row = offset / _nxyz.x;
+			const size_t count = std::min(end - offset, (size_t)(_nxyz.x - x));
+			func(getVoxels<T>() + offset, count, x, (int)(row % _nxyz.y), (int)(row / _nxyz.y));
+			offset += count;
+		}
+	}
+}
@@ -1,23 +1,544 @@
 #include "VolumeDataLoader.h"
+#include "MappedVolumeData.h"
+#include "TaskScheduler.h"
+#include "Tracer.h"
 #include <QFile>
 #include <QDir>
 #include <QDebug>
+#include <algorithm>
+
+static const char binMagic[4] = { 'V', 'V', 'Z', 'B' };
+
+static qint64 alignOffset(qint64 offset)
+{
+	return (offset + AbstractVolumeDataLoader::BinAlignment - 1) / AbstractVolumeDataLoader::BinAlignment * AbstractVolumeDataLoader::BinAlignment;
+}
+
+static void writePadding(QFile& file)
+{
+	const qint64 padding = alignOffset(file.pos()) - file.pos();
+	if (padding > 0)
+		file.write(QByteArray(padding, 0));
+}
+
+// reads the min/max grid of the level at offset, offset is then past it
+static bool readMinMaxGrid(QFile& file, qint64& offset, VolumeData* level)
+{
+	std::vector<glm::float2> grid(level->getNumMinMaxCells());
+	const qint64 gridSize = grid.size() * sizeof(glm::float2);
+	if (!file.seek(offset) || file.read((char*)grid.data(), gridSize) != gridSize)
+	{
+		qDebug() << "Truncated min/max grids" << file.fileName();
+		return false;
+	}
+
+	offset += gridSize;
+	level->_minMaxGrid.swap(grid);
+	return true;
+}
+
+static AbstractVolumeDataLoader::BinHeader makeBinHeader(const VolumeData* vdata, quint32 numLevels)
+{
+	AbstractVolumeDataLoader::BinHeader header = {};
+	memcpy(header.magic, binMagic, sizeof(binMagic));
+	header.version = AbstractVolumeDataLoader::BinVersion;
+	header.headerSize = sizeof(AbstractVolumeDataLoader::BinHeader);
+	header.voxelType = vdata->_voxelType;
+	header.nx = vdata->_nxyz.x;
+	header.ny = vdata->_nxyz.y;
+	header.nz = vdata->_nxyz.z;
+	header.sx = vdata->_sxyz.x;
+	header.sy = vdata->_sxyz.y;
+	header.sz = vdata->_sxyz.z;
+	header.min = vdata->_min;
+	header.max = vdata->_max;
+	header.mean = vdata->_mean;
+	header.std = vdata->_std;
+	header.numBins = vdata->_histogram != nullptr ? vdata->_numBins : 0;
+	header.numLevels = numLevels;
+	header.levelTableOffset = sizeof(AbstractVolumeDataLoader::BinHeader);
+	header.histogramOffset = header.levelTableOffset + sizeof(AbstractVolumeDataLoader::BinLevel) * header.numLevels;
+	return header;
+}
+
+// Fills the bricks of a level in their order and appends them to the file. A batch of bricks is filled
+// in parallel then written, fill(origin, size, dst) writing the voxels of the box [origin, origin + size) to dst, x fastest.
+template <typename Fill>
+static bool writeBricks(QFile& file, const glm::int3& nxyz, int brickShift, size_t voxelSize, Fill fill)
+{
+	const int brickSize = 1 << brickShift;
+	const glm::int3 numBricks = (nxyz + brickSize - 1) / brickSize;
+	const size_t numBricksTotal = (size_t)numBricks.x * numBricks.y * numBricks.z;
+	const size_t brickBytes = ((size_t)1 << (3 * brickShift)) * voxelSize;
+	const size_t batchSize = std::max<size_t>(1, ((size_t)64 << 20) / brickBytes);
+	std::vector<VolumeData::DataType> batch(std::min(batchSize, numBricksTotal) * brickBytes);
+
+	for (size_t first = 0; first < numBricksTotal; first += batchSize)
+	{
+		const size_t count = std::min(batchSize, numBricksTotal - first);
+
+		TaskScheduler::getInstance().parallelFor(count, [&](size_t i, unsigned int)
+			{
+				const size_t brickIndex = first + i;
+				const glm::int3 origin = glm::int3((int)(brickIndex % numBricks.x), (int)((brickIndex / numBricks.x) % numBricks.y),
+					(int)(brickIndex / ((size_t)numBricks.x * numBricks.y))) * brickSize;
+				const glm::int3 extent = glm::min(nxyz - origin, glm::int3(brickSize));
+
+				std::vector<VolumeData::DataType> box((size_t)extent.x * extent.y * extent.z * voxelSize);
+				fill(origin, extent, box.data());
+
+				// the padding is zeroed, the store stays reproducible
+				VolumeData::DataType* brick = batch.data() + i * brickBytes;
+				memset(brick, 0, brickBytes);
+				for (int z = 0; z < extent.z; z++)
+				{
+					for (int y = 0; y < extent.y; y++)
+						memcpy(brick + ((size_t)z * brickSize + y) * brickSize * voxelSize,
+							box.data() + ((size_t)z * extent.y + y) * extent.x * voxelSize, extent.x * voxelSize);
+				}
+			});
+
+		if (file.write((const char*)batch.data(), count * brickBytes) != (qint64)(count * brickBytes))
+			return false;
+	}
+	return true;
+}
 
 void AbstractVolumeDataLoader::saveToBinFormat(const VolumeData* vdata, const QString& path)
 {
+	TRACE_SCOPE("AbstractVolumeDataLoader::saveToBinFormat");
 	if (vdata == nullptr) return;
 	QDir directory(path);
 	directory.mkpath(path);
 	QFile file(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
 	if (file.open(QIODevice::OpenModeFlag::WriteOnly))
 	{
-		file.write((char*)(&vdata->_nxyz), sizeof(vdata->_nxyz));
-		file.write((char*)(&vdata->_sxyz), sizeof(vdata->_sxyz));
-		file.write((char*)vdata->_data, sizeof(VolumeData::DataType) * vdata->_nxyz.x * vdata->_nxyz.y * vdata->_nxyz.z);
-		file.write((char*)&vdata->_min, sizeof(float));
-		file.write((char*)&vdata->_max, sizeof(float));
-		file.write((char*)&vdata->_mean, sizeof(float));
-		file.write((char*)&vdata->_std, sizeof(float));
+		BinHeader header = makeBinHeader(vdata, vdata->getNumLevels());
+
+		// the levels follow each other, each one page aligned
+		std::vector<BinLevel> levels(header.numLevels);
+		qint64 offset = header.histogramOffset + sizeof(unsigned int) * header.numBins;
+		for (quint32 i = 0; i < header.numLevels; i++)
+		{
+			const VolumeData* levelData = vdata->getLevel(i);
+			levels[i].nx = levelData->_nxyz.x;
+			levels[i].ny = levelData->_nxyz.y;
+			levels[i].nz = levelData->_nxyz.z;
+			levels[i].brickShift = 0;
+			levels[i].dataOffset = alignOffset(offset);
+			levels[i].dataSize = levelData->getNumVoxels() * levelData->getVoxelSize(); // always stored linear
+			offset = levels[i].dataOffset + levels[i].dataSize;
+		}
+
+		file.write((char*)&header, sizeof(header));
+		file.write((char*)levels.data(), sizeof(BinLevel) * levels.size());
+		if (header.numBins > 0)
+			file.write((char*)vdata->_histogram, sizeof(unsigned int) * header.numBins);
+
+		for (quint32 i = 0; i < header.numLevels; i++)
+		{
+			const VolumeData* levelData = vdata->getLevel(i);
+			writePadding(file);
+			if (levelData->_layout == VolumeData::Linear)
+			{
+				file.write((char*)levelData->_data, levels[i].dataSize);
+			}
+			else
+			{
+				std::vector<VolumeData::DataType> linearData(levels[i].dataSize);
+				levelData->copyToLinear(linearData.data());
+				file.write((char*)linearData.data(), levels[i].dataSize);
+			}
+		}
 		file.close();
 	}
 }
+
+bool AbstractVolumeDataLoader::saveToBrickedBinFormat(const VolumeData* vdata, const QString& path, int brickSize)
+{
+	TRACE_SCOPE("AbstractVolumeDataLoader::saveToBrickedBinFormat");
+	if (vdata == nullptr) return false;
+
+	int brickShift = 0;
+	while ((1 << brickShift) < brickSize) brickShift++;
+	brickSize = 1 << brickShift;
+
+	// the same levels as buildMipLevels
+	std::vector<glm::int3> levelSizes(1, vdata->_nxyz);
+	while (std::max(std::max(levelSizes.back().x, levelSizes.back().y), levelSizes.back().z) > VolumeData::MinLevelSize)
+		levelSizes.push_back((levelSizes.back() + 1) / 2);
+
+	const size_t voxelSize = vdata->getVoxelSize();
+	const size_t brickBytes = ((size_t)1 << (3 * brickShift)) * voxelSize;
+
+	BinHeader header = makeBinHeader(vdata, (quint32)levelSizes.size());
+	std::vector<BinLevel> levels(header.numLevels);
+	qint64 offset = header.histogramOffset + sizeof(unsigned int) * header.numBins;
+	qint64 totalSize = 0;
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		const glm::int3 numBricks = (levelSizes[i] + brickSize - 1) / brickSize;
+		levels[i].nx = levelSizes[i].x;
+		levels[i].ny = levelSizes[i].y;
+		levels[i].nz = levelSizes[i].z;
+		levels[i].brickShift = brickShift;
+		levels[i].dataOffset = alignOffset(offset);
+		levels[i].dataSize = (quint64)numBricks.x * numBricks.y * numBricks.z * brickBytes;
+		offset = levels[i].dataOffset + levels[i].dataSize;
+		totalSize += levels[i].dataSize;
+	}
+
+	QDir directory(path);
+	directory.mkpath(path);
+	QFile file(directory.absoluteFilePath(QString("%1.bin").arg(directory.dirName())));
+	if (!file.open(QIODevice::OpenModeFlag::WriteOnly))
+		return false;
+
+	file.write((char*)&header, sizeof(header));
+	file.write((char*)levels.data(), sizeof(BinLevel) * levels.size());
+	if (header.numBins > 0)
+		file.write((char*)vdata->_histogram, sizeof(unsigned int) * header.numBins);
+
+	qint64 writtenSize = 0;
+	bool succeeded = true;
+	for (size_t i = 0; i < levels.size() && succeeded && !isCanceled(); i++)
+	{
+		writePadding(file);
+
+		if (i == 0)
+		{
+			succeeded = writeBricks(file, levelSizes[0], brickShift, voxelSize, [&](const glm::int3& origin, const glm::int3& size, VolumeData::DataType* dst)
+				{
+					vdata->readBox(origin, size, dst);
+				});
+		}
+		else
+		{
+			// the previous level is read back from the store through a cache, whatever its size
+			file.flush();
+			StreamedVolumeData source;
+			source.setCacheBudget(_cacheBudget);
+			succeeded = source.open(file.fileName(), levels[i - 1].dataOffset, levelSizes[i - 1].x, levelSizes[i - 1].y, levelSizes[i - 1].z,
+				1.0f, 1.0f, 1.0f, vdata->_voxelType, brickSize);
+
+			succeeded = succeeded && writeBricks(file, levelSizes[i], brickShift, voxelSize, [&](const glm::int3& origin, const glm::int3& size, VolumeData::DataType* dst)
+				{
+					const glm::int3 sourceSize = glm::min(source._nxyz - origin * 2, size * 2);
+					std::vector<VolumeData::DataType> sourceBox((size_t)sourceSize.x * sourceSize.y * sourceSize.z * voxelSize);
+					source.readBox(origin * 2, sourceSize, sourceBox.data());
+					VolumeData::downsampleBox(vdata->_voxelType, sourceBox.data(), sourceSize, dst);
+				});
+		}
+
+		writtenSize += levels[i].dataSize;
+		reportProgress((float)writtenSize / (float)totalSize);
+	}
+
+	// the min/max grids of the levels, read back from the store : opening it never has to scan the streamed levels
+	if (succeeded && !isCanceled())
+	{
+		file.flush();
+		header.minMaxGridOffset = file.pos();
+		for (size_t i = 0; i < levels.size() && succeeded; i++)
+		{
+			std::vector<glm::float2> grid;
+			StreamedVolumeData level;
+			level.setCacheBudget(_cacheBudget);
+			succeeded = level.open(file.fileName(), levels[i].dataOffset, levelSizes[i].x, levelSizes[i].y, levelSizes[i].z,
+				1.0f, 1.0f, 1.0f, vdata->_voxelType, brickSize);
+			if (i == 0 && vdata->_minMaxGrid.size() == level.getNumMinMaxCells())
+				grid = vdata->_minMaxGrid;
+			else if (succeeded)
+			{
+				level.computeMinMaxGrid();
+				grid.swap(level._minMaxGrid);
+			}
+
+			const qint64 gridSize = grid.size() * sizeof(glm::float2);
+			succeeded = succeeded && file.write((const char*)grid.data(), gridSize) == gridSize;
+		}
+
+		// the header points to the grids once they are all written
+		succeeded = succeeded && file.seek(0) && file.write((char*)&header, sizeof(header)) == sizeof(header);
+	}
+	file.close();
+
+	if (!succeeded)
+		qDebug() << "Cannot write the bricked store" << file.fileName();
+	return succeeded && !isCanceled();
+}
+
+void AbstractVolumeDataLoader::setCacheBudget(size_t bytes)
+{
+	_cacheBudget = bytes;
+}
+
+size_t AbstractVolumeDataLoader::getCacheBudget() const
+{
+	return _cacheBudget;
+}
+
+void AbstractVolumeDataLoader::setMemoryMapping(bool enabled)
+{
+	_memoryMapping = enabled;
+}
+
+bool AbstractVolumeDataLoader::isMemoryMapping() const
+{
+	return _memoryMapping;
+}
+
+void AbstractVolumeDataLoader::setProgressCallback(const ProgressCallback& callback)
+{
+	_progressCallback = callback;
+}
+
+void AbstractVolumeDataLoader::setPreviewCallback(const PreviewCallback& callback)
+{
+	_previewCallback = callback;
+}
+
+void AbstractVolumeDataLoader::cancel()
+{
+	_canceled = true;
+}
+
+bool AbstractVolumeDataLoader::isCanceled() const
+{
+	return _canceled;
+}
+
+void AbstractVolumeDataLoader::reportProgress(float progress)
+{
+	if (_progressCallback)
+		_progressCallback(progress);
+}
+
+VolumeData* AbstractVolumeDataLoader::loadFromBinFormat(const QString& filePath)
+{
+	TRACE_SCOPE("AbstractVolumeDataLoader::loadFromBinFormat");
+	QFile file(filePath);
+	if (!file.open(QIODevice::OpenModeFlag::ReadOnly))
+		return nullptr;
+
+	BinHeader header = {};
+	if (file.read((char*)&header, sizeof(header)) != sizeof(header) || memcmp(header.magic, binMagic, sizeof(binMagic)) != 0)
+	{
+		file.seek(0);
+		return loadFromLegacyBinFormat(file);
+	}
+
+	if (header.version > BinVersion || header.voxelType > VolumeData::Float32 || header.numLevels == 0)
+	{
+		qDebug() << "Unsupported .bin file" << filePath << "version" << header.version << "voxel type" << header.voxelType;
+		return nullptr;
+	}
+
+	std::vector<BinLevel> levels(header.numLevels);
+	file.seek(header.levelTableOffset);
+	file.read((char*)levels.data(), sizeof(BinLevel) * levels.size());
+
+	const auto voxelType = (VolumeData::VoxelType)header.voxelType;
+
+	// the coarsest stored level is tiny, it is shown while the full resolution is read or mapped, then prepared
+	if (_previewCallback && levels.size() > 1)
+	{
+		const BinLevel& coarsest = levels.back();
+		const float levelScale = (float)header.nx / (float)coarsest.nx;
+		auto preview = createLevelData(file, coarsest, glm::float3(header.sx, header.sy, header.sz) * levelScale, voxelType);
+		if (preview != nullptr)
+		{
+			preview->_min = header.min;
+			preview->_max = header.max;
+			preview->_mean = header.mean;
+			preview->_std = header.std;
+			_previewCallback(preview);
+		}
+	}
+
+	auto vdata = createLevelData(file, levels[0], glm::float3(header.sx, header.sy, header.sz), voxelType, 0.0f, 0.8f);
+	if (vdata == nullptr) return nullptr;
+
+	// the grids follow each other in the order of the levels, a store without them has its grids built when it is prepared
+	qint64 gridOffset = header.minMaxGridOffset;
+	if (gridOffset != 0 && !readMinMaxGrid(file, gridOffset, vdata))
+		gridOffset = 0;
+
+	vdata->_min = header.min;
+	vdata->_max = header.max;
+	vdata->_mean = header.mean;
+	vdata->_std = header.std;
+
+	if (header.numBins > 0)
+	{
+		// the stored statistics spare a full scan of the volume
+		vdata->_numBins = header.numBins;
+		vdata->_histogram = new unsigned int[vdata->_numBins];
+		file.seek(header.histogramOffset);
+		file.read((char*)vdata->_histogram, sizeof(unsigned int) * vdata->_numBins);
+	}
+	else
+	{
+		vdata->computeHistogram();
+	}
+	reportProgress(0.85f);
+
+	// the stored pyramid, or a new one for the files written before it existed
+	glm::float3 levelSpacing = vdata->_sxyz;
+	for (size_t i = 1; i < levels.size(); i++)
+	{
+		levelSpacing *= 2.0f;
+		auto levelData = createLevelData(file, levels[i], levelSpacing, voxelType);
+		if (levelData == nullptr)
+		{
+			vdata->clearMipLevels();
+			break;
+		}
+		vdata->addMipLevel(levelData);
+
+		if (gridOffset != 0 && !readMinMaxGrid(file, gridOffset, levelData))
+			gridOffset = 0;
+	}
+
+	if (vdata->getNumLevels() == 1 && !isCanceled())
+		vdata->buildMipLevels();
+
+	file.close();
+
+	if (isCanceled())
+	{
+		delete vdata;
+		return nullptr;
+	}
+
+	reportProgress(1.0f);
+	return vdata;
+}
+
+VolumeData* AbstractVolumeDataLoader::loadFromLegacyBinFormat(QFile& file)
+{
+	glm::int3 nxyz;
+	glm::float3 sxyz;
+	file.read((char*)(&nxyz), sizeof(nxyz));
+	file.read((char*)(&sxyz), sizeof(sxyz));
+
+	const qint64 dataOffset = file.pos();
+	const qint64 dataSize = (qint64)nxyz.x * nxyz.y * nxyz.z; // always 8 bits
+
+	auto vdata = createVolumeData(file, dataOffset, dataSize, nxyz, sxyz, VolumeData::UInt8, 0.0f, 0.8f);
+	if (vdata == nullptr) return nullptr;
+
+	file.seek(dataOffset + dataSize);
+	file.read((char*)&vdata->_min, sizeof(float));
+	file.read((char*)&vdata->_max, sizeof(float));
+	file.read((char*)&vdata->_mean, sizeof(float));
+	file.read((char*)&vdata->_std, sizeof(float));
+	vdata->computeHistogram();
+	reportProgress(0.85f);
+	if (!isCanceled())
+		vdata->buildMipLevels();
+
+	file.close();
+
+	if (isCanceled())
+	{
+		delete vdata;
+		return nullptr;
+	}
+
+	reportProgress(1.0f);
+	return vdata;
+}
+
+VolumeData* AbstractVolumeDataLoader::createVolumeData(QFile& file, qint64 offset, qint64 size, const glm::int3& nxyz, const glm::float3& sxyz, VolumeData::VoxelType voxelType,
+	float progressBegin, float progressEnd)
+{
+	if (size != (qint64)VolumeData::getVoxelSize(voxelType) * nxyz.x * nxyz.y * nxyz.z || offset + size > file.size())
+	{
+		qDebug() << "Truncated volume file" << file.fileName();
+		return nullptr;
+	}
+
+	if (_memoryMapping)
+	{
+		auto mappedData = new MappedVolumeData;
+		if (mappedData->map(file.fileName(), offset, nxyz.x, nxyz.y, nxyz.z, sxyz.x, sxyz.y, sxyz.z, voxelType))
+			return mappedData;
+		delete mappedData;
+	}
+
+	auto vdata = new VolumeData;
+	vdata->init(nxyz.x, nxyz.y, nxyz.z, sxyz.x, sxyz.y, sxyz.z, voxelType, false);
+	if (!readVoxels(file, offset, size, vdata->_data, progressBegin, progressEnd))
+	{
+		delete vdata;
+		return nullptr;
+	}
+	return vdata;
+}
+
+VolumeData* AbstractVolumeDataLoader::createLevelData(QFile& file, const BinLevel& level, const glm::float3& sxyz, VolumeData::VoxelType voxelType,
+	float progressBegin, float progressEnd)
+{
+	const glm::int3 nxyz(level.nx, level.ny, level.nz);
+	if (level.brickShift == 0)
+		return createVolumeData(file, level.dataOffset, level.dataSize, nxyz, sxyz, voxelType, progressBegin, progressEnd);
+
+	const int brickSize = 1 << level.brickShift;
+	const glm::int3 numBricks = (nxyz + brickSize - 1) / brickSize;
+	const qint64 size = (qint64)numBricks.x * numBricks.y * numBricks.z * ((qint64)1 << (3 * level.brickShift)) * VolumeData::getVoxelSize(voxelType);
+	if ((qint64)level.dataSize != size || (qint64)level.dataOffset + size > file.size())
+	{
+		qDebug() << "Truncated volume file" << file.fileName();
+		return nullptr;
+	}
+
+	// the large levels stay on disk, their bricks come and go within the budget
+	if ((size_t)size > _cacheBudget / 2)
+	{
+		auto streamedData = new StreamedVolumeData;
+		streamedData->setCacheBudget(_cacheBudget);
+		if (streamedData->open(file.fileName(), level.dataOffset, nxyz.x, nxyz.y, nxyz.z, sxyz.x, sxyz.y, sxyz.z, voxelType, brickSize))
+			return streamedData;
+		delete streamedData;
+		return nullptr;
+	}
+
+	// the bricks are mapped or read as they are, the layout is the one of VolumeData::toBricked
+	if (_memoryMapping)
+	{
+		auto mappedData = new MappedVolumeData;
+		if (mappedData->mapBricked(file.fileName(), level.dataOffset, nxyz.x, nxyz.y, nxyz.z, sxyz.x, sxyz.y, sxyz.z, voxelType, brickSize))
+			return mappedData;
+		delete mappedData;
+	}
+
+	auto vdata = new VolumeData;
+	vdata->initBricked(nxyz.x, nxyz.y, nxyz.z, sxyz.x, sxyz.y, sxyz.z, voxelType, brickSize, false);
+	if (!readVoxels(file, level.dataOffset, size, vdata->_data, progressBegin, progressEnd))
+	{
+		delete vdata;
+		return nullptr;
+	}
+	return vdata;
+}
+
+bool AbstractVolumeDataLoader::readVoxels(QFile& file, qint64 offset, qint64 size, VolumeData::DataType* dst, float progressBegin, float progressEnd)
+{
+	TRACE_SCOPE("AbstractVolumeDataLoader::readVoxels");
+	file.seek(offset);
+
+	// read in slabs to report the progress and give up early when canceled
+	const qint64 slabSize = 64 << 20;
+	for (qint64 position = 0; position < size; position += slabSize)
+	{
+		if (isCanceled())
+			return false;
+
+		file.read((char*)dst + position, std::min(slabSize, size - position));
+
+		if (progressEnd > progressBegin)
+			reportProgress(progressBegin + (progressEnd - progressBegin) * (float)std::min(position + slabSize, size) / (float)size);
+	}
+	return true;
+}
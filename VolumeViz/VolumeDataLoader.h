@@ -1,13 +1,96 @@
 #pragma once
 
 #include <QString>
-#include "VolumeData.h"
+#include <QtGlobal>
+#include <atomic>
+#include <functional>
+#include "StreamedVolumeData.h"
+
+class QFile;
 
 class AbstractVolumeDataLoader
 {
 public:
+	// .bin v3 layout : header, level table, histogram, then the voxels of every level at page aligned offsets
+	// so the payloads can be memory mapped, the bricked stores ending with the min/max grids of their levels. Files without the magic are read as the legacy headerless format.
+	// A level is either linear, or made of full bricks (padded on the far edges) following each other x fastest.
+	struct BinHeader
+	{
+		char magic[4]; // "VVZB"
+		quint32 version;
+		quint32 headerSize;
+		quint32 voxelType; // VolumeData::VoxelType
+		qint32 nx, ny, nz;
+		float sx, sy, sz;
+		float min, max, mean, std;
+		quint32 numBins; // 0 when the histogram was not stored
+		quint32 numLevels; // number of entries of the level table, the full resolution being the first one
+		quint64 histogramOffset;
+		quint64 levelTableOffset;
+		quint64 minMaxGridOffset; // the min/max grids of the levels one after the other (VolumeData::_minMaxGrid), 0 when not stored
+	};
+
+	struct BinLevel
+	{
+		qint32 nx, ny, nz;
+		quint32 brickShift; // 0 for the linear layout, the bricks are 2^brickShift voxels wide otherwise (v3)
+		quint64 dataOffset; // page aligned
+		quint64 dataSize;
+	};
+
+	static const quint32 BinVersion = 3;
+	static const qint64 BinAlignment = 4096;
+
+	using ProgressCallback = std::function<void(float progress)>; // progress in [0, 1]
+	using PreviewCallback = std::function<void(VolumeData* preview)>; // the preview is owned by the callee
+
+	virtual ~AbstractVolumeDataLoader() = default;
+
+	// returns nullptr when the volume cannot be read or the loading was canceled
 	virtual VolumeData* load(const QString& path) = 0;
 
 	virtual void saveToBinFormat(const VolumeData* vdata, const QString& path);
+	// Writes the volume as a bricked store, with a pyramid built brick by brick from the store itself :
+	// the volume can be streamed (or memory mapped), neither the store nor its levels are ever fully in memory.
+	// The progress is reported as the bricks are written.
+	bool saveToBrickedBinFormat(const VolumeData* vdata, const QString& path, int brickSize = VolumeData::DefaultBrickSize);
+
+	// when enabled, the voxels of .bin files are memory mapped instead of being copied
+	void setMemoryMapping(bool enabled);
+	bool isMemoryMapping() const;
+
+	// memory budget of every streamed level, the bricked levels larger than half of it are streamed
+	void setCacheBudget(size_t bytes);
+	size_t getCacheBudget() const;
+
+	// both called from the loading thread
+	void setProgressCallback(const ProgressCallback& callback);
+	void setPreviewCallback(const PreviewCallback& callback);
+
+	// thread safe, load() gives up at its next checkpoint
+	void cancel();
+	bool isCanceled() const;
+protected:
+	void reportProgress(float progress);
+
+	VolumeData* loadFromBinFormat(const QString& filePath);
+	VolumeData* loadFromLegacyBinFormat(QFile& file);
+
+	// maps or reads size bytes of voxels at offset, the reading is reported as progress from progressBegin to progressEnd
+	VolumeData* createVolumeData(QFile& file, qint64 offset, qint64 size, const glm::int3& nxyz, const glm::float3& sxyz, VolumeData::VoxelType voxelType,
+		float progressBegin = 0.0f, float progressEnd = 0.0f);
+	// same for a level of the level table, bricked levels are read or streamed
+	VolumeData* createLevelData(QFile& file, const BinLevel& level, const glm::float3& sxyz, VolumeData::VoxelType voxelType,
+		float progressBegin = 0.0f, float progressEnd = 0.0f);
+	// returns false when the loading was canceled
+	bool readVoxels(QFile& file, qint64 offset, qint64 size, VolumeData::DataType* dst, float progressBegin, float progressEnd);
+
+	bool _memoryMapping = false;
+	size_t _cacheBudget = StreamedVolumeData::DefaultCacheBudget;
+	ProgressCallback _progressCallback;
+	PreviewCallback _previewCallback;
+	std::atomic<bool> _canceled{ false };
 };
 
+static_assert(sizeof(AbstractVolumeDataLoader::BinHeader) == 88, "the .bin header layout must not depend on the compiler");
+static_assert(sizeof(AbstractVolumeDataLoader::BinLevel) == 32, "the .bin level layout must not depend on the compiler");
@@ -0,0 +1,59 @@
+#include "VolumeLoadingTask.h"
+#include <QMetaType>
+
+VolumeLoadingTask::VolumeLoadingTask(AbstractVolumeDataLoader* loader, const QString& path, QObject* parent)
+	: QThread(parent), _loader(loader), _path(path)
+{
+	// queued signals need the argument types to be known to the meta type system
+	qRegisterMetaType<VolumeData*>("VolumeData*");
+
+	_loader->setProgressCallback([this](float progress)
+		{
+			emit progressChanged(progress);
+		});
+
+	_loader->setPreviewCallback([this](VolumeData* preview)
+		{
+			if (_preparation)
+				_preparation(preview);
+			emit previewLoaded(preview);
+		});
+}
+
+VolumeLoadingTask::~VolumeLoadingTask()
+{
+	cancel();
+	wait();
+	delete _loader;
+}
+
+void VolumeLoadingTask::cancel()
+{
+	_loader->cancel();
+}
+
+bool VolumeLoadingTask::isCanceled() const
+{
+	return _loader->isCanceled();
+}
+
+void VolumeLoadingTask::setPreparation(const std::function<void(VolumeData*)>& preparation)
+{
+	_preparation = preparation;
+}
+
+void VolumeLoadingTask::run()
+{
+	auto vdata = _loader->load(_path);
+
+	if (vdata != nullptr && _preparation && !_loader->isCanceled())
+		_preparation(vdata);
+
+	if (vdata != nullptr && _loader->isCanceled())
+	{
+		delete vdata;
+		vdata = nullptr;
+	}
+
+	emit volumeLoaded(vdata);
+}
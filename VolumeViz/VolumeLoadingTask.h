@@ -0,0 +1,35 @@
+#pragma once
+
+#include <QThread>
+#include <QString>
+#include <functional>
+#include "VolumeDataLoader.h"
+
+// Loads a volume on its own thread so the GUI stays responsive.
+// The signals are delivered queued to the receivers living on the GUI thread,
+// the volumes they carry are owned by the receiver.
+class VolumeLoadingTask : public QThread
+{
+	Q_OBJECT
+public:
+	// takes ownership of the loader
+	VolumeLoadingTask(AbstractVolumeDataLoader* loader, const QString& path, QObject* parent = nullptr);
+	~VolumeLoadingTask(); // cancels and waits for the thread
+
+	// the loader gives up at its next checkpoint, volumeLoaded is then emitted with nullptr
+	void cancel();
+	bool isCanceled() const;
+
+	// run on the loading thread on the preview and the volume before they are sent, e.g. to convert their layout
+	void setPreparation(const std::function<void(VolumeData*)>& preparation);
+signals:
+	void progressChanged(float progress); // in [0, 1]
+	void previewLoaded(VolumeData* preview); // a coarse level, sent before the full resolution when available
+	void volumeLoaded(VolumeData* volume); // nullptr when the loading failed or was canceled
+protected:
+	virtual void run() override;
+
+	AbstractVolumeDataLoader* _loader = nullptr;
+	QString _path;
+	std::function<void(VolumeData*)> _preparation;
+};
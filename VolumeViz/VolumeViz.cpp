@@ -1,7 +1,15 @@
 #include "VolumeViz.h"
 #include "OpenCLVolumeRenderer.h"
+#include "CPUVolumeRenderer.h"
 #include "VolumeData.h"
 #include "BasicVolumeDataLoader.h"
+#include "TIFFStackVolumeDataLoader.h"
+#include "RenderSettingsFile.h"
+#include "Tracer.h"
+#include <QDir>
+#include <QFileDialog>
+#include <QMenuBar>
+#include <QStatusBar>
 
 VolumeViz::VolumeViz(QWidget *parent)
 	: QMainWindow(parent)
@@ -17,13 +25,107 @@ VolumeViz::VolumeViz(QWidget *parent)
 
 	_renderWidget->setTransferFunction(ui._tfEditorWidget->getCurveEditorWidget()->getTransferFunction());
 
+	createMenus();
+	createStatusBar();
+
 	show();
 }
 
 VolumeViz::~VolumeViz()
 {
+	// waits for the loading thread
+	if (_loadingTask != nullptr)
+		delete _loadingTask;
+
 	if (_volumeData != nullptr)
 		delete _volumeData;
+
+	if (_previewData != nullptr)
+		delete _previewData;
+}
+
+void VolumeViz::createMenus()
+{
+	auto fileMenu = ui.menuBar->addMenu("File");
+
+	fileMenu->addAction("Open volume...", this, [=]()
+		{
+			auto path = QFileDialog::getExistingDirectory(this, "Open volume");
+			if (!path.isEmpty() && _volumeRenderer != nullptr)
+				loadVolume(path);
+		});
+
+	auto viewMenu = ui.menuBar->addMenu("View");
+
+	auto timingsAction = viewMenu->addAction("Show timings");
+	timingsAction->setCheckable(true);
+	connect(timingsAction, &QAction::toggled, this, [=](bool checked)
+		{
+			_renderWidget->setTimingsOverlayVisible(checked);
+		});
+
+	// OpenCL backend only : the view fills from the center out over a few short frames
+	auto tilesAction = viewMenu->addAction("Progressive tiles");
+	tilesAction->setCheckable(true);
+	connect(tilesAction, &QAction::toggled, this, [=](bool checked)
+		{
+			auto openCLRenderer = dynamic_cast<OpenCLVolumeRenderer*>(_volumeRenderer);
+			if (openCLRenderer != nullptr)
+				openCLRenderer->setTiledDispatch(checked, ProgressiveTilesPerFrame);
+			else if (checked)
+				tilesAction->setChecked(false);
+		});
+
+	auto traceAction = viewMenu->addAction("Record trace");
+	traceAction->setCheckable(true);
+	connect(traceAction, &QAction::toggled, this, [=](bool checked)
+		{
+			if (checked)
+			{
+				Tracer::getInstance().start();
+				return;
+			}
+
+			// discarded when no file is chosen
+			auto path = QFileDialog::getSaveFileName(this, "Save trace", QString(), "Chrome trace (*.json)");
+			Tracer::getInstance().stop(path);
+		});
+
+	auto tfMenu = ui.menuBar->addMenu("Transfer function");
+	auto curveEditor = ui._tfEditorWidget->getCurveEditorWidget();
+
+	tfMenu->addAction("Load...", this, [=]()
+		{
+			auto path = QFileDialog::getOpenFileName(this, "Load transfer function", QString(), "Transfer function (*.json)");
+			TransferFunction transferFunction;
+			if (!path.isEmpty() && RenderSettingsFile::loadTransferFunction(path, transferFunction))
+				curveEditor->setTransferFunction(transferFunction);
+		});
+
+	tfMenu->addAction("Save...", this, [=]()
+		{
+			auto path = QFileDialog::getSaveFileName(this, "Save transfer function", QString(), "Transfer function (*.json)");
+			if (!path.isEmpty())
+				RenderSettingsFile::saveTransferFunction(path, curveEditor->getTransferFunction());
+		});
+}
+
+void VolumeViz::createStatusBar()
+{
+	_loadingProgressBar = new QProgressBar(this);
+	_loadingProgressBar->setRange(0, 100);
+	_loadingProgressBar->setMaximumWidth(200);
+	_loadingProgressBar->hide();
+
+	_cancelLoadingButton = new QPushButton("Cancel", this);
+	_cancelLoadingButton->hide();
+	connect(_cancelLoadingButton, &QPushButton::clicked, this, [=]()
+		{
+			cancelLoading();
+		});
+
+	ui.statusBar->addPermanentWidget(_loadingProgressBar);
+	ui.statusBar->addPermanentWidget(_cancelLoadingButton);
 }
 
 void VolumeViz::paintEvent(QPaintEvent* event)
@@ -37,23 +139,129 @@ void VolumeViz::paintEvent(QPaintEvent* event)
 
 void VolumeViz::initRenderingSystem()
 {
-	_volumeRenderer = new OpenCLVolumeRenderer();
+	// fall back to the native backend on machines without an OpenCL GPU, or when requested
+	if (OpenCLVolumeRenderer::isAvailable() && qgetenv("VOLUMEVIZ_BACKEND") != "cpu")
+		_volumeRenderer = new OpenCLVolumeRenderer();
+	else
+		_volumeRenderer = new CPUVolumeRenderer();
+
 	_volumeRenderer->init();
 
 	_renderWidget->setVolumeRenderer(_volumeRenderer);
+	_volumeRenderer->setTransferFunction(ui._tfEditorWidget->getCurveEditorWidget()->getTransferFunction());
 
-	loadVolume();
+	loadVolume("data/didel");
 }
 
-void VolumeViz::loadVolume()
+void VolumeViz::loadVolume(const QString& path)
 {
-	BasicVolumeDataLoader loader;
-	//_volumeData = loader.load("sample-small");
-	//_volumeData = loader.load("data/cat");
-	_volumeData = loader.load("data/didel");
+	cancelLoading();
 
-	_volumeRenderer->setVolumeData(_volumeData);
-	_volumeRenderer->setTransferFunction(ui._tfEditorWidget->getCurveEditorWidget()->getTransferFunction());
-	ui._tfEditorWidget->getCurveEditorWidget()->setHistogram(_volumeData->_numBins, _volumeData->_histogram);
+	// the .bin cache of a directory is loaded directly, otherwise the directory is read as a TIFF stack
+	QDir directory(path);
+	AbstractVolumeDataLoader* loader = nullptr;
+	if (directory.exists(QString("%1.bin").arg(directory.dirName())))
+		loader = new BasicVolumeDataLoader;
+	else
+		loader = new TIFFStackVolumeDataLoader;
+	loader->setMemoryMapping(true);
+
+	auto task = new VolumeLoadingTask(loader, path, this);
+	_loadingTask = task;
+
+	auto renderer = _volumeRenderer;
+	task->setPreparation([renderer](VolumeData* vdata)
+		{
+			renderer->prepareVolumeData(vdata);
+		});
+
+	// a canceled task may still deliver queued signals, only the current one is listened to
+	connect(task, &VolumeLoadingTask::progressChanged, this, [=](float progress)
+		{
+			if (task == _loadingTask)
+				_loadingProgressBar->setValue((int)(100.0f * progress));
+		});
+
+	connect(task, &VolumeLoadingTask::previewLoaded, this, [=](VolumeData* preview)
+		{
+			if (task == _loadingTask)
+				onPreviewLoaded(preview);
+			else
+				delete preview;
+		});
+
+	connect(task, &VolumeLoadingTask::volumeLoaded, this, [=](VolumeData* volumeData)
+		{
+			if (task == _loadingTask)
+			{
+				_loadingTask = nullptr;
+				onVolumeLoaded(volumeData);
+			}
+			else
+			{
+				delete volumeData;
+			}
+		});
+
+	connect(task, &QThread::finished, task, &QObject::deleteLater);
+
+	_loadingProgressBar->setValue(0);
+	_loadingProgressBar->show();
+	_cancelLoadingButton->show();
+	ui.statusBar->showMessage(QString("Loading %1").arg(path));
+
+	task->start();
+}
+
+void VolumeViz::cancelLoading()
+{
+	if (_loadingTask == nullptr) return;
+
+	// the task deletes itself once its thread is done
+	_loadingTask->cancel();
+	_loadingTask = nullptr;
+
+	_loadingProgressBar->hide();
+	_cancelLoadingButton->hide();
+	ui.statusBar->showMessage("Loading canceled", 3000);
+}
+
+void VolumeViz::onPreviewLoaded(VolumeData* preview)
+{
+	_volumeRenderer->setVolumeData(preview);
+	_volumeRenderer->requestBuffersUpdate();
 	_volumeRenderer->setRenderingStatus(true);
+
+	if (_previewData != nullptr)
+		delete _previewData;
+	_previewData = preview;
+}
+
+void VolumeViz::onVolumeLoaded(VolumeData* volumeData)
+{
+	_loadingProgressBar->hide();
+	_cancelLoadingButton->hide();
+
+	if (volumeData == nullptr)
+	{
+		ui.statusBar->showMessage("The volume could not be loaded", 3000);
+		return;
+	}
+	ui.statusBar->clearMessage();
+
+	// the renderer lets go of the previous volume before it is deleted
+	_volumeRenderer->setVolumeData(volumeData);
+	_volumeRenderer->requestBuffersUpdate();
+	ui._tfEditorWidget->getCurveEditorWidget()->setHistogram(volumeData->_numBins, volumeData->_histogram);
+	_volumeRenderer->setRenderingStatus(true);
+
+	if (_volumeData != nullptr)
+		delete _volumeData;
+	_volumeData = volumeData;
+
+	if (_previewData != nullptr)
+	{
+		delete _previewData;
+		_previewData = nullptr;
+	}
 }
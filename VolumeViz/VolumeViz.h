@@ -5,7 +5,10 @@
 #include "RenderWidget.h"
 #include "VolumeData.h"
 #include "TransferFunctionEditorWidget.h"
+#include "VolumeLoadingTask.h"
 #include <QFocusEvent>
+#include <QProgressBar>
+#include <QPushButton>
 
 class VolumeViz : public QMainWindow
 {
@@ -16,10 +19,21 @@ public:
 protected:
 	virtual void paintEvent(QPaintEvent* event) override;
 	void initRenderingSystem();
-	void loadVolume();
+	// starts loading in the background, a load in progress is canceled
+	void loadVolume(const QString& path);
+	void cancelLoading();
+	void onPreviewLoaded(VolumeData* preview);
+	void onVolumeLoaded(VolumeData* volumeData);
+	void createMenus();
+	void createStatusBar();
 private:
+	static const int ProgressiveTilesPerFrame = 16; // of OpenCLVolumeRenderer::TileSize pixels
 	Ui::VolumeVizClass ui;
 	RenderWidget* _renderWidget = nullptr;
 	AbstractVolumeRenderer* _volumeRenderer = nullptr;
 	VolumeData* _volumeData = nullptr;
+	VolumeData* _previewData = nullptr; // rendered until _volumeData is loaded
+	VolumeLoadingTask* _loadingTask = nullptr;
+	QProgressBar* _loadingProgressBar = nullptr;
+	QPushButton* _cancelLoadingButton = nullptr;
 };
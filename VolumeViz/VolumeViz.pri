@@ -20,7 +20,18 @@ HEADERS += ./VolumeViz.h \
     ./thirdparty/qcustomplot/qcustomplot.h \
     ./CurveEditorWidget.h \
     ./TransparencyWidget.h \
-    ./ColorWidget.h
+    ./ColorWidget.h \
+    ./TaskScheduler.h \
+    ./CPUVolumeRenderer.h \
+    ./OrbitCamera.h \
+    ./RenderSettingsFile.h \
+    ./BatchRenderer.h \
+    ./MappedVolumeData.h \
+    ./VolumeLoadingTask.h \
+    ./RawVolumeDataLoader.h \
+    ./StreamedVolumeData.h \
+    ./OpenCLBrickCache.h \
+    ./Tracer.h
 SOURCES += ./main.cpp \
     ./VolumeViz.cpp \
     ./RenderWidget.cpp \
@@ -35,7 +46,18 @@ SOURCES += ./main.cpp \
     ./thirdparty/qcustomplot/qcustomplot.cpp \
     ./CurveEditorWidget.cpp \
     ./TransparencyWidget.cpp \
-    ./ColorWidget.cpp
+    ./ColorWidget.cpp \
+    ./TaskScheduler.cpp \
+    ./CPUVolumeRenderer.cpp \
+    ./OrbitCamera.cpp \
+    ./RenderSettingsFile.cpp \
+    ./BatchRenderer.cpp \
+    ./MappedVolumeData.cpp \
+    ./VolumeLoadingTask.cpp \
+    ./RawVolumeDataLoader.cpp \
+    ./StreamedVolumeData.cpp \
+    ./OpenCLBrickCache.cpp \
+    ./Tracer.cpp
 FORMS += ./TransferFunctionEditorWidget.ui \
     ./VolumeViz.ui
 RESOURCES += VolumeViz.qrc
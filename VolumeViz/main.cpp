@@ -2,12 +2,34 @@
 #include <QtWidgets/QApplication>
 
 #include "TIFFStackVolumeDataLoader.h"
+#include "BatchRenderer.h"
+#include "Tracer.h"
 
 int main(int argc, char *argv[])
 {
+	// VOLUMEVIZ_TRACE=file records the whole run, the trace is written at exit
+	const QString tracePath = QString::fromLocal8Bit(qgetenv("VOLUMEVIZ_TRACE"));
+	if (!tracePath.isEmpty())
+		Tracer::getInstance().start();
+
+	int exitCode = 0;
+
 	//////////////////////////////////////////////////////////////////////////
-	QApplication a(argc, argv);
-	VolumeViz w;
-	w.show();
-	return a.exec();
+	if (BatchRenderer::isBatchInvocation(argc, argv))
+	{
+		// headless, no display connection is needed
+		QCoreApplication a(argc, argv);
+		exitCode = BatchRenderer::run(a.arguments());
+	}
+	else
+	{
+		QApplication a(argc, argv);
+		VolumeViz w;
+		w.show();
+		exitCode = a.exec();
+	}
+
+	if (Tracer::getInstance().isRecording())
+		Tracer::getInstance().stop(tracePath);
+	return exitCode;
 }